@@ -0,0 +1,418 @@
+/*
+	archive.c :	Append-only pack archives of SMF files, mapped and
+			parsed in parallel without opening each song
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "archive.h"
+#include "parallel.h"
+#include "util.h"
+
+
+#define ARCHIVE_MAGIC "MPAK"
+#define ARCHIVE_VERSION 1
+#define SEGMENT_HEADER_SIZE 16
+#define ENTRY_FIXED_SIZE 36
+#define HASH_SEED_LO 0x4D50414BULL
+#define HASH_SEED_HI 0x6B61704DULL
+
+/*
+	Layout, all integers little-endian:
+		header		"MPAK", version (4), entry count (4), reserved (4),
+				last segment offset (8), reserved (8)
+		per append	file bytes, then a segment: previous segment offset (8),
+				entry count (4), reserved (4), and per entry offset (8),
+				length (8), hash lo (8), hash hi (8), name length (4), name
+*/
+
+typedef struct {
+	char* name;
+	unsigned long long offset;
+	unsigned long long length;
+	Fingerprint hash;
+} PendingEntry;
+
+typedef struct {
+	const Archive* archive;
+	ParserContext** contexts;
+	ArchiveEntryCallback callback;
+	void* arg;
+} ArchiveParseJob;
+
+
+static Fingerprint HashContent(const unsigned char* data, unsigned long long length)
+{
+	Fingerprint hash;
+
+	hash.lo = HashBytes(data, length, HASH_SEED_LO);
+	hash.hi = HashBytes(data, length, HASH_SEED_HI);
+
+	return hash;
+}
+
+
+static void WriteArchiveHeader(FILE* f, unsigned int numEntries, unsigned long long lastSegment)
+{
+	fwrite(ARCHIVE_MAGIC, 1, 4, f);
+	WriteLittleEndian(f, ARCHIVE_VERSION, 4);
+	WriteLittleEndian(f, numEntries, 4);
+	WriteLittleEndian(f, 0, 4);
+	WriteLittleEndian(f, lastSegment, 8);
+	WriteLittleEndian(f, 0, 8);
+}
+
+
+static int ReadFileContents(const char* path, unsigned char** buffer, unsigned long* capacity, unsigned long* length)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+		return 1;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (size < 0) {
+		fclose(f);
+		return 1;
+	}
+
+	if ((unsigned long)size > *capacity) {
+		unsigned char* grown = (unsigned char *)realloc(*buffer, size);
+		if (!grown) {
+			fclose(f);
+			return 1;
+		}
+		*buffer = grown;
+		*capacity = size;
+	}
+
+	int res = fread(*buffer, 1, size, f) == (size_t)size ? 0 : 1;
+	fclose(f);
+	*length = size;
+
+	return res;
+}
+
+
+/*
+	Adds the files to the archive, creating it if needed. Files that
+	cannot be read are skipped. Only the header is written in place.
+*/
+int AppendToArchive(const char* filename, char** paths, unsigned int numPaths, unsigned long long* bytesAdded)
+{
+	unsigned int numEntries = 0;
+	unsigned long long lastSegment = 0;
+	unsigned char header[ARCHIVE_HEADER_SIZE];
+
+	*bytesAdded = 0;
+
+	FILE* f = fopen(filename, "r+b");
+	if (f) {
+		if ((fread(header, 1, sizeof(header), f) != sizeof(header)) ||
+			(memcmp(header, ARCHIVE_MAGIC, 4) != 0) ||
+			(ReadLittleEndian(header + 4, 4) != ARCHIVE_VERSION)) {
+			fclose(f);
+			return 1;
+		}
+		numEntries = ReadLittleEndian(header + 8, 4);
+		lastSegment = ReadLittleEndian(header + 16, 8);
+	}
+	else {
+		f = fopen(filename, "w+b");
+		if (!f)
+			return 1;
+		WriteArchiveHeader(f, 0, 0);
+	}
+
+	/* anything after the last complete segment is a torn append */
+	unsigned long long end = ARCHIVE_HEADER_SIZE;
+	if (lastSegment) {
+		unsigned char segment[SEGMENT_HEADER_SIZE];
+		fseek(f, lastSegment + 8, SEEK_SET);
+		if (fread(segment, 1, 4, f) != 4) {
+			fclose(f);
+			return 1;
+		}
+		unsigned int count = ReadLittleEndian(segment, 4);
+		end = lastSegment + SEGMENT_HEADER_SIZE;
+		for (unsigned int i=0; i < count; i++) {
+			unsigned char fixed[ENTRY_FIXED_SIZE];
+			fseek(f, end, SEEK_SET);
+			if (fread(fixed, 1, sizeof(fixed), f) != sizeof(fixed)) {
+				fclose(f);
+				return 1;
+			}
+			end += ENTRY_FIXED_SIZE + ReadLittleEndian(fixed + 32, 4);
+		}
+	}
+
+	PendingEntry* pending = (PendingEntry *)calloc(numPaths ? numPaths : 1, sizeof(PendingEntry));
+	unsigned char* buffer = NULL;
+	unsigned long capacity = 0;
+	unsigned int numPending = 0;
+	unsigned long long offset = end;
+	int res = pending ? 0 : 1;
+
+	fseek(f, end, SEEK_SET);
+
+	for (unsigned int i=0; (res == 0) && (i < numPaths); i++) {
+		unsigned long length;
+
+		if (ReadFileContents(paths[i], &buffer, &capacity, &length) != 0) {
+			printf("Could not read %s\n", paths[i]);
+			continue;
+		}
+
+		PendingEntry* entry = &pending[numPending++];
+		entry->name = paths[i];
+		entry->offset = offset;
+		entry->length = length;
+		entry->hash = HashContent(buffer, length);
+
+		if (fwrite(buffer, 1, length, f) != length)
+			res = 1;
+		offset += length;
+	}
+
+	if ((res == 0) && numPending) {
+		unsigned long long segmentOffset = offset;
+
+		WriteLittleEndian(f, lastSegment, 8);
+		WriteLittleEndian(f, numPending, 4);
+		WriteLittleEndian(f, 0, 4);
+		for (unsigned int i=0; i < numPending; i++) {
+			unsigned int nameLength = strlen(pending[i].name);
+			WriteLittleEndian(f, pending[i].offset, 8);
+			WriteLittleEndian(f, pending[i].length, 8);
+			WriteLittleEndian(f, pending[i].hash.lo, 8);
+			WriteLittleEndian(f, pending[i].hash.hi, 8);
+			WriteLittleEndian(f, nameLength, 4);
+			fwrite(pending[i].name, 1, nameLength, f);
+		}
+
+		/* the segment must be on disk before the header points at it */
+		if ((fflush(f) != 0) || (fsync(fileno(f)) != 0) || ferror(f))
+			res = 1;
+
+		if (res == 0) {
+			fseek(f, 0, SEEK_SET);
+			WriteArchiveHeader(f, numEntries + numPending, segmentOffset);
+			*bytesAdded = offset - end;
+		}
+	}
+
+	if (ferror(f))
+		res = 1;
+	if (fclose(f) != 0)
+		res = 1;
+
+	free(buffer);
+	free(pending);
+
+	return res;
+}
+
+
+int OpenArchive(Archive* archive, const char* filename)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	memset(archive, 0, sizeof(Archive));
+	if (fd < 0)
+		return 1;
+
+	if ((fstat(fd, &st) != 0) || (st.st_size < ARCHIVE_HEADER_SIZE)) {
+		close(fd);
+		return 1;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 1;
+
+	archive->data = (const unsigned char *)data;
+	archive->size = st.st_size;
+
+	if ((memcmp(archive->data, ARCHIVE_MAGIC, 4) != 0) ||
+		(ReadLittleEndian(archive->data + 4, 4) != ARCHIVE_VERSION)) {
+		CloseArchive(archive);
+		return 1;
+	}
+
+	unsigned int numEntries = ReadLittleEndian(archive->data + 8, 4);
+	unsigned long long segment = ReadLittleEndian(archive->data + 16, 8);
+
+	archive->entries = (ArchiveEntry *)malloc((numEntries ? numEntries : 1) * sizeof(ArchiveEntry));
+	if (!archive->entries) {
+		CloseArchive(archive);
+		return 1;
+	}
+
+	/* segments link backwards, so fill the table from the end */
+	unsigned int remaining = numEntries;
+	while (segment) {
+		if ((segment < ARCHIVE_HEADER_SIZE) || (segment + SEGMENT_HEADER_SIZE > archive->size)) {
+			CloseArchive(archive);
+			return 1;
+		}
+
+		const unsigned char* segmentData = archive->data + segment;
+		unsigned long long previous = ReadLittleEndian(segmentData, 8);
+		unsigned int count = ReadLittleEndian(segmentData + 8, 4);
+		unsigned long long position = segment + SEGMENT_HEADER_SIZE;
+
+		if ((count > remaining) || (previous >= segment)) {
+			CloseArchive(archive);
+			return 1;
+		}
+		remaining -= count;
+
+		for (unsigned int i=0; i < count; i++) {
+			ArchiveEntry* entry = &archive->entries[remaining + i];
+			const unsigned char* fixed = archive->data + position;
+
+			if (position + ENTRY_FIXED_SIZE > archive->size) {
+				CloseArchive(archive);
+				return 1;
+			}
+
+			entry->offset = ReadLittleEndian(fixed, 8);
+			entry->length = ReadLittleEndian(fixed + 8, 8);
+			entry->hash.lo = ReadLittleEndian(fixed + 16, 8);
+			entry->hash.hi = ReadLittleEndian(fixed + 24, 8);
+			entry->nameLength = ReadLittleEndian(fixed + 32, 4);
+			entry->name = (const char *)fixed + ENTRY_FIXED_SIZE;
+			position += ENTRY_FIXED_SIZE + entry->nameLength;
+
+			if ((position > archive->size) || (entry->offset > segment) ||
+				(entry->length > segment - entry->offset)) {
+				CloseArchive(archive);
+				return 1;
+			}
+		}
+
+		segment = previous;
+	}
+
+	if (remaining != 0) {
+		CloseArchive(archive);
+		return 1;
+	}
+	archive->numEntries = numEntries;
+
+	return 0;
+}
+
+
+void CloseArchive(Archive* archive)
+{
+	if (archive->data)
+		munmap((void *)archive->data, archive->size);
+
+	free(archive->entries);
+	memset(archive, 0, sizeof(Archive));
+}
+
+
+/* Index of the most recently added entry with this name, or -1. */
+int FindArchiveEntry(const Archive* archive, const char* name)
+{
+	unsigned long length = strlen(name);
+
+	for (unsigned int i=archive->numEntries; i > 0; i--) {
+		const ArchiveEntry* entry = &archive->entries[i - 1];
+		if ((entry->nameLength == length) && (memcmp(entry->name, name, length) == 0))
+			return i - 1;
+	}
+
+	return -1;
+}
+
+
+int VerifyArchiveEntry(const Archive* archive, unsigned int entry)
+{
+	const ArchiveEntry* item = &archive->entries[entry];
+	Fingerprint hash = HashContent(archive->data + item->offset, item->length);
+
+	return CompareFingerprints(&hash, &item->hash) == 0 ? 0 : 1;
+}
+
+
+/* Writes the entry's original bytes, after checking them against the stored hash. */
+int ExtractArchiveEntry(const Archive* archive, unsigned int entry, const char* filename)
+{
+	const ArchiveEntry* item = &archive->entries[entry];
+
+	if (VerifyArchiveEntry(archive, entry) != 0)
+		return 1;
+
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return 1;
+
+	int res = fwrite(archive->data + item->offset, 1, item->length, f) == item->length ? 0 : 1;
+	if (fclose(f) != 0)
+		res = 1;
+
+	return res;
+}
+
+
+static void ParseArchiveEntry(void* arg, unsigned int index, unsigned int worker)
+{
+	ArchiveParseJob* job = (ArchiveParseJob *)arg;
+	const ArchiveEntry* entry = &job->archive->entries[index];
+	ParserContext* ctx = job->contexts[worker];
+
+	int status = ParseMidiBuffer(ctx, job->archive->data + entry->offset, entry->length);
+
+	job->callback(job->arg, index, ctx, status);
+}
+
+
+/*
+	Parses every entry in place, one ParserContext per worker thread, and
+	hands each result to callback before the context is reused.
+*/
+int ParseArchive(const Archive* archive, unsigned int numThreads, ArchiveEntryCallback callback, void* arg)
+{
+	ArchiveParseJob job;
+
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+
+	job.archive = archive;
+	job.callback = callback;
+	job.arg = arg;
+	job.contexts = (ParserContext **)calloc(numThreads, sizeof(ParserContext *));
+	if (!job.contexts)
+		return 1;
+
+	int res = 0;
+	for (unsigned int i=0; i < numThreads; i++) {
+		job.contexts[i] = CreateParserContext();
+		if (!job.contexts[i])
+			res = 1;
+	}
+
+	if (res == 0)
+		ParallelFor(archive->numEntries, numThreads, ParseArchiveEntry, &job);
+
+	for (unsigned int i=0; i < numThreads; i++) {
+		if (job.contexts[i])
+			FreeParserContext(job.contexts[i]);
+	}
+	free(job.contexts);
+
+	return res;
+}
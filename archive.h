@@ -0,0 +1,50 @@
+#ifndef __ARCHIVE_H__
+#define __ARCHIVE_H__
+
+#include "context.h"
+#include "fingerprint.h"
+
+/*
+	A pack archive stores many SMF files back to back in one file, so a
+	corpus can be read with one open and one mmap instead of one fopen
+	per song. Every append writes the new file bytes followed by an index
+	segment listing them (name, offset, length, 128-bit content hash) and
+	a link to the previous segment, then updates the fixed header to
+	point at the new segment. Existing data is never rewritten, and an
+	interrupted append leaves the previous archive intact.
+
+	Entries are parsed straight from the mapping with ParseMidiBuffer, so
+	event payloads point into the archive while it is open.
+*/
+
+#define ARCHIVE_HEADER_SIZE 32
+
+typedef struct {
+	const char* name;		/* not NUL terminated */
+	unsigned int nameLength;
+	unsigned long long offset;
+	unsigned long long length;
+	Fingerprint hash;
+} ArchiveEntry;
+
+typedef struct {
+	const unsigned char* data;	/* mapped archive */
+	unsigned long size;
+	ArchiveEntry* entries;		/* in the order they were added */
+	unsigned int numEntries;
+} Archive;
+
+/* Called from worker threads; status is 0 if the entry parsed. */
+typedef void (*ArchiveEntryCallback)(void* arg, unsigned int entry, ParserContext* ctx, int status);
+
+
+int AppendToArchive(const char* filename, char** paths, unsigned int numPaths, unsigned long long* bytesAdded);
+int OpenArchive(Archive* archive, const char* filename);
+void CloseArchive(Archive* archive);
+
+int FindArchiveEntry(const Archive* archive, const char* name);
+int VerifyArchiveEntry(const Archive* archive, unsigned int entry);
+int ExtractArchiveEntry(const Archive* archive, unsigned int entry, const char* filename);
+int ParseArchive(const Archive* archive, unsigned int numThreads, ArchiveEntryCallback callback, void* arg);
+
+#endif
@@ -0,0 +1,604 @@
+/*
+	catalog.c :	Persistent metadata index for large MIDI libraries
+*/
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "context.h"
+#include "events.h"
+#include "tempomap.h"
+#include "parallel.h"
+
+
+#define CATALOG_MAGIC "MCAT"
+#define CATALOG_VERSION 2
+
+
+void InitCatalog(Catalog* catalog)
+{
+	memset(catalog, 0, sizeof(Catalog));
+}
+
+
+static void FreeEntry(CatalogEntry* entry)
+{
+	free(entry->path);
+	free(entry->trackNames);
+}
+
+
+void FreeCatalog(Catalog* catalog)
+{
+	for (unsigned int i=0; i < catalog->numEntries; i++)
+		FreeEntry(&catalog->entries[i]);
+
+	free(catalog->entries);
+	InitCatalog(catalog);
+}
+
+
+static CatalogEntry* AppendEntry(Catalog* catalog)
+{
+	if (catalog->numEntries == catalog->capacity) {
+		unsigned int capacity = catalog->capacity ? catalog->capacity * 2 : 256;
+		CatalogEntry* grown = (CatalogEntry *)realloc(catalog->entries, capacity * sizeof(CatalogEntry));
+		if (!grown)
+			return NULL;
+		catalog->entries = grown;
+		catalog->capacity = capacity;
+	}
+
+	CatalogEntry* entry = &catalog->entries[catalog->numEntries++];
+	memset(entry, 0, sizeof(CatalogEntry));
+
+	return entry;
+}
+
+
+/* Serialisation: every field is written little-endian at a fixed width */
+
+static void PutUnsigned(FILE* f, unsigned long long value, unsigned int numBytes)
+{
+	unsigned char bytes[8];
+
+	for (unsigned int i=0; i < numBytes; i++)
+		bytes[i] = (value >> (8 * i)) & 0xFF;
+
+	fwrite(bytes, 1, numBytes, f);
+}
+
+
+static void PutString(FILE* f, const char* string)
+{
+	unsigned long length = string ? strlen(string) : 0;
+
+	PutUnsigned(f, length, 4);
+	if (length)
+		fwrite(string, 1, length, f);
+}
+
+
+typedef struct {
+	const unsigned char* data;
+	unsigned long size;
+	unsigned long offset;
+	int failed;
+} Reader;
+
+
+static unsigned long long GetUnsigned(Reader* reader, unsigned int numBytes)
+{
+	unsigned long long value = 0;
+
+	if (reader->offset + numBytes > reader->size) {
+		reader->failed = 1;
+		return 0;
+	}
+
+	for (unsigned int i=0; i < numBytes; i++)
+		value |= (unsigned long long)reader->data[reader->offset + i] << (8 * i);
+	reader->offset += numBytes;
+
+	return value;
+}
+
+
+static char* GetString(Reader* reader)
+{
+	unsigned long length = GetUnsigned(reader, 4);
+
+	if (reader->failed || (length > reader->size - reader->offset)) {
+		reader->failed = 1;
+		return NULL;
+	}
+
+	char* string = (char *)malloc(length + 1);
+	if (!string) {
+		reader->failed = 1;
+		return NULL;
+	}
+
+	memcpy(string, reader->data + reader->offset, length);
+	string[length] = '\0';
+	reader->offset += length;
+
+	return string;
+}
+
+
+int SaveCatalog(const Catalog* catalog, const char* filename)
+{
+	char temporary[4096];
+	snprintf(temporary, sizeof(temporary), "%s.tmp", filename);
+
+	FILE* f = fopen(temporary, "wb");
+	if (!f)
+		return 1;
+
+	fwrite(CATALOG_MAGIC, 1, 4, f);
+	PutUnsigned(f, CATALOG_VERSION, 4);
+	PutUnsigned(f, catalog->numEntries, 4);
+
+	for (unsigned int i=0; i < catalog->numEntries; i++) {
+		const CatalogEntry* entry = &catalog->entries[i];
+		double seconds = entry->durationSeconds;
+		unsigned long long secondsBits;
+		memcpy(&secondsBits, &seconds, sizeof(secondsBits));
+
+		PutString(f, entry->path);
+		PutUnsigned(f, entry->size, 8);
+		PutUnsigned(f, (unsigned long long)entry->mtime, 8);
+		PutUnsigned(f, (unsigned int)entry->status, 4);
+		PutUnsigned(f, entry->formatType, 2);
+		PutUnsigned(f, entry->numTracks, 2);
+		PutUnsigned(f, entry->timeDivision, 2);
+		PutUnsigned(f, entry->firstTempo, 4);
+		PutUnsigned(f, entry->hasTimeSignature, 1);
+		PutUnsigned(f, entry->timeSignatureNumerator, 1);
+		PutUnsigned(f, entry->timeSignatureDenominator, 1);
+		PutUnsigned(f, entry->hasKeySignature, 1);
+		PutUnsigned(f, (unsigned char)entry->keySignatureSf, 1);
+		PutUnsigned(f, entry->keySignatureMi, 1);
+		PutUnsigned(f, entry->durationTicks, 8);
+		PutUnsigned(f, secondsBits, 8);
+		PutUnsigned(f, entry->numEvents, 4);
+		PutString(f, entry->trackNames);
+	}
+
+	int res = ferror(f) ? 1 : 0;
+	if (fclose(f) != 0)
+		res = 1;
+
+	/* replace the old index only once the new one is complete */
+	if ((res == 0) && (rename(temporary, filename) != 0))
+		res = 1;
+	if (res)
+		remove(temporary);
+
+	return res;
+}
+
+
+/*
+	Appends the entries of an index file. On any failure the catalog is
+	left empty, so a damaged index only costs a full rebuild.
+*/
+int LoadCatalog(Catalog* catalog, const char* filename)
+{
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return 1;
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char* data = (size >= 0) ? (unsigned char *)malloc(size > 0 ? size : 1) : NULL;
+	if (!data) {
+		fclose(f);
+		return 1;
+	}
+
+	size_t numRead = fread(data, 1, size, f);
+	fclose(f);
+
+	Reader reader = {data, numRead, 0, 0};
+
+	if ((numRead < 12) || (memcmp(data, CATALOG_MAGIC, 4) != 0)) {
+		free(data);
+		return 1;
+	}
+
+	reader.offset = 4;
+	if (GetUnsigned(&reader, 4) != CATALOG_VERSION) {
+		free(data);
+		return 1;
+	}
+
+	unsigned int count = GetUnsigned(&reader, 4);
+
+	for (unsigned int i=0; (i < count) && !reader.failed; i++) {
+		CatalogEntry* entry = AppendEntry(catalog);
+		if (!entry) {
+			reader.failed = 1;
+			break;
+		}
+
+		entry->path = GetString(&reader);
+		entry->size = GetUnsigned(&reader, 8);
+		entry->mtime = (long long)GetUnsigned(&reader, 8);
+		entry->status = (int)GetUnsigned(&reader, 4);
+		entry->formatType = GetUnsigned(&reader, 2);
+		entry->numTracks = GetUnsigned(&reader, 2);
+		entry->timeDivision = GetUnsigned(&reader, 2);
+		entry->firstTempo = GetUnsigned(&reader, 4);
+		entry->hasTimeSignature = GetUnsigned(&reader, 1);
+		entry->timeSignatureNumerator = GetUnsigned(&reader, 1);
+		entry->timeSignatureDenominator = GetUnsigned(&reader, 1);
+		entry->hasKeySignature = GetUnsigned(&reader, 1);
+		entry->keySignatureSf = (signed char)GetUnsigned(&reader, 1);
+		entry->keySignatureMi = GetUnsigned(&reader, 1);
+		entry->durationTicks = GetUnsigned(&reader, 8);
+		unsigned long long secondsBits = GetUnsigned(&reader, 8);
+		memcpy(&entry->durationSeconds, &secondsBits, sizeof(double));
+		entry->numEvents = GetUnsigned(&reader, 4);
+		entry->trackNames = GetString(&reader);
+	}
+
+	free(data);
+
+	if (reader.failed) {
+		FreeCatalog(catalog);	/* also leaves it initialised */
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int IsMidiFilename(const char* name)
+{
+	const char* dot = strrchr(name, '.');
+
+	/* ParseMidiFile reads gzip and zstd compressed files as well */
+	if (dot && ((strcasecmp(dot, ".gz") == 0) || (strcasecmp(dot, ".zst") == 0))) {
+		char stem[256];
+		unsigned long length = dot - name;
+		if (length >= sizeof(stem))
+			return 0;
+		memcpy(stem, name, length);
+		stem[length] = '\0';
+		return IsMidiFilename(stem);
+	}
+
+	return dot && ((strcasecmp(dot, ".mid") == 0) || (strcasecmp(dot, ".midi") == 0) || (strcasecmp(dot, ".smf") == 0));
+}
+
+
+static int AppendPath(char*** paths, unsigned int* numPaths, unsigned int* capacity, const char* path)
+{
+	if (*numPaths == *capacity) {
+		unsigned int newCapacity = *capacity ? *capacity * 2 : 1024;
+		char** grown = (char **)realloc(*paths, newCapacity * sizeof(char *));
+		if (!grown)
+			return 1;
+		*paths = grown;
+		*capacity = newCapacity;
+	}
+
+	(*paths)[(*numPaths)++] = strdup(path);
+
+	return 0;
+}
+
+
+/*
+	Appends root if it is a file, or every MIDI file below it if it is a
+	directory. Paths are heap strings owned by the caller.
+*/
+int CollectMidiFiles(const char* root, char*** paths, unsigned int* numPaths, unsigned int* capacity)
+{
+	struct stat st;
+
+	if (stat(root, &st) != 0)
+		return 1;
+
+	if (!S_ISDIR(st.st_mode))
+		return AppendPath(paths, numPaths, capacity, root);
+
+	DIR* dir = opendir(root);
+	if (!dir)
+		return 1;
+
+	struct dirent* item;
+	char path[4096];
+	int res = 0;
+
+	while ((item = readdir(dir)) != NULL) {
+		if (item->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), "%s/%s", root, item->d_name);
+		if (stat(path, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode))
+			res |= CollectMidiFiles(path, paths, numPaths, capacity);
+		else if (IsMidiFilename(item->d_name))
+			res |= AppendPath(paths, numPaths, capacity, path);
+	}
+
+	closedir(dir);
+
+	return res;
+}
+
+
+static char* JoinTrackNames(ParserContext* ctx)
+{
+	unsigned long length = 0;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		Event* name = FindMetaEvent(ContextTrackEvents(ctx, t), ctx->tracks[t].numEvents, 0x03);
+		if (name)
+			length += name->size + 1;
+	}
+
+	char* names = (char *)malloc(length + 1);
+	char* out = names;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		Event* name = FindMetaEvent(ContextTrackEvents(ctx, t), ctx->tracks[t].numEvents, 0x03);
+		if (!name)
+			continue;
+
+		for (unsigned int i=0; i < name->size; i++)
+			*out++ = (name->data[i] == '\n' || name->data[i] == '\0') ? ' ' : name->data[i];
+		*out++ = '\n';
+	}
+	*out = '\0';
+
+	return names;
+}
+
+
+static void FillEntry(CatalogEntry* entry, ParserContext* ctx, TempoMap* map)
+{
+	entry->status = ParseMidiFile(ctx, entry->path);
+	if (entry->status != 0)
+		return;
+
+	FileInfo* info = &ctx->fileInfo;
+	entry->formatType = info->formatType;
+	entry->numTracks = ctx->numTracks;
+	entry->timeDivision = info->timeDivisionType == framesPerSecond ?
+		0x8000 | (info->timeDivision.framesPerSecond.smpteFrames << 8) | info->timeDivision.framesPerSecond.ticksPerFrame :
+		info->timeDivision.ticksPerBeat;
+	entry->numEvents = ctx->numEvents;
+
+	Event* tempo = FindMetaEvent(ctx->events, ctx->numEvents, 0x51);
+	if (tempo && (tempo->size >= 3))
+		entry->firstTempo = (tempo->data[0] << 16) | (tempo->data[1] << 8) | tempo->data[2];
+
+	Event* timeSignature = FindMetaEvent(ctx->events, ctx->numEvents, 0x58);
+	if (timeSignature && (timeSignature->size >= 4)) {
+		struct TimeSignature ts = GetTimeSignature(timeSignature->data);
+		entry->hasTimeSignature = 1;
+		entry->timeSignatureNumerator = ts.numerator;
+		entry->timeSignatureDenominator = ts.denominator;
+	}
+
+	Event* keySignature = FindMetaEvent(ctx->events, ctx->numEvents, 0x59);
+	if (keySignature && (keySignature->size >= 2)) {
+		struct KeySignature ks = GetKeySignature(keySignature->data);
+		entry->hasKeySignature = 1;
+		entry->keySignatureSf = (signed char)ks.sf;
+		entry->keySignatureMi = ks.mi;
+	}
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		unsigned int n = ctx->tracks[t].numEvents;
+		if (n && (ContextTrackTicks(ctx, t)[n - 1] > entry->durationTicks))
+			entry->durationTicks = ContextTrackTicks(ctx, t)[n - 1];
+	}
+
+	if (BuildTempoMap(ctx, map) == 0)
+		entry->durationSeconds = TicksToSeconds(map, entry->durationTicks);
+
+	entry->trackNames = JoinTrackNames(ctx);
+}
+
+
+typedef struct {
+	Catalog* catalog;
+	unsigned int* pending;
+	ParserContext** contexts;
+	TempoMap* maps;
+} RefreshJob;
+
+
+static void RefreshEntry(void* arg, unsigned int index, unsigned int worker)
+{
+	RefreshJob* job = (RefreshJob *)arg;
+	CatalogEntry* entry = &job->catalog->entries[job->pending[index]];
+
+	FillEntry(entry, job->contexts[worker], &job->maps[worker]);
+}
+
+
+static int CompareEntryPaths(const void* a, const void* b)
+{
+	return strcmp(((const CatalogEntry *)a)->path, ((const CatalogEntry *)b)->path);
+}
+
+
+/* nanoseconds, so a rewrite within the same second still counts as a change */
+static long long ModifiedTime(const struct stat* st)
+{
+	return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+
+/*
+	Frees what a failed refresh built. Carried-over entries still belong
+	to the old catalog, so only the pending entries own their strings.
+*/
+static void AbandonRefresh(Catalog* refreshed, const unsigned int* pending, unsigned int numPending)
+{
+	for (unsigned int i=0; i < numPending; i++)
+		FreeEntry(&refreshed->entries[pending[i]]);
+
+	free(refreshed->entries);
+	InitCatalog(refreshed);
+}
+
+
+/*
+	Rebuilds the catalog so it covers exactly the given paths. Entries whose
+	size and mtime are unchanged are carried over without parsing. On
+	failure the old catalog is left as it was.
+*/
+int RefreshCatalog(Catalog* catalog, char** paths, unsigned int numPaths, unsigned int numThreads, unsigned int* numRebuilt)
+{
+	Catalog refreshed;
+	RefreshJob job;
+	unsigned int* pending = (unsigned int *)malloc((numPaths ? numPaths : 1) * sizeof(unsigned int));
+	unsigned int numPending = 0;
+	unsigned char* taken = (unsigned char *)calloc(catalog->numEntries ? catalog->numEntries : 1, 1);
+	int res = 0;
+
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+
+	InitCatalog(&refreshed);
+	job.catalog = &refreshed;
+	job.pending = pending;
+	job.contexts = (ParserContext **)calloc(numThreads, sizeof(ParserContext *));
+	job.maps = (TempoMap *)malloc(numThreads * sizeof(TempoMap));
+
+	if (!pending || !taken || !job.contexts || !job.maps)
+		res = 1;
+
+	for (unsigned int i=0; job.contexts && job.maps && (i < numThreads); i++) {
+		job.contexts[i] = CreateParserContext();
+		InitTempoMap(&job.maps[i]);
+		if (!job.contexts[i])
+			res = 1;
+	}
+
+	qsort(catalog->entries, catalog->numEntries, sizeof(CatalogEntry), CompareEntryPaths);
+
+	for (unsigned int i=0; (res == 0) && (i < numPaths); i++) {
+		struct stat st;
+		if (stat(paths[i], &st) != 0)
+			continue;
+
+		CatalogEntry key;
+		key.path = paths[i];
+		CatalogEntry* old = (CatalogEntry *)bsearch(&key, catalog->entries, catalog->numEntries, sizeof(CatalogEntry), CompareEntryPaths);
+		CatalogEntry* entry = AppendEntry(&refreshed);
+
+		if (!entry) {
+			res = 1;
+			break;
+		}
+
+		if (old && !taken[old - catalog->entries] &&
+			(old->size == (unsigned long long)st.st_size) && (old->mtime == ModifiedTime(&st))) {
+			*entry = *old;
+			taken[old - catalog->entries] = 1;	/* ownership moves to the refreshed catalog */
+			continue;
+		}
+
+		entry->path = strdup(paths[i]);
+		entry->size = st.st_size;
+		entry->mtime = ModifiedTime(&st);
+		pending[numPending++] = refreshed.numEntries - 1;
+
+		if (!entry->path)
+			res = 1;
+	}
+
+	if (res == 0)
+		ParallelFor(numPending, numThreads, RefreshEntry, &job);
+
+	for (unsigned int i=0; job.contexts && job.maps && (i < numThreads); i++) {
+		FreeParserContext(job.contexts[i]);
+		FreeTempoMap(&job.maps[i]);
+	}
+
+	free(job.contexts);
+	free(job.maps);
+
+	if (res != 0) {
+		if (pending)
+			AbandonRefresh(&refreshed, pending, numPending);
+		free(pending);
+		free(taken);
+		return 1;
+	}
+
+	free(pending);
+
+	for (unsigned int i=0; i < catalog->numEntries; i++) {
+		if (taken[i]) {
+			catalog->entries[i].path = NULL;
+			catalog->entries[i].trackNames = NULL;
+		}
+	}
+	free(taken);
+
+	FreeCatalog(catalog);
+	*catalog = refreshed;
+
+	if (numRebuilt)
+		*numRebuilt = numPending;
+
+	return 0;
+}
+
+
+double CatalogEntryTempoBpm(const CatalogEntry* entry)
+{
+	return 60000000.0 / (entry->firstTempo ? entry->firstTempo : 500000);
+}
+
+
+static int ContainsIgnoringCase(const char* haystack, const char* needle)
+{
+	unsigned long needleLength = strlen(needle);
+
+	for (; *haystack; haystack++) {
+		if (strncasecmp(haystack, needle, needleLength) == 0)
+			return 1;
+	}
+
+	return needleLength == 0;
+}
+
+
+int MatchCatalogEntry(const CatalogEntry* entry, const CatalogQuery* query)
+{
+	if (entry->status != 0)
+		return 0;
+
+	if (query->tempoBpm > 0.0) {
+		double difference = CatalogEntryTempoBpm(entry) - query->tempoBpm;
+		if ((difference > query->tempoTolerance) || (-difference > query->tempoTolerance))
+			return 0;
+	}
+
+	if ((query->numTracks >= 0) && (entry->numTracks != query->numTracks))
+		return 0;
+
+	if (query->trackName && !(entry->trackNames && ContainsIgnoringCase(entry->trackNames, query->trackName)))
+		return 0;
+
+	return 1;
+}
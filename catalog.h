@@ -0,0 +1,60 @@
+#ifndef __CATALOG_H__
+#define __CATALOG_H__
+
+/*
+	A catalog is an on-disk index of per-file metadata for a MIDI library,
+	so queries can be answered without opening any .mid files. Refreshing
+	a catalog only re-parses files whose size or mtime changed, and does
+	that in parallel with one ParserContext per worker thread.
+*/
+
+typedef struct {
+	char* path;
+	unsigned long long size;
+	long long mtime;		/* nanoseconds since the epoch */
+	int status;			/* 0 if the file parsed */
+
+	unsigned short formatType;
+	unsigned short numTracks;
+	unsigned short timeDivision;	/* raw MThd division word */
+
+	unsigned long firstTempo;	/* microseconds per quarter note, 0 if none */
+	unsigned char hasTimeSignature;
+	unsigned char timeSignatureNumerator;
+	unsigned char timeSignatureDenominator;	/* as a power of two */
+	unsigned char hasKeySignature;
+	signed char keySignatureSf;
+	unsigned char keySignatureMi;
+
+	unsigned long long durationTicks;
+	double durationSeconds;
+	unsigned int numEvents;
+	char* trackNames;		/* one per line */
+} CatalogEntry;
+
+typedef struct {
+	CatalogEntry* entries;
+	unsigned int numEntries;
+	unsigned int capacity;
+} Catalog;
+
+typedef struct {
+	double tempoBpm;		/* 0 matches any */
+	double tempoTolerance;
+	int numTracks;			/* -1 matches any */
+	const char* trackName;		/* case-insensitive substring, NULL matches any */
+} CatalogQuery;
+
+
+void InitCatalog(Catalog* catalog);
+void FreeCatalog(Catalog* catalog);
+int LoadCatalog(Catalog* catalog, const char* filename);
+int SaveCatalog(const Catalog* catalog, const char* filename);
+
+int CollectMidiFiles(const char* root, char*** paths, unsigned int* numPaths, unsigned int* capacity);
+int RefreshCatalog(Catalog* catalog, char** paths, unsigned int numPaths, unsigned int numThreads, unsigned int* numRebuilt);
+
+double CatalogEntryTempoBpm(const CatalogEntry* entry);
+int MatchCatalogEntry(const CatalogEntry* entry, const CatalogQuery* query);
+
+#endif
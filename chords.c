@@ -0,0 +1,377 @@
+/*
+	chords.c :	Chord labelling from sounding-note bitsets, and writing
+			the labels back out as a marker track
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chords.h"
+#include "writemidi.h"
+
+#define PC(n) (1 << (n))
+#define DRUM_CHANNEL 9
+#define CHORD_NAME_SIZE 16
+
+
+typedef struct {
+	const char* suffix;
+	unsigned short mask;		/* pitch classes relative to the root */
+} ChordTemplate;
+
+static const ChordTemplate templates[] = {
+	{ "",		PC(0) | PC(4) | PC(7) },
+	{ "m",		PC(0) | PC(3) | PC(7) },
+	{ "dim",	PC(0) | PC(3) | PC(6) },
+	{ "aug",	PC(0) | PC(4) | PC(8) },
+	{ "sus2",	PC(0) | PC(2) | PC(7) },
+	{ "sus4",	PC(0) | PC(5) | PC(7) },
+	{ "5",		PC(0) | PC(7) },
+	{ "6",		PC(0) | PC(4) | PC(7) | PC(9) },
+	{ "m6",		PC(0) | PC(3) | PC(7) | PC(9) },
+	{ "7",		PC(0) | PC(4) | PC(7) | PC(10) },
+	{ "maj7",	PC(0) | PC(4) | PC(7) | PC(11) },
+	{ "m7",		PC(0) | PC(3) | PC(7) | PC(10) },
+	{ "mMaj7",	PC(0) | PC(3) | PC(7) | PC(11) },
+	{ "m7b5",	PC(0) | PC(3) | PC(6) | PC(10) },
+	{ "dim7",	PC(0) | PC(3) | PC(6) | PC(9) },
+	{ "7sus4",	PC(0) | PC(5) | PC(7) | PC(10) },
+	{ "add9",	PC(0) | PC(2) | PC(4) | PC(7) },
+	{ "9",		PC(0) | PC(2) | PC(4) | PC(7) | PC(10) },
+	{ "maj9",	PC(0) | PC(2) | PC(4) | PC(7) | PC(11) },
+	{ "m9",		PC(0) | PC(2) | PC(3) | PC(7) | PC(10) },
+};
+
+#define NUM_TEMPLATES (sizeof(templates) / sizeof(templates[0]))
+
+static const char* pitchNames[12] = { "C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab", "A", "Bb", "B" };
+
+
+void InitChordTrack(ChordTrack* chords)
+{
+	memset(chords, 0, sizeof(ChordTrack));
+}
+
+
+void FreeChordTrack(ChordTrack* chords)
+{
+	free(chords->labels);
+	InitChordTrack(chords);
+}
+
+
+/* The 12 keys starting at offset, which may straddle the two words. */
+static unsigned int KeysAt(const NoteSet* set, unsigned int offset)
+{
+	unsigned long long bits;
+
+	if (offset >= 64) {
+		bits = set->hi >> (offset - 64);
+	}
+	else {
+		bits = set->lo >> offset;
+		if (offset > 52)
+			bits |= set->hi << (64 - offset);
+	}
+
+	return bits & 0xFFF;
+}
+
+
+unsigned short PitchClasses(const NoteSet* set)
+{
+	unsigned short classes = 0;
+
+	for (unsigned int offset=0; offset < 128; offset += 12)
+		classes |= KeysAt(set, offset);
+
+	return classes;
+}
+
+
+static int LowestKey(const NoteSet* set)
+{
+	if (set->lo)
+		return __builtin_ctzll(set->lo);
+	if (set->hi)
+		return 64 + __builtin_ctzll(set->hi);
+
+	return -1;
+}
+
+
+/*
+	Returns the best matching template index, chordNone or chordUnknown.
+	Every template tone must sound, except that the fifth may be missing
+	from four and five note chords, and at most one extra tone is allowed.
+	Fuller matches win, and ties go to the root in the bass.
+*/
+unsigned char MatchChord(unsigned short pitchClasses, unsigned char bassClass, unsigned char* root)
+{
+	unsigned char best = chordUnknown;
+	int bestScore = 0;
+
+	*root = bassClass;
+
+	if (!pitchClasses)
+		return chordNone;
+	if (__builtin_popcount(pitchClasses) < 2)
+		return chordUnknown;
+
+	for (unsigned int r=0; r < 12; r++) {
+		if (!(pitchClasses & PC(r)))
+			continue;
+
+		unsigned short rotated = ((pitchClasses >> r) | (pitchClasses << (12 - r))) & 0xFFF;
+
+		for (unsigned int t=0; t < NUM_TEMPLATES; t++) {
+			unsigned short mask = templates[t].mask;
+			unsigned short missing = mask & ~rotated;
+			int numMissing = __builtin_popcount(missing);
+			int numExtra = __builtin_popcount(rotated & ~mask);
+
+			if ((numExtra > 1) || (numMissing > 1))
+				continue;
+			if (missing && ((missing != PC(7)) || (__builtin_popcount(mask) < 4)))
+				continue;
+
+			int score = 4 * __builtin_popcount(mask & rotated) - 3 * numExtra - 2 * numMissing + (r == bassClass);
+			if (score > bestScore) {
+				bestScore = score;
+				best = t;
+				*root = r;
+			}
+		}
+	}
+
+	return best;
+}
+
+
+/* Writes a name such as "F#m7/A" and returns its length. */
+unsigned int FormatChord(const ChordLabel* label, char* out, unsigned int size)
+{
+	if (label->quality == chordNone)
+		return snprintf(out, size, "N");
+	if (label->quality == chordUnknown)
+		return snprintf(out, size, "?");
+
+	unsigned char bassClass = label->bass % 12;
+	if (bassClass == label->root)
+		return snprintf(out, size, "%s%s", pitchNames[label->root], templates[label->quality].suffix);
+
+	return snprintf(out, size, "%s%s/%s", pitchNames[label->root], templates[label->quality].suffix, pitchNames[bassClass]);
+}
+
+
+static int AddLabel(ChordTrack* chords, const ChordLabel* label)
+{
+	if (chords->numLabels == chords->capacity) {
+		unsigned int capacity = chords->capacity ? chords->capacity * 2 : 256;
+		ChordLabel* grown = (ChordLabel *)realloc(chords->labels, capacity * sizeof(ChordLabel));
+		if (!grown)
+			return 1;
+		chords->labels = grown;
+		chords->capacity = capacity;
+	}
+
+	chords->labels[chords->numLabels++] = *label;
+
+	return 0;
+}
+
+
+/*
+	Updates the held counts and sets for one event. Returns 1 if the
+	event's channel now has a different set of sounding keys.
+*/
+static int ApplyNoteEvent(NoteSet* sets, unsigned char held[16][128], const Event* event)
+{
+	if (event->type >= 0xF0)
+		return 0;
+
+	unsigned char channel = event->type & 0x0F;
+	unsigned char status = event->type & 0xF0;
+	unsigned char key = event->data[0];
+	unsigned long long* word = (key < 64) ? &sets[channel].lo : &sets[channel].hi;
+	unsigned long long bit = 1ULL << (key & 63);
+
+	if ((status == 0x90) && (event->data[1] > 0)) {
+		if (held[channel][key] < 255)
+			held[channel][key]++;
+		if (*word & bit)
+			return 0;
+		*word |= bit;
+		return 1;
+	}
+
+	if ((status == 0x80) || (status == 0x90)) {
+		if (!held[channel][key] || --held[channel][key])
+			return 0;
+		*word &= ~bit;
+		return 1;
+	}
+
+	/* All sound off, All notes off and the mode changes that imply it */
+	if ((status == 0xB0) && (key >= 120) && (key != 121) && (key != 122)) {
+		if (!sets[channel].lo && !sets[channel].hi)
+			return 0;
+		memset(held[channel], 0, sizeof(held[channel]));
+		sets[channel].lo = 0;
+		sets[channel].hi = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+	channel is 0-15, or CHORD_ALL_CHANNELS for every channel but drums.
+*/
+int AnalyseChords(ParserContext* ctx, int channel, ChordTrack* chords)
+{
+	NoteSet sets[16];
+	unsigned char held[16][128];
+	unsigned int cursorSpace[64];
+	unsigned int* cursors = cursorSpace;
+	unsigned short analysed = (channel == CHORD_ALL_CHANNELS) ? (0xFFFF & ~PC(DRUM_CHANNEL)) : PC(channel & 0x0F);
+
+	chords->numLabels = 0;
+	chords->numChangePoints = 0;
+
+	if ((ctx->numTracks > 64) && !(cursors = (unsigned int *)malloc(ctx->numTracks * sizeof(unsigned int)))) {
+		ctx->error = "Out of memory";
+		return 1;
+	}
+
+	memset(sets, 0, sizeof(sets));
+	memset(held, 0, sizeof(held));
+	memset(cursors, 0, ctx->numTracks * sizeof(unsigned int));
+
+	for (;;) {
+		/* merge tracks by taking every event at the earliest pending tick */
+		unsigned long tick = 0;
+		int found = 0;
+
+		for (unsigned int t=0; t < ctx->numTracks; t++) {
+			if (cursors[t] < ctx->tracks[t].numEvents) {
+				unsigned long next = ContextTrackTicks(ctx, t)[cursors[t]];
+				if (!found || (next < tick))
+					tick = next;
+				found = 1;
+			}
+		}
+		if (!found)
+			break;
+
+		unsigned short changed = 0;
+		for (unsigned int t=0; t < ctx->numTracks; t++) {
+			Event* events = ContextTrackEvents(ctx, t);
+			unsigned long* ticks = ContextTrackTicks(ctx, t);
+
+			while ((cursors[t] < ctx->tracks[t].numEvents) && (ticks[cursors[t]] == tick)) {
+				Event* event = &events[cursors[t]++];
+				if (ApplyNoteEvent(sets, held, event))
+					changed |= PC(event->type & 0x0F);
+			}
+		}
+
+		if (!(changed & analysed))
+			continue;
+
+		NoteSet sounding = { 0, 0 };
+		for (unsigned int c=0; c < 16; c++) {
+			if (analysed & PC(c)) {
+				sounding.lo |= sets[c].lo;
+				sounding.hi |= sets[c].hi;
+			}
+		}
+
+		ChordLabel label;
+		int bass = LowestKey(&sounding);
+		label.tick = tick;
+		label.pitchClasses = PitchClasses(&sounding);
+		label.bass = (bass < 0) ? 0 : bass;
+		label.quality = MatchChord(label.pitchClasses, label.bass % 12, &label.root);
+		chords->numChangePoints++;
+
+		/* only changes of chord or bass start a new label */
+		ChordLabel* last = chords->numLabels ? &chords->labels[chords->numLabels - 1] : NULL;
+		if (last ? ((last->quality == label.quality) && (last->root == label.root) && (last->bass % 12 == label.bass % 12)) :
+			(label.quality == chordNone))
+			continue;
+
+		if (AddLabel(chords, &label)) {
+			ctx->error = "Out of memory";
+			if (cursors != cursorSpace)
+				free(cursors);
+			return 1;
+		}
+	}
+
+	if (cursors != cursorSpace)
+		free(cursors);
+
+	return 0;
+}
+
+
+/*
+	Writes the song with an extra track holding a track name and one
+	marker per chord label. Format 0 files become format 1.
+*/
+int WriteChordMidiFile(ParserContext* ctx, const ChordTrack* chords, const char* filename)
+{
+	static unsigned char trackName[] = "Chords";
+	Event* events = (Event *)malloc((chords->numLabels + 1) * sizeof(Event));
+	unsigned char* names = (unsigned char *)malloc(chords->numLabels * CHORD_NAME_SIZE + 1);
+	FileInfo fileInfo = ctx->fileInfo;
+	unsigned long previous = 0;
+
+	if (!events || !names) {
+		free(events);
+		free(names);
+		return 1;
+	}
+
+	events[0].time = 0;
+	events[0].type = 0xFF;
+	events[0].subtype = 0x03;
+	events[0].size = sizeof(trackName) - 1;
+	events[0].data = trackName;
+
+	for (unsigned int i=0; i < chords->numLabels; i++) {
+		const ChordLabel* label = &chords->labels[i];
+		Event* event = &events[i + 1];
+		unsigned char* name = names + i * CHORD_NAME_SIZE;
+
+		event->time = label->tick - previous;
+		event->type = 0xFF;
+		event->subtype = 0x06;	/* Marker */
+		event->size = FormatChord(label, (char *)name, CHORD_NAME_SIZE);
+		event->data = name;
+		previous = label->tick;
+	}
+
+	if (fileInfo.formatType == 0)
+		fileInfo.formatType = 1;
+
+	int res = 1;
+	FILE* f = fopen(filename, "wb");
+	if (f) {
+		res = WriteHeaderChunk(f, &fileInfo, ctx->numTracks + 1);
+		for (unsigned int i=0; (res == 0) && (i < ctx->numTracks); i++)
+			res = WriteTrackChunk(f, ContextTrackEvents(ctx, i), ctx->tracks[i].numEvents);
+		if (res == 0)
+			res = WriteTrackChunk(f, events, chords->numLabels + 1);
+		if (fclose(f) != 0)
+			res = 1;
+	}
+
+	free(events);
+	free(names);
+
+	return res;
+}
@@ -0,0 +1,57 @@
+#ifndef __CHORDS_H__
+#define __CHORDS_H__
+
+#include "context.h"
+
+/*
+	Chord labelling from decoded note events. Tracks are merged in tick
+	order while the sounding keys are kept as one 128-bit set per channel.
+	After the last event of each tick the sets being analysed are ORed,
+	folded to 12 pitch classes, and matched against chord templates by
+	rotating the pitch classes to every sounding root and counting the
+	matched, missing and extra tones with popcount. A label is recorded
+	each time the chord changes, so the result reads as a chord track.
+
+	Channel 10 is left out unless it is analysed on its own. Sustain is
+	ignored: a chord lasts as long as its keys are held.
+*/
+
+#define CHORD_ALL_CHANNELS -1
+
+enum ChordQuality {
+	chordNone = 0xFF,		/* nothing sounding */
+	chordUnknown = 0xFE,		/* notes that match no template */
+};
+
+typedef struct {
+	unsigned long long lo;		/* keys 0-63 */
+	unsigned long long hi;		/* keys 64-127 */
+} NoteSet;
+
+typedef struct {
+	unsigned long tick;
+	unsigned short pitchClasses;	/* bit n set if pitch class n sounds */
+	unsigned char root;		/* pitch class */
+	unsigned char bass;		/* lowest sounding key */
+	unsigned char quality;		/* template index, chordNone or chordUnknown */
+} ChordLabel;
+
+typedef struct {
+	ChordLabel* labels;
+	unsigned int numLabels;
+	unsigned int capacity;
+	unsigned long numChangePoints;	/* ticks at which the sounding set was matched */
+} ChordTrack;
+
+
+void InitChordTrack(ChordTrack* chords);
+void FreeChordTrack(ChordTrack* chords);
+
+unsigned short PitchClasses(const NoteSet* set);
+unsigned char MatchChord(unsigned short pitchClasses, unsigned char bassClass, unsigned char* root);
+unsigned int FormatChord(const ChordLabel* label, char* out, unsigned int size);
+
+int AnalyseChords(ParserContext* ctx, int channel, ChordTrack* chords);
+int WriteChordMidiFile(ParserContext* ctx, const ChordTrack* chords, const char* filename);
+
+#endif
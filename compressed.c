@@ -0,0 +1,554 @@
+/*
+	compressed.c :	Streams gzip and zstd compressed MIDI files into the
+			parser, decompressing on a second thread
+*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "compressed.h"
+#include "context.h"
+#include "speculative.h"
+#include "util.h"
+
+#define INPUT_BLOCK_SIZE (64UL << 10)
+#define MIN_OUTPUT_ROOM (4UL << 10)
+#define MAX_SIZE_HINT (1UL << 30)
+
+
+typedef struct {
+	ParserContext* ctx;		/* owner of the buffer, or NULL */
+	FILE* f;
+	enum CompressionType type;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	unsigned char* buffer;
+	unsigned long capacity;
+	unsigned long available;	/* decompressed bytes published so far */
+	int parserBusy;			/* a chunk is being decoded, the buffer may not move */
+	int finished;
+	int cancelled;
+	const char* error;
+} DecompressStream;
+
+
+enum CompressionType DetectCompression(const unsigned char* magic, unsigned long length)
+{
+	if ((length >= 2) && (magic[0] == 0x1F) && (magic[1] == 0x8B))
+		return gzipCompression;
+	if ((length >= 4) && (magic[0] == 0x28) && (magic[1] == 0xB5) && (magic[2] == 0x2F) && (magic[3] == 0xFD))
+		return zstdCompression;
+
+	return noCompression;
+}
+
+
+const char* CompressionName(enum CompressionType type)
+{
+	switch (type) {
+		case gzipCompression: return "gzip";
+		case zstdCompression: return "zstd";
+		default: return "none";
+	}
+}
+
+
+/* Called with the lock held. Waits for the parser to leave the buffer before moving it. */
+static int GrowStream(DecompressStream* stream, unsigned long needed)
+{
+	while (stream->parserBusy && !stream->cancelled)
+		pthread_cond_wait(&stream->changed, &stream->lock);
+
+	unsigned long capacity = stream->capacity ? stream->capacity : DECOMPRESS_STEP;
+	while (capacity < needed)
+		capacity *= 2;
+
+	unsigned char* grown = (unsigned char *)realloc(stream->buffer, capacity);
+	if (!grown)
+		return 1;
+
+	stream->buffer = grown;
+	stream->capacity = capacity;
+	if (stream->ctx) {
+		stream->ctx->buffer = grown;
+		stream->ctx->bufferCapacity = capacity;
+		stream->ctx->numAllocations++;
+	}
+
+	return 0;
+}
+
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/*
+	Space after the published bytes for the decompressor to write into.
+	Only the decompressor moves the buffer, so it stays valid until the
+	next call.
+*/
+static unsigned char* ReserveOutput(DecompressStream* stream, unsigned long* room)
+{
+	unsigned char* out = NULL;
+
+	pthread_mutex_lock(&stream->lock);
+	if ((stream->capacity - stream->available >= MIN_OUTPUT_ROOM) ||
+		(GrowStream(stream, stream->available + DECOMPRESS_STEP) == 0)) {
+		out = stream->buffer + stream->available;
+		*room = stream->capacity - stream->available;
+		if (*room > DECOMPRESS_STEP)
+			*room = DECOMPRESS_STEP;
+	}
+	else {
+		stream->error = "Out of memory";
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	return out;
+}
+
+
+/* Returns 1 when the parser has given up. */
+static int PublishOutput(DecompressStream* stream, unsigned long count)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->available += count;
+	int cancelled = stream->cancelled;
+	pthread_cond_broadcast(&stream->changed);
+	pthread_mutex_unlock(&stream->lock);
+
+	return cancelled;
+}
+#endif
+
+
+#ifdef HAVE_ZLIB
+static const char* InflateGzip(DecompressStream* stream)
+{
+	unsigned char* input = (unsigned char *)malloc(INPUT_BLOCK_SIZE);
+	const char* error = NULL;
+	int status = Z_OK;
+	z_stream z;
+
+	memset(&z, 0, sizeof(z));
+	if (!input || (inflateInit2(&z, 15 + 32) != Z_OK)) {
+		free(input);
+		return "Could not start gzip decompression";
+	}
+
+	for (;;) {
+		if (z.avail_in == 0) {
+			z.next_in = input;
+			z.avail_in = fread(input, 1, INPUT_BLOCK_SIZE, stream->f);
+			if (z.avail_in == 0) {
+				if (status != Z_STREAM_END)
+					error = "Truncated gzip stream";
+				break;
+			}
+		}
+
+		/* concatenated gzip members decompress to one stream */
+		if (status == Z_STREAM_END)
+			inflateReset(&z);
+
+		unsigned long room;
+		unsigned char* out = ReserveOutput(stream, &room);
+		if (!out)
+			break;
+
+		z.next_out = out;
+		z.avail_out = room;
+		status = inflate(&z, Z_NO_FLUSH);
+		if ((status != Z_OK) && (status != Z_STREAM_END) && (status != Z_BUF_ERROR)) {
+			error = "Corrupt gzip stream";
+			break;
+		}
+
+		if (PublishOutput(stream, room - z.avail_out))
+			break;
+	}
+
+	inflateEnd(&z);
+	free(input);
+
+	return error;
+}
+#endif
+
+
+#ifdef HAVE_ZSTD
+static const char* DecompressZstd(DecompressStream* stream)
+{
+	unsigned char* input = (unsigned char *)malloc(INPUT_BLOCK_SIZE);
+	ZSTD_DStream* zstream = ZSTD_createDStream();
+	const char* error = NULL;
+	size_t hint = 1;		/* 0 once the current frame is complete */
+	ZSTD_inBuffer in;
+
+	if (!input || !zstream || ZSTD_isError(ZSTD_initDStream(zstream))) {
+		free(input);
+		ZSTD_freeDStream(zstream);
+		return "Could not start zstd decompression";
+	}
+
+	in.src = input;
+	in.size = 0;
+	in.pos = 0;
+
+	for (;;) {
+		if (in.pos == in.size) {
+			in.size = fread(input, 1, INPUT_BLOCK_SIZE, stream->f);
+			in.pos = 0;
+			if (in.size == 0) {
+				if (hint != 0)
+					error = "Truncated zstd stream";
+				break;
+			}
+		}
+
+		unsigned long room;
+		unsigned char* out = ReserveOutput(stream, &room);
+		if (!out)
+			break;
+
+		ZSTD_outBuffer output;
+		output.dst = out;
+		output.size = room;
+		output.pos = 0;
+
+		hint = ZSTD_decompressStream(zstream, &output, &in);
+		if (ZSTD_isError(hint)) {
+			error = "Corrupt zstd stream";
+			break;
+		}
+
+		if (PublishOutput(stream, output.pos))
+			break;
+	}
+
+	ZSTD_freeDStream(zstream);
+	free(input);
+
+	return error;
+}
+#endif
+
+
+static void* RunDecompressor(void* arg)
+{
+	DecompressStream* stream = (DecompressStream *)arg;
+	const char* error = "Compression format not supported by this build";
+
+#ifdef HAVE_ZLIB
+	if (stream->type == gzipCompression)
+		error = InflateGzip(stream);
+#endif
+#ifdef HAVE_ZSTD
+	if (stream->type == zstdCompression)
+		error = DecompressZstd(stream);
+#endif
+
+	pthread_mutex_lock(&stream->lock);
+	if (error && !stream->error)
+		stream->error = error;
+	stream->finished = 1;
+	pthread_cond_broadcast(&stream->changed);
+	pthread_mutex_unlock(&stream->lock);
+
+	return NULL;
+}
+
+
+static int IsSupported(enum CompressionType type)
+{
+#ifdef HAVE_ZLIB
+	if (type == gzipCompression)
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	if (type == zstdCompression)
+		return 1;
+#endif
+
+	return 0;
+}
+
+
+/* Decompressed size recorded in the stream, or 0 if it is not known. */
+static unsigned long SizeHint(FILE* f, enum CompressionType type)
+{
+	unsigned char bytes[18];
+	unsigned long hint = 0;
+
+	if (type == gzipCompression) {
+		/* ISIZE, the last member's size modulo 2^32 */
+		if ((fseek(f, -4, SEEK_END) == 0) && (fread(bytes, 1, 4, f) == 4))
+			hint = ReadLittleEndian(bytes, 4);
+	}
+#ifdef HAVE_ZSTD
+	else if (type == zstdCompression) {
+		size_t numRead = fread(bytes, 1, sizeof(bytes), f);
+		unsigned long long size = ZSTD_getFrameContentSize(bytes, numRead);
+		if ((size != ZSTD_CONTENTSIZE_UNKNOWN) && (size != ZSTD_CONTENTSIZE_ERROR))
+			hint = size;
+	}
+#endif
+
+	fseek(f, 0, SEEK_SET);
+
+	return hint < MAX_SIZE_HINT ? hint : MAX_SIZE_HINT;
+}
+
+
+static void InitStream(DecompressStream* stream, ParserContext* ctx, FILE* f, enum CompressionType type)
+{
+	memset(stream, 0, sizeof(DecompressStream));
+	stream->ctx = ctx;
+	stream->f = f;
+	stream->type = type;
+	pthread_mutex_init(&stream->lock, NULL);
+	pthread_cond_init(&stream->changed, NULL);
+
+	if (ctx) {
+		stream->buffer = ctx->buffer;
+		stream->capacity = ctx->bufferCapacity;
+	}
+
+	unsigned long hint = SizeHint(f, type);
+	if (hint > stream->capacity)
+		GrowStream(stream, hint);
+}
+
+
+static void DestroyStream(DecompressStream* stream)
+{
+	pthread_cond_destroy(&stream->changed);
+	pthread_mutex_destroy(&stream->lock);
+}
+
+
+/* Called with the lock held, before the parser touches the buffer. */
+static void FollowBuffer(ParserContext* ctx, DecompressStream* stream, const unsigned char** base)
+{
+	if (stream->buffer != *base) {
+		if (*base)
+			RebaseParserContext(ctx, *base, stream->available, stream->buffer);
+		*base = stream->buffer;
+		ctx->data = *base;
+	}
+}
+
+
+/*
+	Decodes a track while its body is still being decompressed, waiting
+	only when the next event runs past the bytes published so far. Called
+	and returns with the lock held.
+*/
+static int StreamTrackChunk(ParserContext* ctx, DecompressStream* stream, const unsigned char** base, unsigned long offset, unsigned long length)
+{
+	TrackDecoder decoder;
+	unsigned long decoded = 0;	/* body bytes available at the last decode */
+	int res;
+
+	FollowBuffer(ctx, stream, base);
+	res = BeginTrackChunk(ctx, *base + offset, length, &decoder);
+
+	while ((res == 0) && !decoder.ended) {
+		while (!stream->finished && (stream->available - offset - 8 <= decoded))
+			pthread_cond_wait(&stream->changed, &stream->lock);
+
+		unsigned long available = stream->available - offset - 8;
+		if (available > length)
+			available = length;
+
+		if (stream->error)
+			return 1;
+		if (available <= decoded) {
+			ctx->error = "Chunk runs past end of file";
+			return 1;
+		}
+
+		FollowBuffer(ctx, stream, base);
+		stream->parserBusy = 1;
+		pthread_mutex_unlock(&stream->lock);
+
+		res = DecodeTrackBytes(ctx, &decoder, available);
+
+		pthread_mutex_lock(&stream->lock);
+		stream->parserBusy = 0;
+		pthread_cond_broadcast(&stream->changed);
+		decoded = available;
+	}
+
+	return res;
+}
+
+
+/*
+	Parses a compressed file whose magic bytes have been read. Track
+	events are decoded as soon as their bytes have been decompressed, and
+	other chunks once all of them have.
+*/
+int ParseCompressedMidi(ParserContext* ctx, FILE* f, enum CompressionType type)
+{
+	DecompressStream stream;
+	pthread_t thread;
+
+	if (!IsSupported(type)) {
+		ctx->error = "Compression format not supported by this build";
+		return 1;
+	}
+
+	ResetParserContext(ctx);
+	InitStream(&stream, ctx, f, type);
+	if (pthread_create(&thread, NULL, RunDecompressor, &stream) != 0) {
+		DestroyStream(&stream);
+		ctx->error = "Could not start decompression thread";
+		return 1;
+	}
+
+	const unsigned char* base = NULL;
+	unsigned long offset = 0;
+	int res = 0;
+
+	pthread_mutex_lock(&stream.lock);
+	for (;;) {
+		unsigned long needed = offset + 8;
+		unsigned long length = 0;
+
+		while (!stream.finished && (stream.available < needed))
+			pthread_cond_wait(&stream.changed, &stream.lock);
+
+		if (stream.error) {
+			ctx->error = stream.error;
+			res = 1;
+			break;
+		}
+		if (stream.available < needed)
+			break;
+
+		const unsigned char* header = stream.buffer + offset;
+		length = ((unsigned long)header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+		needed += length;
+
+		/* large tracks that are decoded speculatively need all their bytes */
+		int streamTrack = (memcmp(header, "MTrk", 4) == 0) && ctx->hasHeader &&
+			!((ctx->decodeThreads > 1) && (length >= 2 * SPECULATIVE_SEGMENT_SIZE));
+
+		if (streamTrack) {
+			res = StreamTrackChunk(ctx, &stream, &base, offset, length);
+			if (res) {
+				if (stream.error)
+					ctx->error = stream.error;
+				break;
+			}
+		}
+		else {
+			while (!stream.finished && (stream.available < needed))
+				pthread_cond_wait(&stream.changed, &stream.lock);
+
+			if (stream.error) {
+				ctx->error = stream.error;
+				res = 1;
+				break;
+			}
+			if (stream.available < needed) {
+				ctx->error = "Chunk runs past end of file";
+				res = 1;
+				break;
+			}
+
+			FollowBuffer(ctx, &stream, &base);
+			stream.parserBusy = 1;
+			pthread_mutex_unlock(&stream.lock);
+
+			res = ParseMidiChunk(ctx, base + offset, length);
+
+			pthread_mutex_lock(&stream.lock);
+			stream.parserBusy = 0;
+			pthread_cond_broadcast(&stream.changed);
+			if (res)
+				break;
+		}
+
+		offset = needed;
+	}
+
+	stream.cancelled = 1;
+	pthread_cond_broadcast(&stream.changed);
+	pthread_mutex_unlock(&stream.lock);
+	pthread_join(thread, NULL);
+
+	/* the decompressor may have moved the buffer after the last chunk */
+	if (base && (stream.buffer != base))
+		RebaseParserContext(ctx, base, stream.available, stream.buffer);
+
+	ctx->data = stream.buffer;
+	ctx->size = stream.available;
+	DestroyStream(&stream);
+
+	if ((res == 0) && !ctx->hasHeader) {
+		ctx->error = "Missing MThd header";
+		res = 1;
+	}
+
+	return res;
+}
+
+
+/*
+	Reads a whole file into a new buffer, decompressing it first if it is
+	compressed. The caller frees *data.
+*/
+int ReadCompressedFile(const char* filename, unsigned char** data, unsigned long* size)
+{
+	DecompressStream stream;
+	unsigned char magic[4];
+
+	FILE* f = fopen(filename, "rb");
+	if (!f)
+		return 1;
+
+	enum CompressionType type = DetectCompression(magic, fread(magic, 1, sizeof(magic), f));
+	fseek(f, 0, SEEK_SET);
+
+	if (type == noCompression) {
+		fseek(f, 0, SEEK_END);
+		long length = ftell(f);
+		fseek(f, 0, SEEK_SET);
+
+		*data = (unsigned char *)malloc(length > 0 ? length : 1);
+		int res = (length < 0) || !*data || (fread(*data, 1, length, f) != (size_t)length);
+		fclose(f);
+		*size = length;
+		return res;
+	}
+
+	if (!IsSupported(type)) {
+		fclose(f);
+		return 1;
+	}
+
+	InitStream(&stream, NULL, f, type);
+	RunDecompressor(&stream);
+	fclose(f);
+
+	int res = stream.error ? 1 : 0;
+	if (res)
+		free(stream.buffer);
+	else {
+		*data = stream.buffer;
+		*size = stream.available;
+	}
+	DestroyStream(&stream);
+
+	return res;
+}
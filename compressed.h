@@ -0,0 +1,36 @@
+#ifndef __COMPRESSED_H__
+#define __COMPRESSED_H__
+
+#include <stdio.h>
+
+#include "context.h"
+
+/*
+	Reading gzip and zstd compressed MIDI files without a temporary file.
+	A decompressor thread inflates straight into the context's buffer
+	while the calling thread decodes track events as soon as their bytes
+	have arrived, so the two stages overlap even within a single track.
+	When the buffer has to grow, the decompressor waits until the parser
+	is not decoding, moves it, and the parser rebases the events it
+	already holds.
+
+	Support depends on the build: HAVE_ZLIB enables gzip and HAVE_ZSTD
+	enables zstd. The Makefile sets them when pkg-config finds the
+	libraries.
+*/
+
+#define DECOMPRESS_STEP (256UL << 10)
+
+enum CompressionType {
+	noCompression = 0,
+	gzipCompression = 1,
+	zstdCompression = 2,
+};
+
+
+enum CompressionType DetectCompression(const unsigned char* magic, unsigned long length);
+const char* CompressionName(enum CompressionType type);
+int ParseCompressedMidi(ParserContext* ctx, FILE* f, enum CompressionType type);
+int ReadCompressedFile(const char* filename, unsigned char** data, unsigned long* size);
+
+#endif
@@ -0,0 +1,477 @@
+/*
+	context.c :	Reusable parser context. Decodes a whole SMF into flat
+			event storage without allocating per event or per file
+			once the context has warmed up.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "context.h"
+#include "events.h"
+#include "speculative.h"
+#include "compressed.h"
+
+
+static int GrowArray(ParserContext* ctx, void** array, unsigned int* capacity, unsigned int needed, size_t elemSize)
+{
+	if (needed <= *capacity)
+		return 0;
+
+	unsigned int newCapacity = *capacity ? *capacity * 2 : 16;
+	while (newCapacity < needed)
+		newCapacity *= 2;
+
+	void* grown = realloc(*array, (size_t)newCapacity * elemSize);
+	if (!grown) {
+		ctx->error = "Out of memory";
+		return 1;
+	}
+
+	*array = grown;
+	*capacity = newCapacity;
+	ctx->numAllocations++;
+
+	return 0;
+}
+
+
+ParserContext* CreateParserContext(void)
+{
+	ParserContext* ctx = (ParserContext *)calloc(1, sizeof(ParserContext));
+
+	return ctx;
+}
+
+
+void ResetParserContext(ParserContext* ctx)
+{
+	ctx->data = NULL;
+	ctx->size = 0;
+	ctx->numChunks = 0;
+	ctx->numEvents = 0;
+	ctx->numTracks = 0;
+	ctx->hasHeader = 0;
+	ctx->numSpeculativeSegments = 0;
+	ctx->numRedecodedSegments = 0;
+	ctx->error = NULL;
+}
+
+
+void FreeParserContext(ParserContext* ctx)
+{
+	if (!ctx)
+		return;
+
+	free(ctx->buffer);
+	free(ctx->chunks);
+	free(ctx->events);
+	free(ctx->ticks);
+	free(ctx->tracks);
+	free(ctx);
+}
+
+
+int ReserveEvents(ParserContext* ctx, unsigned int count)
+{
+	unsigned int needed = ctx->numEvents + count;
+
+	if (needed <= ctx->eventCapacity)
+		return 0;
+
+	unsigned int newCapacity = ctx->eventCapacity ? ctx->eventCapacity * 2 : 1024;
+	while (newCapacity < needed)
+		newCapacity *= 2;
+
+	Event* events = (Event *)realloc(ctx->events, (size_t)newCapacity * sizeof(Event));
+	if (events)
+		ctx->events = events;
+
+	unsigned long* ticks = (unsigned long *)realloc(ctx->ticks, (size_t)newCapacity * sizeof(unsigned long));
+	if (ticks)
+		ctx->ticks = ticks;
+
+	if (!events || !ticks) {
+		ctx->error = "Out of memory";
+		return 1;
+	}
+
+	ctx->eventCapacity = newCapacity;
+	ctx->numAllocations += 2;
+
+	return 0;
+}
+
+
+Event* ContextTrackEvents(ParserContext* ctx, unsigned int track)
+{
+	return ctx->events + ctx->tracks[track].firstEvent;
+}
+
+
+unsigned long* ContextTrackTicks(ParserContext* ctx, unsigned int track)
+{
+	return ctx->ticks + ctx->tracks[track].firstEvent;
+}
+
+
+unsigned int GetVLenBounded(const unsigned char* data, unsigned long length, unsigned long* result)
+{
+	unsigned long val = 0;
+	unsigned int offset = 0;
+
+	/* SMF variable-length quantities are at most four bytes */
+	while (offset < length && offset < 4) {
+		unsigned char byte = data[offset++];
+		val = (val << 7) | (byte & 0x7F);
+
+		if (!(byte & 0x80)) {
+			*result = val;
+			return offset;
+		}
+	}
+
+	return 0;
+}
+
+
+static unsigned long DecodeLengthPrefixed(const unsigned char* data, unsigned long length, unsigned long offset, Event* event)
+{
+	unsigned long size;
+	unsigned int vlenSize = GetVLenBounded(data + offset, length - offset, &size);
+
+	if (!vlenSize)
+		return 0;
+
+	offset += vlenSize;
+	if (size > length - offset)
+		return 0;
+
+	event->size = size;
+	event->data = (unsigned char *)data + offset;
+
+	return offset + size;
+}
+
+
+unsigned long DecodeEvent(const unsigned char* data, unsigned long length, Event* event, unsigned char* runningStatus)
+{
+	unsigned long dTime;
+	unsigned long offset = GetVLenBounded(data, length, &dTime);
+
+	if (!offset || offset >= length)
+		return 0;
+
+	event->time = dTime;
+	unsigned char typeByte = data[offset];
+
+	switch (typeByte) {
+		case 0xFF: {
+			if (offset + 2 > length)
+				return 0;
+			event->type = 0xFF;
+			event->subtype = data[offset + 1];
+			return DecodeLengthPrefixed(data, length, offset + 2, event);
+		}
+		case 0xF0:
+		case 0xF7: {
+			event->type = typeByte;
+			event->subtype = '\0';
+			return DecodeLengthPrefixed(data, length, offset + 1, event);
+		}
+		default: {
+			if (typeByte & 0x80) {
+				if (!IsValidMidiEventType(typeByte))
+					return 0;
+				event->type = typeByte;
+				*runningStatus = typeByte;
+				++offset;
+			}
+			else if (*runningStatus) {
+				event->type = *runningStatus;	/* only MIDI events can have running status */
+			}
+			else {
+				return 0;
+			}
+
+			event->subtype = '\0';
+			event->size = SizeForMidiEvent(*event);
+			if (event->size > length - offset)
+				return 0;
+
+			for (unsigned int i=0; i < event->size; i++) {
+				if (data[offset + i] & 0x80)
+					return 0;
+			}
+
+			event->data = (unsigned char *)data + offset;
+			return offset + event->size;
+		}
+	}
+}
+
+
+/*
+	Decodes the events of the last track whose bytes lie within the first
+	available bytes of its body. While the body is incomplete, an event
+	that does not decode is taken to be cut short and left for the next
+	call; once all of it is there, it is malformed.
+*/
+int DecodeTrackBytes(ParserContext* ctx, TrackDecoder* decoder, unsigned long available)
+{
+	TrackSpan* span = &ctx->tracks[ctx->numTracks - 1];
+	Chunk* chunk = &ctx->chunks[span->chunkIndex];
+
+	if (available > chunk->length)
+		available = chunk->length;
+
+	while (!decoder->ended && (decoder->offset < available)) {
+		if (ReserveEvents(ctx, 1))
+			return 1;
+
+		Event* event = &ctx->events[ctx->numEvents];
+		unsigned char runningStatus = decoder->runningStatus;
+		unsigned long size = DecodeEvent(chunk->data + decoder->offset, available - decoder->offset, event, &runningStatus);
+		if (!size) {
+			if (available < chunk->length)
+				return 0;
+			ctx->error = "Malformed event in track chunk";
+			return 1;
+		}
+
+		decoder->offset += size;
+		decoder->runningStatus = runningStatus;
+		decoder->tick += event->time;
+		ctx->ticks[ctx->numEvents++] = decoder->tick;
+		span->numEvents++;
+
+		if ((event->type == 0xFF) && (event->subtype == 0x2F))
+			decoder->ended = 1;	// End of track
+	}
+
+	if (decoder->offset >= chunk->length)
+		decoder->ended = 1;
+
+	return 0;
+}
+
+
+static int OpenTrack(ParserContext* ctx, unsigned int chunkIndex)
+{
+	if (!ctx->hasHeader) {
+		ctx->error = "Track chunk before header";
+		return 1;
+	}
+
+	if (GrowArray(ctx, (void **)&ctx->tracks, &ctx->trackCapacity, ctx->numTracks + 1, sizeof(TrackSpan)))
+		return 1;
+
+	TrackSpan* span = &ctx->tracks[ctx->numTracks++];
+	span->chunkIndex = chunkIndex;
+	span->firstEvent = ctx->numEvents;
+	span->numEvents = 0;
+
+	return 0;
+}
+
+
+static int DecodeTrackChunk(ParserContext* ctx, unsigned int chunkIndex)
+{
+	Chunk* chunk = &ctx->chunks[chunkIndex];
+	TrackDecoder decoder;
+
+	if (OpenTrack(ctx, chunkIndex))
+		return 1;
+
+	if ((ctx->decodeThreads > 1) && (chunk->length >= 2 * SPECULATIVE_SEGMENT_SIZE))
+		return DecodeTrackSpeculative(ctx, chunk->data, chunk->length, ctx->decodeThreads);
+
+	memset(&decoder, 0, sizeof(TrackDecoder));
+
+	return DecodeTrackBytes(ctx, &decoder, chunk->length);
+}
+
+
+static int DecodeHeaderChunk(ParserContext* ctx, Chunk* chunk)
+{
+	if (chunk->length < 6) {
+		ctx->error = "Header chunk too short";
+		return 1;
+	}
+
+	unsigned short division = (chunk->data[4] << 8) | chunk->data[5];
+
+	ctx->fileInfo.formatType = (chunk->data[0] << 8) | chunk->data[1];
+	ctx->fileInfo.numTracks = (chunk->data[2] << 8) | chunk->data[3];
+	ctx->fileInfo.timeDivisionType = GetTimeDivisionType(division);
+	ctx->fileInfo.timeDivision = GetTimeDivision(division);
+	ctx->hasHeader = 1;
+
+	return 0;
+}
+
+
+static int RecordChunk(ParserContext* ctx, const unsigned char* chunk, unsigned long length)
+{
+	if (GrowArray(ctx, (void **)&ctx->chunks, &ctx->chunkCapacity, ctx->numChunks + 1, sizeof(Chunk)))
+		return 1;
+
+	Chunk* record = &ctx->chunks[ctx->numChunks++];
+	record->type = (unsigned char *)chunk;
+	record->length = length;
+	record->data = (unsigned char *)chunk + 8;
+
+	return 0;
+}
+
+
+/*
+	Records and decodes one chunk. chunk points at its 8-byte header and
+	the whole body must be readable.
+*/
+int ParseMidiChunk(ParserContext* ctx, const unsigned char* chunk, unsigned long length)
+{
+	if (RecordChunk(ctx, chunk, length))
+		return 1;
+
+	unsigned int chunkIndex = ctx->numChunks - 1;
+	Chunk* record = &ctx->chunks[chunkIndex];
+
+	if (memcmp(record->type, "MThd", 4) == 0) {
+		if (DecodeHeaderChunk(ctx, record))
+			return 1;
+	}
+	else if (memcmp(record->type, "MTrk", 4) == 0) {
+		if (DecodeTrackChunk(ctx, chunkIndex))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+	Records a track chunk whose body is still arriving and opens its
+	track. The events are then decoded with DecodeTrackBytes as the body
+	comes in; the bytes must stay at the same offsets from chunk, though
+	RebaseParserContext may move them as a whole.
+*/
+int BeginTrackChunk(ParserContext* ctx, const unsigned char* chunk, unsigned long length, TrackDecoder* decoder)
+{
+	memset(decoder, 0, sizeof(TrackDecoder));
+
+	if (RecordChunk(ctx, chunk, length))
+		return 1;
+
+	return OpenTrack(ctx, ctx->numChunks - 1);
+}
+
+
+/*
+	Points chunks and event payloads that were inside [oldBase,
+	oldBase + size) at the same offsets from newBase, after the bytes
+	being parsed have moved.
+*/
+void RebaseParserContext(ParserContext* ctx, const unsigned char* oldBase, unsigned long size, const unsigned char* newBase)
+{
+	for (unsigned int i=0; i < ctx->numChunks; i++) {
+		ctx->chunks[i].type = (unsigned char *)newBase + (ctx->chunks[i].type - oldBase);
+		ctx->chunks[i].data = (unsigned char *)newBase + (ctx->chunks[i].data - oldBase);
+	}
+
+	for (unsigned int i=0; i < ctx->numEvents; i++) {
+		unsigned char* data = ctx->events[i].data;
+		if (data && (data >= oldBase) && (data <= oldBase + size))
+			ctx->events[i].data = (unsigned char *)newBase + (data - oldBase);
+	}
+
+	if (ctx->data == oldBase)
+		ctx->data = newBase;
+}
+
+
+int ParseMidiBuffer(ParserContext* ctx, const unsigned char* data, unsigned long size)
+{
+	ResetParserContext(ctx);
+	ctx->data = data;
+	ctx->size = size;
+
+	unsigned long offset = 0;
+
+	while (offset + 8 <= size) {
+		unsigned long length =	((unsigned long)data[offset + 4] << 24) |
+					(data[offset + 5] << 16) |
+					(data[offset + 6] << 8) |
+					data[offset + 7];
+
+		if (length > size - offset - 8) {
+			ctx->error = "Chunk runs past end of file";
+			return 1;
+		}
+
+		if (ParseMidiChunk(ctx, data + offset, length))
+			return 1;
+		offset += 8 + length;
+	}
+
+	if (!ctx->hasHeader) {
+		ctx->error = "Missing MThd header";
+		return 1;
+	}
+
+	return 0;
+}
+
+
+int ParseMidiFile(ParserContext* ctx, const char* filename)
+{
+	ResetParserContext(ctx);
+
+	FILE* f = fopen(filename, "rb");
+	if (!f) {
+		ctx->error = "Could not open file";
+		return 1;
+	}
+
+	unsigned char magic[4];
+	size_t numMagic = fread(magic, 1, sizeof(magic), f);
+	enum CompressionType compression = DetectCompression(magic, numMagic);
+	if (compression != noCompression) {
+		int res = ParseCompressedMidi(ctx, f, compression);
+		fclose(f);
+		return res;
+	}
+
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	if (size < 0) {
+		fclose(f);
+		ctx->error = "Could not read file";
+		return 1;
+	}
+
+	if ((unsigned long)size > ctx->bufferCapacity) {
+		unsigned char* grown = (unsigned char *)realloc(ctx->buffer, size);
+		if (!grown) {
+			fclose(f);
+			ctx->error = "Out of memory";
+			return 1;
+		}
+		ctx->buffer = grown;
+		ctx->bufferCapacity = size;
+		ctx->numAllocations++;
+	}
+
+	size_t numRead = fread(ctx->buffer, sizeof(unsigned char), size, f);
+	fclose(f);
+
+	if (numRead != (size_t)size) {
+		ctx->error = "Could not read file";
+		return 1;
+	}
+
+	return ParseMidiBuffer(ctx, ctx->buffer, size);
+}
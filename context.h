@@ -0,0 +1,78 @@
+#ifndef __CONTEXT_H__
+#define __CONTEXT_H__
+
+#include "events.h"
+
+/*
+	A ParserContext owns everything needed to decode one MIDI file: the
+	file buffer, the chunk table and flat event storage. Event payloads
+	point straight into the file bytes, so decoding does not allocate per
+	event. Reset a context and parse the next file into it to reuse all
+	of its storage. A context is not shared, so separate contexts can be
+	used from separate threads at the same time.
+*/
+
+typedef struct {
+	unsigned int chunkIndex;
+	unsigned int firstEvent;
+	unsigned int numEvents;
+} TrackSpan;
+
+typedef struct {
+	unsigned char* buffer;		/* owned, reused between files */
+	unsigned long bufferCapacity;
+	const unsigned char* data;	/* bytes being parsed (buffer or borrowed) */
+	unsigned long size;
+
+	Chunk* chunks;
+	unsigned int numChunks;
+	unsigned int chunkCapacity;
+
+	Event* events;
+	unsigned long* ticks;		/* absolute tick of each event */
+	unsigned int numEvents;
+	unsigned int eventCapacity;
+
+	TrackSpan* tracks;
+	unsigned int numTracks;
+	unsigned int trackCapacity;
+
+	FileInfo fileInfo;
+	int hasHeader;
+
+	unsigned int decodeThreads;	/* above 1, large tracks are decoded speculatively */
+	unsigned int numSpeculativeSegments;
+	unsigned int numRedecodedSegments;
+
+	const char* error;
+	unsigned long numAllocations;
+} ParserContext;
+
+/* Where decoding of a track stopped, for bodies that arrive in pieces. */
+typedef struct {
+	unsigned long offset;		/* into the chunk body */
+	unsigned long tick;
+	unsigned char runningStatus;
+	int ended;			/* End of track decoded, or the body used up */
+} TrackDecoder;
+
+
+ParserContext* CreateParserContext(void);
+void ResetParserContext(ParserContext* ctx);
+void FreeParserContext(ParserContext* ctx);
+
+int ParseMidiFile(ParserContext* ctx, const char* filename);
+int ParseMidiBuffer(ParserContext* ctx, const unsigned char* data, unsigned long size);
+int ParseMidiChunk(ParserContext* ctx, const unsigned char* chunk, unsigned long length);
+int BeginTrackChunk(ParserContext* ctx, const unsigned char* chunk, unsigned long length, TrackDecoder* decoder);
+int DecodeTrackBytes(ParserContext* ctx, TrackDecoder* decoder, unsigned long available);
+void RebaseParserContext(ParserContext* ctx, const unsigned char* oldBase, unsigned long size, const unsigned char* newBase);
+
+Event* ContextTrackEvents(ParserContext* ctx, unsigned int track);
+unsigned long* ContextTrackTicks(ParserContext* ctx, unsigned int track);
+
+unsigned int GetVLenBounded(const unsigned char* data, unsigned long length, unsigned long* result);
+unsigned long DecodeEvent(const unsigned char* data, unsigned long length, Event* event, unsigned char* runningStatus);
+int ReserveEvents(ParserContext* ctx, unsigned int count);
+
+#endif
@@ -0,0 +1,872 @@
+/*
+	daemon.c :	Unix socket query server backed by an LRU cache of parsed
+			songs, plus a small client for issuing requests
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "context.h"
+#include "tempomap.h"
+#include "fingerprint.h"
+#include "parallel.h"
+
+#define CACHE_BUCKETS 256
+#define LISTEN_BACKLOG 64
+#define MAX_CONNECTIONS 1024
+
+
+typedef struct CachedSong {
+	char* path;
+	unsigned long long fileSize;
+	long long mtime;
+	ParserContext* ctx;
+	TempoMap tempoMap;
+	unsigned long long bytes;	/* estimated memory footprint */
+
+	unsigned int refs;		/* requests currently using the song */
+	int evicted;			/* unlinked, freed when refs drops to 0 */
+
+	struct CachedSong* newer;	/* LRU list, head is most recent */
+	struct CachedSong* older;
+	struct CachedSong* hashNext;
+} CachedSong;
+
+typedef struct {
+	pthread_mutex_t lock;
+	CachedSong* buckets[CACHE_BUCKETS];
+	CachedSong* newest;
+	CachedSong* oldest;
+	DaemonMetrics metrics;
+} SongCache;
+
+typedef struct {
+	int fd;
+	FILE* out;
+	char pending[DAEMON_MAX_LINE];	/* start of a request still arriving */
+	unsigned int numPending;
+	int discarding;			/* skipping the rest of an over-long request */
+} DaemonConnection;
+
+/*
+	Idle connections wait in the accept loop's poll set. A connection
+	with input is queued for a worker, which answers the requests that
+	arrived and hands it back, so a client that keeps its connection
+	open without sending anything never holds a worker.
+*/
+typedef struct {
+	int listenFd;
+	int wakeFds[2];			/* workers write to wake the accept loop */
+	int running;
+	SongCache cache;
+
+	pthread_mutex_t queueLock;
+	pthread_cond_t queueNotEmpty;
+	DaemonConnection* queue[MAX_CONNECTIONS];
+	unsigned int queueHead;
+	unsigned int queueCount;
+
+	DaemonConnection* returned[MAX_CONNECTIONS];	/* served, waiting to be polled again */
+	unsigned int numReturned;
+	unsigned int numConnections;	/* open, wherever they are */
+} DaemonServer;
+
+
+static unsigned int PathBucket(const char* path)
+{
+	return (unsigned int)(HashBytes(path, strlen(path), 0) % CACHE_BUCKETS);
+}
+
+
+static unsigned long long SongFootprint(const CachedSong* song)
+{
+	const ParserContext* ctx = song->ctx;
+
+	return sizeof(CachedSong) + sizeof(ParserContext) + strlen(song->path) + 1 +
+		ctx->bufferCapacity +
+		(unsigned long long)ctx->eventCapacity * (sizeof(Event) + sizeof(unsigned long)) +
+		(unsigned long long)ctx->chunkCapacity * sizeof(Chunk) +
+		(unsigned long long)ctx->trackCapacity * sizeof(TrackSpan) +
+		(unsigned long long)song->tempoMap.capacity * sizeof(TempoChange);
+}
+
+
+static void FreeSong(CachedSong* song)
+{
+	FreeTempoMap(&song->tempoMap);
+	FreeParserContext(song->ctx);
+	free(song->path);
+	free(song);
+}
+
+
+static void InitSongCache(SongCache* cache, unsigned long long memoryBudget)
+{
+	memset(cache, 0, sizeof(SongCache));
+	pthread_mutex_init(&cache->lock, NULL);
+	cache->metrics.memoryBudget = memoryBudget;
+}
+
+
+/* Removes a song from the hash and LRU list. Caller holds the lock. */
+static void UnlinkSong(SongCache* cache, CachedSong* song)
+{
+	CachedSong** link = &cache->buckets[PathBucket(song->path)];
+	while (*link != song)
+		link = &(*link)->hashNext;
+	*link = song->hashNext;
+
+	if (song->newer)
+		song->newer->older = song->older;
+	else
+		cache->newest = song->older;
+	if (song->older)
+		song->older->newer = song->newer;
+	else
+		cache->oldest = song->newer;
+
+	cache->metrics.numSongs--;
+	cache->metrics.bytesCached -= song->bytes;
+
+	if (song->refs == 0)
+		FreeSong(song);
+	else
+		song->evicted = 1;
+}
+
+
+static void LinkSong(SongCache* cache, CachedSong* song)
+{
+	unsigned int bucket = PathBucket(song->path);
+	song->hashNext = cache->buckets[bucket];
+	cache->buckets[bucket] = song;
+
+	song->newer = NULL;
+	song->older = cache->newest;
+	if (cache->newest)
+		cache->newest->newer = song;
+	cache->newest = song;
+	if (!cache->oldest)
+		cache->oldest = song;
+
+	cache->metrics.numSongs++;
+	cache->metrics.bytesCached += song->bytes;
+}
+
+
+static void TouchSong(SongCache* cache, CachedSong* song)
+{
+	if (cache->newest == song)
+		return;
+
+	song->newer->older = song->older;
+	if (song->older)
+		song->older->newer = song->newer;
+	else
+		cache->oldest = song->newer;
+
+	song->newer = NULL;
+	song->older = cache->newest;
+	cache->newest->newer = song;
+	cache->newest = song;
+}
+
+
+static CachedSong* FindSong(SongCache* cache, const char* path)
+{
+	for (CachedSong* song = cache->buckets[PathBucket(path)]; song; song = song->hashNext) {
+		if (strcmp(song->path, path) == 0)
+			return song;
+	}
+
+	return NULL;
+}
+
+
+/* Evicts least recently used songs until the cache fits its budget, keeping keep. */
+static void EnforceBudget(SongCache* cache, CachedSong* keep)
+{
+	while ((cache->metrics.bytesCached > cache->metrics.memoryBudget) && cache->oldest && (cache->oldest != keep)) {
+		UnlinkSong(cache, cache->oldest);
+		cache->metrics.evictions++;
+	}
+}
+
+
+/*
+	Returns the parsed song for path with a reference held, parsing it on
+	a miss. Parsing happens outside the lock so other clients are not held
+	up; if two clients miss on the same file at once, the first insert wins.
+*/
+static CachedSong* AcquireSong(SongCache* cache, const char* path, const char** error)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0) {
+		*error = "Could not open file";
+		return NULL;
+	}
+
+	pthread_mutex_lock(&cache->lock);
+	CachedSong* song = FindSong(cache, path);
+	if (song && (song->fileSize == (unsigned long long)st.st_size) && (song->mtime == (long long)st.st_mtime)) {
+		cache->metrics.hits++;
+		TouchSong(cache, song);
+		song->refs++;
+		pthread_mutex_unlock(&cache->lock);
+		return song;
+	}
+	if (song)
+		UnlinkSong(cache, song);	/* changed on disk */
+	cache->metrics.misses++;
+	pthread_mutex_unlock(&cache->lock);
+
+	song = (CachedSong *)calloc(1, sizeof(CachedSong));
+	if (!song || !(song->path = strdup(path)) || !(song->ctx = CreateParserContext())) {
+		if (song)
+			free(song->path);
+		free(song);
+		*error = "Out of memory";
+		return NULL;
+	}
+	song->fileSize = st.st_size;
+	song->mtime = st.st_mtime;
+	InitTempoMap(&song->tempoMap);
+
+	if ((ParseMidiFile(song->ctx, path) != 0) || (BuildTempoMap(song->ctx, &song->tempoMap) != 0)) {
+		*error = song->ctx->error ? song->ctx->error : "Could not parse file";
+		FreeSong(song);
+		return NULL;
+	}
+	song->bytes = SongFootprint(song);
+	song->refs = 1;
+
+	pthread_mutex_lock(&cache->lock);
+	CachedSong* existing = FindSong(cache, path);
+	if (existing && (existing->fileSize == song->fileSize) && (existing->mtime == song->mtime)) {
+		existing->refs++;
+		TouchSong(cache, existing);
+		pthread_mutex_unlock(&cache->lock);
+		FreeSong(song);
+		return existing;
+	}
+	if (existing)
+		UnlinkSong(cache, existing);
+
+	LinkSong(cache, song);
+	EnforceBudget(cache, song);
+	pthread_mutex_unlock(&cache->lock);
+
+	return song;
+}
+
+
+static void ReleaseSong(SongCache* cache, CachedSong* song)
+{
+	pthread_mutex_lock(&cache->lock);
+	song->refs--;
+	if (song->evicted && (song->refs == 0))
+		FreeSong(song);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+static void FreeSongCache(SongCache* cache)
+{
+	while (cache->oldest)
+		UnlinkSong(cache, cache->oldest);
+	pthread_mutex_destroy(&cache->lock);
+}
+
+
+static void PrintTrackName(FILE* out, ParserContext* ctx, unsigned int track)
+{
+	Event* name = FindMetaEvent(ContextTrackEvents(ctx, track), ctx->tracks[track].numEvents, 0x03);
+
+	if (name) {
+		for (unsigned int i=0; i < name->size; i++)
+			fputc(((name->data[i] < 0x20) || (name->data[i] == 0x7F)) ? '?' : name->data[i], out);
+	}
+	else {
+		fputc('-', out);
+	}
+}
+
+
+static void ReplyHeader(FILE* out, CachedSong* song)
+{
+	FileInfo* info = &song->ctx->fileInfo;
+
+	fprintf(out, "OK 1\n%u %u ", info->formatType, song->ctx->numTracks);
+	if (info->timeDivisionType == framesPerSecond)
+		fprintf(out, "smpte:%u/%u\n", info->timeDivision.framesPerSecond.smpteFrames,
+			info->timeDivision.framesPerSecond.ticksPerFrame);
+	else
+		fprintf(out, "%u\n", info->timeDivision.ticksPerBeat);
+}
+
+
+static void ReplyTracks(FILE* out, CachedSong* song)
+{
+	ParserContext* ctx = song->ctx;
+
+	fprintf(out, "OK %u\n", ctx->numTracks);
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		fprintf(out, "%u %u ", t, ctx->tracks[t].numEvents);
+		PrintTrackName(out, ctx, t);
+		fputc('\n', out);
+	}
+}
+
+
+/* First event in ticks[0, count) at or after tick; ticks are sorted. */
+static unsigned int LowerBoundTick(const unsigned long* ticks, unsigned int count, unsigned long tick)
+{
+	unsigned int lo = 0, hi = count;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (ticks[mid] < tick)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+static void ReplyEvents(FILE* out, CachedSong* song, unsigned int track, unsigned long from, unsigned long to)
+{
+	ParserContext* ctx = song->ctx;
+
+	if (track >= ctx->numTracks) {
+		fprintf(out, "ERR No such track\n");
+		return;
+	}
+
+	Event* events = ContextTrackEvents(ctx, track);
+	unsigned long* ticks = ContextTrackTicks(ctx, track);
+	unsigned int count = ctx->tracks[track].numEvents;
+	unsigned int first = LowerBoundTick(ticks, count, from);
+	unsigned int last = to > from ? LowerBoundTick(ticks, count, to) : first;
+
+	fprintf(out, "OK %u\n", last - first);
+	for (unsigned int i=first; i < last; i++) {
+		fprintf(out, "%lu %02x %02x ", ticks[i], events[i].type, events[i].subtype);
+		for (unsigned int b=0; b < events[i].size; b++)
+			fprintf(out, "%02x", events[i].data[b]);
+		if (events[i].size == 0)
+			fputc('-', out);
+		fputc('\n', out);
+	}
+}
+
+
+static void ReplyStats(FILE* out, CachedSong* song)
+{
+	ParserContext* ctx = song->ctx;
+	unsigned long lastTick = 0;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		unsigned int count = ctx->tracks[t].numEvents;
+		if (count && (ContextTrackTicks(ctx, t)[count - 1] > lastTick))
+			lastTick = ContextTrackTicks(ctx, t)[count - 1];
+	}
+
+	fprintf(out, "OK 1\n%u %lu %.3f\n", ctx->numEvents, lastTick, TicksToSeconds(&song->tempoMap, lastTick));
+}
+
+
+static void ReplyMetrics(FILE* out, SongCache* cache)
+{
+	pthread_mutex_lock(&cache->lock);
+	DaemonMetrics metrics = cache->metrics;
+	pthread_mutex_unlock(&cache->lock);
+
+	fprintf(out, "OK 1\n%llu %llu %llu %u %llu %llu\n", metrics.hits, metrics.misses, metrics.evictions,
+		metrics.numSongs, metrics.bytesCached, metrics.memoryBudget);
+}
+
+
+static void WakeAcceptLoop(DaemonServer* server)
+{
+	/* the pipe is non-blocking; if it is full the loop is awake anyway */
+	if (write(server->wakeFds[1], "", 1) < 0)
+		return;
+}
+
+
+static void StopServer(DaemonServer* server)
+{
+	pthread_mutex_lock(&server->queueLock);
+	server->running = 0;
+	pthread_cond_broadcast(&server->queueNotEmpty);
+	pthread_mutex_unlock(&server->queueLock);
+
+	WakeAcceptLoop(server);
+}
+
+
+/* Returns 1 when the connection should be closed. */
+static int HandleRequest(DaemonServer* server, char* line, FILE* out)
+{
+	char* save = NULL;
+	char* command = strtok_r(line, " \t", &save);
+	char* path = strtok_r(NULL, " \t", &save);
+
+	pthread_mutex_lock(&server->cache.lock);
+	server->cache.metrics.requests++;
+	pthread_mutex_unlock(&server->cache.lock);
+
+	if (!command) {
+		fprintf(out, "ERR Empty request\n");
+		return 0;
+	}
+	if (strcmp(command, "QUIT") == 0)
+		return 1;
+	if (strcmp(command, "SHUTDOWN") == 0) {
+		fprintf(out, "OK 0\n");
+		fflush(out);
+		StopServer(server);
+		return 1;
+	}
+	if (strcmp(command, "METRICS") == 0) {
+		ReplyMetrics(out, &server->cache);
+		return 0;
+	}
+
+	int isHeader = strcmp(command, "HEADER") == 0;
+	int isTracks = strcmp(command, "TRACKS") == 0;
+	int isEvents = strcmp(command, "EVENTS") == 0;
+	int isStats = strcmp(command, "STATS") == 0;
+
+	if (!isHeader && !isTracks && !isEvents && !isStats) {
+		fprintf(out, "ERR Unknown command\n");
+		return 0;
+	}
+	if (!path) {
+		fprintf(out, "ERR Missing path\n");
+		return 0;
+	}
+
+	char* trackArg = NULL;
+	char* fromArg = NULL;
+	char* toArg = NULL;
+	if (isEvents) {
+		trackArg = strtok_r(NULL, " \t", &save);
+		fromArg = strtok_r(NULL, " \t", &save);
+		toArg = strtok_r(NULL, " \t", &save);
+		if (!trackArg || !fromArg || !toArg) {
+			fprintf(out, "ERR Usage: EVENTS <path> <track> <from> <to>\n");
+			return 0;
+		}
+	}
+
+	const char* error = NULL;
+	CachedSong* song = AcquireSong(&server->cache, path, &error);
+	if (!song) {
+		fprintf(out, "ERR %s\n", error);
+		return 0;
+	}
+
+	if (isHeader)
+		ReplyHeader(out, song);
+	else if (isTracks)
+		ReplyTracks(out, song);
+	else if (isEvents)
+		ReplyEvents(out, song, strtoul(trackArg, NULL, 10), strtoul(fromArg, NULL, 10), strtoul(toArg, NULL, 10));
+	else
+		ReplyStats(out, song);
+
+	ReleaseSong(&server->cache, song);
+
+	return 0;
+}
+
+
+static DaemonConnection* OpenConnection(int fd)
+{
+	DaemonConnection* connection = (DaemonConnection *)malloc(sizeof(DaemonConnection));
+	int writeFd = dup(fd);
+
+	if (connection && (writeFd >= 0))
+		connection->out = fdopen(writeFd, "w");
+
+	if (!connection || (writeFd < 0) || !connection->out) {
+		if (writeFd >= 0)
+			close(writeFd);
+		free(connection);
+		close(fd);
+		return NULL;
+	}
+
+	connection->fd = fd;
+	connection->numPending = 0;
+	connection->discarding = 0;
+
+	return connection;
+}
+
+
+static void CloseConnection(DaemonConnection* connection)
+{
+	fclose(connection->out);
+	close(connection->fd);
+	free(connection);
+}
+
+
+/*
+	Answers every complete request that has arrived on a readable
+	connection. Returns 1 when the connection should be closed.
+*/
+static int ServeConnection(DaemonServer* server, DaemonConnection* connection)
+{
+	char* buffer = connection->pending;
+	unsigned int capacity = sizeof(connection->pending) - 1;
+	ssize_t received = recv(connection->fd, buffer + connection->numPending, capacity - connection->numPending, 0);
+
+	if (received < 0)
+		return (errno != EINTR) && (errno != EAGAIN);
+
+	/* a last request without a newline is still answered */
+	if (received == 0) {
+		if (connection->numPending && !connection->discarding) {
+			buffer[connection->numPending] = '\0';
+			HandleRequest(server, buffer, connection->out);
+			fflush(connection->out);
+		}
+		return 1;
+	}
+
+	unsigned int length = connection->numPending + received;
+	unsigned int start = 0;
+
+	for (unsigned int i=connection->numPending; i < length; i++) {
+		if (buffer[i] != '\n')
+			continue;
+
+		buffer[i] = '\0';
+		if ((i > start) && (buffer[i - 1] == '\r'))
+			buffer[i - 1] = '\0';
+
+		int done = connection->discarding ? 0 : HandleRequest(server, buffer + start, connection->out);
+		connection->discarding = 0;
+		start = i + 1;
+
+		if ((fflush(connection->out) != 0) || done)
+			return 1;
+	}
+
+	if (connection->discarding)
+		start = length;
+
+	memmove(buffer, buffer + start, length - start);
+	connection->numPending = length - start;
+
+	if (connection->numPending == capacity) {
+		fprintf(connection->out, "ERR Request too long\n");
+		connection->numPending = 0;
+		connection->discarding = 1;
+		if (fflush(connection->out) != 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+static void* RunDaemonWorker(void* arg)
+{
+	DaemonServer* server = (DaemonServer *)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&server->queueLock);
+		while (server->running && (server->queueCount == 0))
+			pthread_cond_wait(&server->queueNotEmpty, &server->queueLock);
+
+		if (!server->running) {
+			pthread_mutex_unlock(&server->queueLock);
+			break;
+		}
+
+		DaemonConnection* connection = server->queue[server->queueHead];
+		server->queueHead = (server->queueHead + 1) % MAX_CONNECTIONS;
+		server->queueCount--;
+		pthread_mutex_unlock(&server->queueLock);
+
+		int done = ServeConnection(server, connection);
+
+		pthread_mutex_lock(&server->queueLock);
+		if (done) {
+			CloseConnection(connection);
+			server->numConnections--;
+		}
+		else {
+			server->returned[server->numReturned++] = connection;
+		}
+		pthread_mutex_unlock(&server->queueLock);
+
+		WakeAcceptLoop(server);
+	}
+
+	return NULL;
+}
+
+
+static int OpenListenSocket(const char* socketPath)
+{
+	struct sockaddr_un address;
+
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+	unlink(socketPath);
+
+	if ((bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) || (listen(fd, LISTEN_BACKLOG) != 0)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/*
+	Serves requests until a client sends SHUTDOWN. Blocks the calling
+	thread, which accepts connections, polls the idle ones and hands
+	those with input to the workers.
+*/
+int RunMidiDaemon(const char* socketPath, unsigned long long memoryBudget, unsigned int numThreads)
+{
+	DaemonServer* server = (DaemonServer *)calloc(1, sizeof(DaemonServer));
+
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+
+	if (!server)
+		return 1;
+
+	server->listenFd = OpenListenSocket(socketPath);
+	if (server->listenFd < 0) {
+		free(server);
+		return 1;
+	}
+
+	if (pipe(server->wakeFds) != 0) {
+		close(server->listenFd);
+		unlink(socketPath);
+		free(server);
+		return 1;
+	}
+	fcntl(server->wakeFds[1], F_SETFL, O_NONBLOCK);
+
+	/* a client hanging up mid-reply must not kill the server */
+	signal(SIGPIPE, SIG_IGN);
+
+	server->running = 1;
+	InitSongCache(&server->cache, memoryBudget);
+	pthread_mutex_init(&server->queueLock, NULL);
+	pthread_cond_init(&server->queueNotEmpty, NULL);
+
+	pthread_t* threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+	DaemonConnection** idle = (DaemonConnection **)malloc(MAX_CONNECTIONS * sizeof(DaemonConnection *));
+	struct pollfd* fds = (struct pollfd *)malloc((MAX_CONNECTIONS + 2) * sizeof(struct pollfd));
+	unsigned int numIdle = 0;
+	unsigned int numStarted = 0;
+
+	if (threads && idle && fds) {
+		for (unsigned int i=0; i < numThreads; i++) {
+			if (pthread_create(&threads[i], NULL, RunDaemonWorker, server) != 0)
+				break;
+			numStarted++;
+		}
+	}
+
+	int res = numStarted ? 0 : 1;
+	if (res != 0)
+		StopServer(server);
+
+	for (;;) {
+		pthread_mutex_lock(&server->queueLock);
+		int running = server->running;
+		while (server->numReturned > 0)
+			idle[numIdle++] = server->returned[--server->numReturned];
+		int full = server->numConnections == MAX_CONNECTIONS;
+		pthread_mutex_unlock(&server->queueLock);
+
+		if (!running)
+			break;
+
+		/* stop accepting while every connection slot is taken */
+		unsigned int numFds = 0;
+		fds[numFds].fd = server->wakeFds[0];
+		fds[numFds++].events = POLLIN;
+		fds[numFds].fd = full ? -1 : server->listenFd;
+		fds[numFds++].events = POLLIN;
+		for (unsigned int i=0; i < numIdle; i++) {
+			fds[numFds].fd = idle[i]->fd;
+			fds[numFds++].events = POLLIN;
+		}
+
+		if (poll(fds, numFds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (fds[0].revents) {
+			char drain[64];
+			if (read(server->wakeFds[0], drain, sizeof(drain)) < 0)
+				break;
+		}
+
+		/* walk backwards so moving the last idle connection down is safe */
+		for (unsigned int i=numIdle; i > 0; i--) {
+			if (!fds[i + 1].revents)
+				continue;
+
+			pthread_mutex_lock(&server->queueLock);
+			server->queue[(server->queueHead + server->queueCount) % MAX_CONNECTIONS] = idle[i - 1];
+			server->queueCount++;
+			pthread_cond_signal(&server->queueNotEmpty);
+			pthread_mutex_unlock(&server->queueLock);
+
+			idle[i - 1] = idle[--numIdle];
+		}
+
+		if (fds[1].revents) {
+			int fd = accept(server->listenFd, NULL, NULL);
+			DaemonConnection* connection = fd >= 0 ? OpenConnection(fd) : NULL;
+
+			if (connection) {
+				pthread_mutex_lock(&server->queueLock);
+				server->numConnections++;
+				pthread_mutex_unlock(&server->queueLock);
+				idle[numIdle++] = connection;
+			}
+		}
+	}
+
+	StopServer(server);
+	for (unsigned int i=0; i < numStarted; i++)
+		pthread_join(threads[i], NULL);
+
+	/* connections still open, whether idle, queued or just served */
+	for (unsigned int i=0; i < numIdle; i++)
+		CloseConnection(idle[i]);
+	while (server->queueCount > 0) {
+		CloseConnection(server->queue[server->queueHead]);
+		server->queueHead = (server->queueHead + 1) % MAX_CONNECTIONS;
+		server->queueCount--;
+	}
+	while (server->numReturned > 0)
+		CloseConnection(server->returned[--server->numReturned]);
+
+	close(server->listenFd);
+	close(server->wakeFds[0]);
+	close(server->wakeFds[1]);
+	unlink(socketPath);
+
+	FreeSongCache(&server->cache);
+	pthread_cond_destroy(&server->queueNotEmpty);
+	pthread_mutex_destroy(&server->queueLock);
+	free(fds);
+	free(idle);
+	free(threads);
+	free(server);
+
+	return res;
+}
+
+
+/*
+	Sends one request line and copies the reply to out. Returns 0 if the
+	server answered OK.
+*/
+int MidiDaemonRequest(const char* socketPath, const char* request, FILE* out)
+{
+	struct sockaddr_un address;
+
+	if (strlen(socketPath) >= sizeof(address.sun_path))
+		return 1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketPath);
+
+	if (connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+		close(fd);
+		return 1;
+	}
+
+	int writeFd = dup(fd);
+	FILE* in = fdopen(fd, "r");
+	FILE* requestOut = writeFd >= 0 ? fdopen(writeFd, "w") : NULL;
+	if (!in || !requestOut) {
+		if (in)
+			fclose(in);
+		else
+			close(fd);
+		if (requestOut)
+			fclose(requestOut);
+		else if (writeFd >= 0)
+			close(writeFd);
+		return 1;
+	}
+
+	fprintf(requestOut, "%s\n", request);
+	fflush(requestOut);
+
+	char line[DAEMON_MAX_LINE];
+	unsigned long numLines = 0;
+	int res = 1;
+
+	if (fgets(line, sizeof(line), in)) {
+		fputs(line, out);
+		if (strncmp(line, "OK ", 3) == 0) {
+			numLines = strtoul(line + 3, NULL, 10);
+			res = 0;
+		}
+	}
+
+	/* lines longer than the buffer arrive in pieces */
+	unsigned long numRead = 0;
+	while ((numRead < numLines) && fgets(line, sizeof(line), in)) {
+		fputs(line, out);
+		if (line[strlen(line) - 1] == '\n')
+			numRead++;
+	}
+
+	if (strcmp(request, "SHUTDOWN") != 0) {
+		fprintf(requestOut, "QUIT\n");
+		fflush(requestOut);
+	}
+	fclose(requestOut);
+	fclose(in);
+
+	return res;
+}
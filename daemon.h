@@ -0,0 +1,44 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+#include <stdio.h>
+
+/*
+	Long-running query server on a Unix domain socket. Parsed songs are
+	kept in an LRU cache bounded by a memory budget and shared between a
+	fixed pool of worker threads. Idle connections are polled, and a
+	worker only takes a connection while it has requests to answer.
+	A cached song is re-parsed when its size or mtime changes.
+
+	The protocol is line based. Each request is one line and each reply
+	starts with "OK <n>" followed by n lines, or with "ERR <message>".
+
+		HEADER <path>				OK 1: format tracks division
+		TRACKS <path>				OK n: index events name
+		EVENTS <path> <track> <from> <to>	OK n: tick type subtype hexdata
+		STATS <path>				OK 1: events ticks seconds
+		METRICS					OK 1: hits misses evictions songs bytes budget
+		QUIT					closes the connection
+		SHUTDOWN				stops the server
+
+	Paths may not contain spaces. EVENTS returns the events of one track
+	whose absolute tick is in [from, to).
+*/
+
+#define DAEMON_MAX_LINE 4096
+
+typedef struct {
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long requests;
+	unsigned int numSongs;
+	unsigned long long bytesCached;
+	unsigned long long memoryBudget;
+} DaemonMetrics;
+
+
+int RunMidiDaemon(const char* socketPath, unsigned long long memoryBudget, unsigned int numThreads);
+int MidiDaemonRequest(const char* socketPath, const char* request, FILE* out);
+
+#endif
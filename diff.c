@@ -0,0 +1,593 @@
+/*
+	diff.c :	Structural diff of two songs, with fingerprinted tracks
+			skipped and the rest aligned event by event by tick
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "diff.h"
+#include "parallel.h"
+
+#define NO_TRACK 0xFFFF
+#define NO_PARTNER 0xFFFFFFFFU
+
+
+enum PairState {
+	unpaired = 0,
+	pairedExact = 1,
+	pairedModified = 2,
+	pairedMoved = 3,
+};
+
+
+void InitDiffScratch(DiffScratch* scratch)
+{
+	memset(scratch, 0, sizeof(DiffScratch));
+}
+
+
+void FreeDiffScratch(DiffScratch* scratch)
+{
+	for (int side=0; side < 2; side++) {
+		free(scratch->events[side]);
+		free(scratch->partner[side]);
+		free(scratch->unmatched[side]);
+		free(scratch->state[side]);
+		free(scratch->prints[side]);
+		free(scratch->numHashed[side]);
+		free(scratch->trackPartner[side]);
+	}
+
+	InitDiffScratch(scratch);
+}
+
+
+static int Grow(void** array, unsigned int count, unsigned long size)
+{
+	void* grown = realloc(*array, count * size);
+	if (!grown)
+		return 1;
+
+	*array = grown;
+
+	return 0;
+}
+
+
+static int ReserveEventScratch(DiffScratch* scratch, int side, unsigned int count)
+{
+	if (count <= scratch->capacity[side])
+		return 0;
+
+	unsigned int capacity = scratch->capacity[side] ? scratch->capacity[side] : 1024;
+	while (capacity < count)
+		capacity *= 2;
+
+	if (Grow((void **)&scratch->events[side], capacity, sizeof(DiffEvent)) ||
+		Grow((void **)&scratch->partner[side], capacity, sizeof(unsigned int)) ||
+		Grow((void **)&scratch->unmatched[side], capacity, sizeof(unsigned int)) ||
+		Grow((void **)&scratch->state[side], capacity, sizeof(unsigned char)))
+		return 1;
+
+	scratch->capacity[side] = capacity;
+
+	return 0;
+}
+
+
+static int ReserveTrackScratch(DiffScratch* scratch, int side, unsigned int count)
+{
+	if (count <= scratch->trackCapacity[side])
+		return 0;
+
+	unsigned int capacity = count < 64 ? 64 : count;
+
+	if (Grow((void **)&scratch->prints[side], capacity, sizeof(Fingerprint)) ||
+		Grow((void **)&scratch->numHashed[side], capacity, sizeof(unsigned long)) ||
+		Grow((void **)&scratch->trackPartner[side], capacity, sizeof(int)))
+		return 1;
+
+	scratch->trackCapacity[side] = capacity;
+
+	return 0;
+}
+
+
+/* Same rules as the fingerprint; returns 0 for events that are ignored. */
+static int NormaliseDiffEvent(const Event* event, DiffEvent* out)
+{
+	if (event->type == 0xFF) {
+		switch (event->subtype) {
+			case 0x51: // Set tempo
+			case 0x54: // SMPTE offset
+			case 0x58: // Set time signature
+			case 0x59: // Set key signature
+				out->message = 0xFF00 | event->subtype;
+				out->value = HashBytes(event->data, event->size, 0);
+				return 1;
+			default:
+				return 0;
+		}
+	}
+
+	if ((event->type == 0xF0) || (event->type == 0xF7)) {
+		out->message = event->type << 8;
+		out->value = HashBytes(event->data, event->size, 0);
+		return 1;
+	}
+
+	unsigned char status = event->type;
+	unsigned char data1 = event->data[0];
+	unsigned char data2 = (event->size > 1) ? event->data[1] : 0;
+
+	switch (status & 0xF0) {
+		case 0x90:
+			if (data2 == 0)
+				status = 0x80 | (status & 0x0F);
+			break;
+		case 0xC0:
+		case 0xD0:
+			/* the single data byte is the value */
+			data2 = data1;
+			data1 = 0;
+			break;
+		case 0xE0:
+			out->message = status << 8;
+			out->value = data1 | (data2 << 7);
+			return 1;
+	}
+
+	if ((status & 0xF0) == 0x80)
+		data2 = 0;
+
+	out->message = (status << 8) | data1;
+	out->value = data2;
+
+	return 1;
+}
+
+
+static int EventLess(const DiffEvent* x, const DiffEvent* y)
+{
+	if (x->tick != y->tick)
+		return x->tick < y->tick;
+	if (x->message != y->message)
+		return x->message < y->message;
+
+	return x->value < y->value;
+}
+
+
+/*
+	Normalises one track into the scratch list of a side, sorted by tick
+	and then message so the order within a tick does not matter. A
+	negative track gives an empty list.
+*/
+static int CollectEvents(ParserContext* ctx, int track, unsigned long numerator, unsigned long denominator, DiffScratch* scratch, int side, unsigned int* count)
+{
+	*count = 0;
+	if (track < 0)
+		return 0;
+
+	unsigned int numEvents = ctx->tracks[track].numEvents;
+	if (ReserveEventScratch(scratch, side, numEvents ? numEvents : 1))
+		return 1;
+
+	Event* events = ContextTrackEvents(ctx, track);
+	unsigned long* ticks = ContextTrackTicks(ctx, track);
+	DiffEvent* list = scratch->events[side];
+	unsigned int n = 0;
+
+	for (unsigned int i=0; i < numEvents; i++) {
+		DiffEvent event;
+		if (!NormaliseDiffEvent(&events[i], &event))
+			continue;
+
+		event.tick = (numerator == denominator) ? ticks[i] :
+			(unsigned long)(((unsigned long long)ticks[i] * numerator + denominator / 2) / denominator);
+
+		/* ticks never decrease, so this only reorders within a tick */
+		unsigned int j = n++;
+		while ((j > 0) && EventLess(&event, &list[j - 1])) {
+			list[j] = list[j - 1];
+			j--;
+		}
+		list[j] = event;
+	}
+
+	*count = n;
+
+	return 0;
+}
+
+
+static void AddEntry(DiffReport* report, unsigned char kind, const DiffEvent* event, const DiffEvent* other, int trackA, int trackB)
+{
+	if (!report->entries || (report->numEntries >= report->maxEntries))
+		return;
+
+	DiffEntry* entry = &report->entries[report->numEntries++];
+	entry->kind = kind;
+	entry->status = event->message >> 8;
+	entry->data1 = event->message & 0xFF;
+	entry->value = (entry->status >= 0xF0) ? 0 : event->value;
+	entry->otherValue = (other && (entry->status < 0xF0)) ? other->value : 0;
+	entry->trackA = (kind == diffInserted) ? NO_TRACK : trackA;
+	entry->trackB = (kind == diffRemoved) ? NO_TRACK : trackB;
+	entry->tick = event->tick;
+	entry->tickDelta = other ? (long)other->tick - (long)event->tick : 0;
+}
+
+
+static void Pair(DiffScratch* scratch, unsigned int i, unsigned int j, unsigned char state)
+{
+	scratch->state[0][i] = state;
+	scratch->state[1][j] = state;
+	scratch->partner[0][i] = j;
+	scratch->partner[1][j] = i;
+}
+
+
+/* Keeps the indices of still unpaired events, in sorted order. */
+static unsigned int GatherUnpaired(DiffScratch* scratch, int side, unsigned int count)
+{
+	unsigned int n = 0;
+
+	for (unsigned int i=0; i < count; i++) {
+		if (scratch->state[side][i] == unpaired)
+			scratch->unmatched[side][n++] = i;
+	}
+
+	return n;
+}
+
+
+static int DiffTrackPair(ParserContext* a, int trackA, ParserContext* b, int trackB, unsigned long numerator, unsigned long denominator,
+	unsigned long tolerance, DiffScratch* scratch, DiffReport* report)
+{
+	unsigned int na, nb;
+
+	if (CollectEvents(a, trackA, 1, 1, scratch, 0, &na) ||
+		CollectEvents(b, trackB, numerator, denominator, scratch, 1, &nb))
+		return 1;
+
+	const DiffEvent* A = scratch->events[0];
+	const DiffEvent* B = scratch->events[1];
+
+	if (na)
+		memset(scratch->state[0], unpaired, na);
+	if (nb)
+		memset(scratch->state[1], unpaired, nb);
+
+	/* identical events at the same tick */
+	for (unsigned int i=0, j=0; (i < na) && (j < nb); ) {
+		if (EventLess(&A[i], &B[j]))
+			i++;
+		else if (EventLess(&B[j], &A[i]))
+			j++;
+		else
+			Pair(scratch, i++, j++, pairedExact);
+	}
+
+	/* the same message at the same tick with another value */
+	unsigned int* ua = scratch->unmatched[0];
+	unsigned int* ub = scratch->unmatched[1];
+	unsigned int nua = GatherUnpaired(scratch, 0, na);
+	unsigned int nub = GatherUnpaired(scratch, 1, nb);
+
+	for (unsigned int p=0, q=0; (p < nua) && (q < nub); ) {
+		const DiffEvent* x = &A[ua[p]];
+		const DiffEvent* y = &B[ub[q]];
+
+		if ((x->tick == y->tick) && (x->message == y->message))
+			Pair(scratch, ua[p++], ub[q++], pairedModified);
+		else if ((x->tick < y->tick) || ((x->tick == y->tick) && (x->message < y->message)))
+			p++;
+		else
+			q++;
+	}
+
+	/* the same message and value at the nearest tick within tolerance */
+	if (tolerance) {
+		nua = GatherUnpaired(scratch, 0, na);
+		nub = GatherUnpaired(scratch, 1, nb);
+
+		unsigned int low = 0;
+		for (unsigned int p=0; p < nua; p++) {
+			const DiffEvent* x = &A[ua[p]];
+			unsigned int best = NO_PARTNER;
+			unsigned long bestDistance = 0;
+
+			while ((low < nub) && (B[ub[low]].tick + tolerance < x->tick))
+				low++;
+
+			for (unsigned int q=low; (q < nub) && (B[ub[q]].tick <= x->tick + tolerance); q++) {
+				const DiffEvent* y = &B[ub[q]];
+				if ((scratch->state[1][ub[q]] != unpaired) || (y->message != x->message) || (y->value != x->value))
+					continue;
+
+				unsigned long distance = (y->tick > x->tick) ? y->tick - x->tick : x->tick - y->tick;
+				if ((best == NO_PARTNER) || (distance < bestDistance)) {
+					best = ub[q];
+					bestDistance = distance;
+				}
+			}
+
+			if (best != NO_PARTNER)
+				Pair(scratch, ua[p], best, pairedMoved);
+		}
+	}
+
+	/* count, and report in tick order with the first song's events first on a tie */
+	unsigned long numDifferences = 0;
+	for (unsigned int i=0, j=0; (i < na) || (j < nb); ) {
+		if ((j >= nb) || ((i < na) && (A[i].tick <= B[j].tick))) {
+			unsigned char state = scratch->state[0][i];
+			const DiffEvent* other = (state == unpaired) ? NULL : &B[scratch->partner[0][i]];
+
+			if (state == pairedModified) {
+				report->numModified++;
+				AddEntry(report, diffModified, &A[i], other, trackA, trackB);
+			}
+			else if (state == pairedMoved) {
+				report->numMoved++;
+				AddEntry(report, diffMoved, &A[i], other, trackA, trackB);
+			}
+			else if (state == unpaired) {
+				report->numRemoved++;
+				AddEntry(report, diffRemoved, &A[i], NULL, trackA, trackB);
+			}
+			numDifferences += (state != pairedExact);
+			i++;
+		}
+		else {
+			if (scratch->state[1][j] == unpaired) {
+				report->numInserted++;
+				AddEntry(report, diffInserted, &B[j], NULL, trackA, trackB);
+				numDifferences++;
+			}
+			j++;
+		}
+	}
+
+	if ((trackA >= 0) && (trackB >= 0)) {
+		if (numDifferences)
+			report->numChangedTracks++;
+		else
+			report->numIdenticalTracks++;	/* only after rescaling ticks */
+	}
+
+	return 0;
+}
+
+
+static int FingerprintTracks(ParserContext* ctx, DiffScratch* scratch, int side)
+{
+	if (ReserveTrackScratch(scratch, side, ctx->numTracks))
+		return 1;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		scratch->prints[side][t] = FingerprintTrack(ctx, t, &scratch->numHashed[side][t]);
+		scratch->trackPartner[side][t] = -1;
+	}
+
+	return 0;
+}
+
+
+static unsigned short DivisionWord(const FileInfo* fileInfo)
+{
+	if (fileInfo->timeDivisionType == ticksPerBeat)
+		return fileInfo->timeDivision.ticksPerBeat;
+
+	return 0x8000 | (fileInfo->timeDivision.framesPerSecond.smpteFrames << 8) | fileInfo->timeDivision.framesPerSecond.ticksPerFrame;
+}
+
+
+/*
+	Fills report with the differences from a to b, keeping the first
+	report->maxEntries of them in report->entries. Returns 1 if out of
+	memory.
+*/
+int DiffSongs(ParserContext* a, ParserContext* b, unsigned long tolerance, DiffScratch* scratch, DiffReport* report)
+{
+	DiffEntry* entries = report->entries;
+	unsigned int maxEntries = report->maxEntries;
+
+	memset(report, 0, sizeof(DiffReport));
+	report->entries = entries;
+	report->maxEntries = maxEntries;
+
+	unsigned short divisionA = DivisionWord(&a->fileInfo);
+	unsigned short divisionB = DivisionWord(&b->fileInfo);
+	report->headerDiffers = (a->fileInfo.formatType != b->fileInfo.formatType) || (divisionA != divisionB);
+
+	unsigned long numerator = 1;
+	unsigned long denominator = 1;
+	if ((divisionA != divisionB) && divisionA && divisionB && !(divisionA & 0x8000) && !(divisionB & 0x8000)) {
+		numerator = divisionA;
+		denominator = divisionB;
+	}
+
+	if (FingerprintTracks(a, scratch, 0) || FingerprintTracks(b, scratch, 1))
+		return 1;
+
+	int* partnerA = scratch->trackPartner[0];
+	int* partnerB = scratch->trackPartner[1];
+
+	/* identical prints need identical ticks, so they are only trusted without rescaling */
+	for (int pass=0; (pass < 2) && (numerator == denominator); pass++) {
+		for (unsigned int i=0; i < a->numTracks; i++) {
+			if (!scratch->numHashed[0][i] || (partnerA[i] >= 0))
+				continue;
+
+			/* the same position first, then anywhere */
+			unsigned int first = pass ? 0 : i;
+			unsigned int last = pass ? b->numTracks : (i < b->numTracks ? i + 1 : 0);
+			for (unsigned int j=first; j < last; j++) {
+				if (scratch->numHashed[1][j] && (partnerB[j] < 0) &&
+					(CompareFingerprints(&scratch->prints[0][i], &scratch->prints[1][j]) == 0)) {
+					partnerA[i] = j;
+					partnerB[j] = i;
+					report->numIdenticalTracks++;
+					break;
+				}
+			}
+		}
+	}
+
+	/* what is left is paired in file order, and the rest was added or removed */
+	unsigned int i = 0;
+	unsigned int j = 0;
+	for (;;) {
+		while ((i < a->numTracks) && (!scratch->numHashed[0][i] || (partnerA[i] >= 0)))
+			i++;
+		while ((j < b->numTracks) && (!scratch->numHashed[1][j] || (partnerB[j] >= 0)))
+			j++;
+
+		int trackA = (i < a->numTracks) ? (int)i++ : -1;
+		int trackB = (j < b->numTracks) ? (int)j++ : -1;
+		if ((trackA < 0) && (trackB < 0))
+			break;
+
+		if (trackA < 0)
+			report->numAddedTracks++;
+		else if (trackB < 0)
+			report->numRemovedTracks++;
+
+		if (DiffTrackPair(a, trackA, b, trackB, numerator, denominator, tolerance, scratch, report))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+int SongsDiffer(const DiffReport* report)
+{
+	return report->headerDiffers || report->numInserted || report->numRemoved || report->numModified || report->numMoved;
+}
+
+
+/* Writes a line such as "~ track 1 tick 480: note_on ch 0 key 60 value 80 -> 96". */
+unsigned int FormatDiffEntry(const DiffEntry* entry, char* out, unsigned int size)
+{
+	static const char symbols[4] = { '+', '-', '~', '>' };
+	static const char* names[7] = { "note_off", "note_on", "poly_pressure", "control_change",
+		"program_change", "channel_pressure", "pitch_bend" };
+	char message[64];
+
+	if (entry->status == 0xFF)
+		snprintf(message, sizeof(message), "meta 0x%02x", entry->data1);
+	else if (entry->status >= 0xF0)
+		snprintf(message, sizeof(message), "sysex 0x%02x", entry->status);
+	else if ((entry->status & 0xF0) == 0xB0)
+		snprintf(message, sizeof(message), "%s ch %u cc %u value %u", names[(entry->status >> 4) & 0x07],
+			entry->status & 0x0F, entry->data1, entry->value);
+	else if ((entry->status & 0xF0) <= 0xA0)
+		snprintf(message, sizeof(message), "%s ch %u key %u value %u", names[(entry->status >> 4) & 0x07],
+			entry->status & 0x0F, entry->data1, entry->value);
+	else
+		snprintf(message, sizeof(message), "%s ch %u value %u", names[(entry->status >> 4) & 0x07],
+			entry->status & 0x0F, entry->value);
+
+	unsigned int track = (entry->kind == diffInserted) ? entry->trackB : entry->trackA;
+	unsigned int length = snprintf(out, size, "%c track %u tick %lu: %s", symbols[entry->kind & 3], track, entry->tick, message);
+	if (length >= size)
+		return length;
+
+	if (entry->kind == diffModified)
+		length += (entry->status >= 0xF0) ? snprintf(out + length, size - length, " changed") :
+			snprintf(out + length, size - length, " -> %u", entry->otherValue);
+	else if (entry->kind == diffMoved)
+		length += snprintf(out + length, size - length, " moved %+ld", entry->tickDelta);
+
+	return length;
+}
+
+
+typedef struct {
+	DiffPair* pairs;
+	ParserContext** contexts;	/* two per worker */
+	DiffScratch* scratch;
+	unsigned long tolerance;
+} DiffJob;
+
+
+static void DiffPairTask(void* arg, unsigned int index, unsigned int worker)
+{
+	DiffJob* job = (DiffJob *)arg;
+	DiffPair* pair = &job->pairs[index];
+	ParserContext* a = job->contexts[2 * worker];
+	ParserContext* b = job->contexts[2 * worker + 1];
+
+	memset(&pair->report, 0, sizeof(DiffReport));
+	pair->status = ParseMidiFile(a, pair->first) || ParseMidiFile(b, pair->second);
+	if (pair->status == 0)
+		pair->status = DiffSongs(a, b, job->tolerance, &job->scratch[worker], &pair->report);
+}
+
+
+/*
+	Compares every pair on up to numThreads threads, each reusing its own
+	two contexts and scratch. Only counts are kept. Returns the number of
+	pairs that differ, or -1 with every pair marked as failed if the
+	workers could not be set up.
+*/
+int DiffPairs(DiffPair* pairs, unsigned int count, unsigned int numThreads, unsigned long tolerance)
+{
+	DiffJob job;
+	int numDiffering = 0;
+	int res = 0;
+
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+
+	job.pairs = pairs;
+	job.tolerance = tolerance;
+	job.contexts = (ParserContext **)calloc(2 * numThreads, sizeof(ParserContext *));
+	job.scratch = (DiffScratch *)malloc(numThreads * sizeof(DiffScratch));
+
+	if (!job.contexts || !job.scratch)
+		res = 1;
+
+	for (unsigned int i=0; (res == 0) && (i < numThreads); i++) {
+		InitDiffScratch(&job.scratch[i]);
+		job.contexts[2 * i] = CreateParserContext();
+		job.contexts[2 * i + 1] = CreateParserContext();
+	}
+
+	for (unsigned int i=0; (res == 0) && (i < 2 * numThreads); i++) {
+		if (!job.contexts[i])
+			res = 1;
+	}
+
+	if (res == 0)
+		ParallelFor(count, numThreads, DiffPairTask, &job);
+
+	for (unsigned int i=0; job.contexts && job.scratch && (i < numThreads); i++) {
+		FreeParserContext(job.contexts[2 * i]);
+		FreeParserContext(job.contexts[2 * i + 1]);
+		FreeDiffScratch(&job.scratch[i]);
+	}
+
+	free(job.contexts);
+	free(job.scratch);
+
+	if (res) {
+		for (unsigned int i=0; i < count; i++) {
+			memset(&pairs[i].report, 0, sizeof(DiffReport));
+			pairs[i].status = 1;
+		}
+		return -1;
+	}
+
+	for (unsigned int i=0; i < count; i++) {
+		if ((pairs[i].status == 0) && SongsDiffer(&pairs[i].report))
+			numDiffering++;
+	}
+
+	return numDiffering;
+}
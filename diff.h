@@ -0,0 +1,96 @@
+#ifndef __DIFF_H__
+#define __DIFF_H__
+
+#include "context.h"
+#include "fingerprint.h"
+
+/*
+	Structural comparison of two decoded songs. Tracks are paired by
+	their fingerprints first, so identical tracks are skipped without
+	looking at their events, even if the tracks were reordered. The
+	remaining tracks are paired in file order and their events aligned
+	by absolute tick, after the same normalisation as fingerprints (note
+	on with velocity 0 is note off, note off velocity and text metas are
+	ignored). Events that do not line up exactly are reported as
+	modified (same tick and message, other value), moved (same message
+	within tolerance ticks) or inserted and removed.
+
+	If both files count ticks per beat but at different rates, ticks of
+	the second file are rescaled to the first before aligning.
+
+	A DiffScratch holds the working arrays and only ever grows, so one
+	per thread makes repeated comparisons allocation free.
+*/
+
+enum DiffKind {
+	diffInserted = 0,		/* only in the second song */
+	diffRemoved = 1,		/* only in the first song */
+	diffModified = 2,
+	diffMoved = 3,
+};
+
+typedef struct {
+	unsigned char kind;
+	unsigned char status;		/* resolved status, 0xFF for metas */
+	unsigned char data1;		/* key, controller or meta subtype */
+	unsigned short value;		/* velocity, value or bend in the first song, or the second if inserted */
+	unsigned short otherValue;	/* in the second song, if modified */
+	unsigned short trackA;		/* 0xFFFF if the event is not in that song */
+	unsigned short trackB;
+	unsigned long tick;		/* in the first song, or the second if inserted */
+	long tickDelta;			/* second minus first, if moved */
+} DiffEntry;
+
+typedef struct {
+	int headerDiffers;
+	unsigned int numIdenticalTracks;
+	unsigned int numChangedTracks;	/* paired tracks whose events differ */
+	unsigned int numAddedTracks;
+	unsigned int numRemovedTracks;
+	unsigned long numInserted;
+	unsigned long numRemoved;
+	unsigned long numModified;
+	unsigned long numMoved;
+
+	DiffEntry* entries;		/* caller owned, may be NULL */
+	unsigned int maxEntries;
+	unsigned int numEntries;	/* the first differences in tick order per track */
+} DiffReport;
+
+typedef struct {
+	unsigned long tick;
+	unsigned long long value;	/* data2, or a hash of meta and sysex payloads */
+	unsigned short message;		/* status << 8 | data1 */
+} DiffEvent;
+
+typedef struct {
+	DiffEvent* events[2];
+	unsigned int* partner[2];	/* index of the paired event in the other song */
+	unsigned int* unmatched[2];
+	unsigned char* state[2];
+	unsigned int capacity[2];
+
+	Fingerprint* prints[2];
+	unsigned long* numHashed[2];
+	int* trackPartner[2];
+	unsigned int trackCapacity[2];
+} DiffScratch;
+
+typedef struct {
+	const char* first;
+	const char* second;
+	int status;			/* 0 if both files parsed */
+	DiffReport report;		/* counts only */
+} DiffPair;
+
+
+void InitDiffScratch(DiffScratch* scratch);
+void FreeDiffScratch(DiffScratch* scratch);
+
+int DiffSongs(ParserContext* a, ParserContext* b, unsigned long tolerance, DiffScratch* scratch, DiffReport* report);
+int SongsDiffer(const DiffReport* report);
+unsigned int FormatDiffEntry(const DiffEntry* entry, char* out, unsigned int size);
+
+int DiffPairs(DiffPair* pairs, unsigned int count, unsigned int numThreads, unsigned long tolerance);
+
+#endif
@@ -1,4 +1,5 @@
 #include "events.h"
+#include "visitor.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -74,29 +75,22 @@ void PrintMetaEvent(Event* event)
 	switch(event->subtype) {
 		case 0x03: // Track name
 		{
-			unsigned char* name = malloc(event->size + 1);
-			memcpy(name, event->data, event->size);
-			name[event->size] = '\0';
-
-			printf("Track name: %s\n", name);
+			printf("Track name: %.*s\n", (int)event->size, event->data);
 			return;
 		}
 		case 0x04: // Instrument name
 		{
-			unsigned char* name = malloc(event->size + 1);
-			name[event->size] = '\0';
-			memcpy(name, event->data, event->size);
-
-			printf("Instrument name: %s\n", name);
+			printf("Instrument name: %.*s\n", (int)event->size, event->data);
 			return;
 		}
 		case 0x05: // Lyrics
 		{
-			unsigned char* lyrics = malloc(event->size + 1);
-			lyrics[event->size] = '\0';
-			memcpy(lyrics, event->data, event->size);
-
-			printf("Lyrics: %s\n", lyrics);
+			printf("Lyrics: %.*s\n", (int)event->size, event->data);
+			return;
+		}
+		case 0x06: // Marker
+		{
+			printf("Marker: %.*s\n", (int)event->size, event->data);
 			return;
 		}
 		case 0x51: // Set tempo
@@ -173,6 +167,18 @@ unsigned char* GetTrackName(Track track)
 }
 
 
+Event* FindMetaEvent(Event* events, unsigned int numEvents, unsigned char subtype)
+{
+	for (unsigned int i=0; i < numEvents; i++) {
+		if ((events[i].type == 0xFF) && (events[i].subtype == subtype)) {
+			return &events[i];
+		}
+	}
+
+	return NULL;
+}
+
+
 void PrintSysexEvent(Event* event)
 {
 	printf("%02x SysEx event: 0x", event->type);
@@ -353,18 +359,7 @@ unsigned int SizeForMidiEvent(Event event)
 
 
 void PrintEvent(Event* event) {
-	printf("dTime: %lu\n", event->time);
-	switch(event->type) {
-		case 0xFF:
-			return PrintMetaEvent(event);
-		case 0xF0:
-		case 0xF7:
-			return PrintSysexEvent(event);
-		default: {
-			return PrintMidiEvent(event);
-			printf("Unrecognised event type: 0x%2x\n", event->type);
-		}
-	}
+	DispatchEvent(&PrintVisitor, NULL, 0, event->time, event);
 }
 
 union TimeDivision GetTimeDivision( unsigned short tDivData )
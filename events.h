@@ -34,12 +34,12 @@ enum TimeDivType {
 struct FramesPerSecond {
 	unsigned short smpteFrames;
 	unsigned short ticksPerFrame;
-} FramesPerSecond;
+};
 
 union TimeDivision {
 	struct FramesPerSecond framesPerSecond;
 	unsigned short ticksPerBeat;
-} TimeDivision;
+};
 
 typedef struct {
 	unsigned short formatType;
@@ -53,12 +53,12 @@ struct TimeSignature {
 	unsigned short denominator;
 	unsigned short clocksPerClick;
 	unsigned short notesPerQuarterNote;
-} TimeSignature;
+};
 
 struct KeySignature {
 	signed short sf;
 	signed short mi;
-} KeySignature;
+};
 
 
 unsigned int GetTempoBPM(unsigned char* buffer);
@@ -68,7 +68,11 @@ void PrintFileInfo(FileInfo* fileInfo);
 int IsValidMidiEventType(unsigned char typeByte);
 unsigned int SizeForMidiEvent(Event event);
 unsigned char* GetTrackName(Track track);
+Event* FindMetaEvent(Event* events, unsigned int numEvents, unsigned char subtype);
 void PrintEvent(Event* event);
+void PrintMetaEvent(Event* event);
+void PrintSysexEvent(Event* event);
+void PrintMidiEvent(Event* event);
 union TimeDivision GetTimeDivision(unsigned short tDivData);
 enum TimeDivType GetTimeDivisionType(unsigned short timeDivData);
 
@@ -0,0 +1,558 @@
+/*
+	fanout.c :	Decode-once pipeline that feeds several visitors on their
+			own threads, and the stats, NDJSON and fingerprint sinks
+*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fanout.h"
+
+
+enum RecordKind {
+	recordTrackStart = 0,
+	recordEvent = 1,
+};
+
+typedef struct {
+	unsigned long tick;
+	unsigned int track;
+	unsigned int kind;
+	Event event;
+} FanoutRecord;
+
+typedef struct {
+	int hasHeader;			/* fileInfo comes before the records */
+	FileInfo fileInfo;
+	unsigned int numRecords;
+	FanoutRecord records[FANOUT_BATCH_EVENTS];
+} FanoutBatch;
+
+struct Fanout;
+
+typedef struct {
+	_Alignas(64) _Atomic unsigned long consumed;	/* batches released, own cache line */
+	struct Fanout* fanout;
+	FanoutSink* sink;
+	pthread_t thread;
+} SinkThread;
+
+typedef struct Fanout {
+	FanoutBatch* ring;
+	_Alignas(64) _Atomic unsigned long published;	/* batches the decoder has filled */
+	_Atomic int finished;
+	_Atomic unsigned int numStopped;
+
+	SinkThread threads[FANOUT_MAX_SINKS];
+	unsigned int numSinks;
+
+	FanoutBatch* current;		/* being filled, NULL until a slot is free */
+	FanoutStats* stats;
+} Fanout;
+
+
+/* Spins briefly, then yields, then sleeps, so a long wait costs no CPU. */
+static void Backoff(unsigned int* spins)
+{
+	if (*spins >= 256) {
+		struct timespec pause = { 0, 50000 };
+		nanosleep(&pause, NULL);
+	}
+	else if (*spins >= 16) {
+		sched_yield();
+	}
+
+	(*spins)++;
+}
+
+
+/* Waits until every sink has released the slot batch n goes into. */
+static void AcquireSlot(Fanout* fanout, unsigned long n)
+{
+	for (unsigned int i=0; i < fanout->numSinks; i++) {
+		unsigned int spins = 0;
+
+		while (n - atomic_load_explicit(&fanout->threads[i].consumed, memory_order_acquire) >= FANOUT_RING_BATCHES) {
+			if (!spins)
+				fanout->stats->numStalls++;
+			Backoff(&spins);
+		}
+	}
+
+	fanout->current = &fanout->ring[n % FANOUT_RING_BATCHES];
+	fanout->current->hasHeader = 0;
+	fanout->current->numRecords = 0;
+}
+
+
+static void PublishBatch(Fanout* fanout)
+{
+	if (!fanout->current)
+		return;
+
+	unsigned long n = atomic_load_explicit(&fanout->published, memory_order_relaxed);
+	atomic_store_explicit(&fanout->published, n + 1, memory_order_release);
+
+	fanout->current = NULL;
+	fanout->stats->numBatches++;
+}
+
+
+static int AppendRecord(Fanout* fanout, unsigned int kind, unsigned int track, unsigned long tick, const Event* event)
+{
+	if (atomic_load_explicit(&fanout->numStopped, memory_order_relaxed) == fanout->numSinks)
+		return visitStop;
+
+	if (!fanout->current)
+		AcquireSlot(fanout, atomic_load_explicit(&fanout->published, memory_order_relaxed));
+
+	FanoutBatch* batch = fanout->current;
+	FanoutRecord* record = &batch->records[batch->numRecords++];
+	record->tick = tick;
+	record->track = track;
+	record->kind = kind;
+	if (event) {
+		record->event = *event;
+		fanout->stats->numEvents++;
+	}
+
+	if (batch->numRecords == FANOUT_BATCH_EVENTS)
+		PublishBatch(fanout);
+
+	return visitContinue;
+}
+
+
+static int CaptureHeader(void* user, const FileInfo* fileInfo)
+{
+	Fanout* fanout = (Fanout *)user;
+
+	/* a header always starts a batch so sinks see it before later events */
+	if (fanout->current && fanout->current->numRecords)
+		PublishBatch(fanout);
+	if (!fanout->current)
+		AcquireSlot(fanout, atomic_load_explicit(&fanout->published, memory_order_relaxed));
+
+	fanout->current->hasHeader = 1;
+	fanout->current->fileInfo = *fileInfo;
+
+	return visitContinue;
+}
+
+
+static int CaptureTrackStart(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	return AppendRecord((Fanout *)user, recordTrackStart, track, tick, NULL);
+}
+
+
+static int CaptureEvent(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	return AppendRecord((Fanout *)user, recordEvent, track, tick, event);
+}
+
+
+static const MidiVisitor CaptureVisitor = {
+	CaptureHeader,
+	CaptureTrackStart,
+	CaptureEvent,
+	CaptureEvent,
+	CaptureEvent,
+	CaptureEvent,
+};
+
+
+/*
+	Hands one batch to the sink's visitor. skipTrack holds the track the
+	visitor asked to skip, or -1.
+*/
+static int ReplayBatch(FanoutSink* sink, const FanoutBatch* batch, long* skipTrack)
+{
+	const MidiVisitor* visitor = sink->visitor;
+
+	if (batch->hasHeader && visitor->header && (visitor->header(sink->user, &batch->fileInfo) == visitStop))
+		return visitStop;
+
+	for (unsigned int i=0; i < batch->numRecords; i++) {
+		const FanoutRecord* record = &batch->records[i];
+		int res = visitContinue;
+
+		if (record->kind == recordTrackStart) {
+			*skipTrack = -1;
+			if (visitor->trackStart)
+				res = visitor->trackStart(sink->user, record->track, 0, NULL);
+		}
+		else {
+			if ((long)record->track == *skipTrack)
+				continue;
+			sink->numEvents++;
+			res = DispatchEvent(visitor, sink->user, record->track, record->tick, &record->event);
+		}
+
+		if (res == visitStop)
+			return visitStop;
+		if (res == visitSkipTrack)
+			*skipTrack = record->track;
+	}
+
+	return visitContinue;
+}
+
+
+static void* RunSink(void* arg)
+{
+	SinkThread* thread = (SinkThread *)arg;
+	Fanout* fanout = thread->fanout;
+	FanoutSink* sink = thread->sink;
+	unsigned long cursor = 0;
+	unsigned int spins = 0;
+	long skipTrack = -1;
+
+	for (;;) {
+		unsigned long published = atomic_load_explicit(&fanout->published, memory_order_acquire);
+
+		if (cursor == published) {
+			/* the final batch is published before finished is set */
+			if (atomic_load_explicit(&fanout->finished, memory_order_acquire) &&
+				(cursor == atomic_load_explicit(&fanout->published, memory_order_acquire)))
+				break;
+			if (!spins)
+				sink->numStalls++;
+			Backoff(&spins);
+			continue;
+		}
+
+		spins = 0;
+		while (cursor < published) {
+			/* a stopped sink keeps releasing batches so it never holds up the decoder */
+			if (!sink->stopped && (ReplayBatch(sink, &fanout->ring[cursor % FANOUT_RING_BATCHES], &skipTrack) == visitStop)) {
+				sink->stopped = 1;
+				atomic_fetch_add_explicit(&fanout->numStopped, 1, memory_order_relaxed);
+			}
+			atomic_store_explicit(&thread->consumed, ++cursor, memory_order_release);
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+	Returns 0 when the whole file was decoded (or every sink stopped) and
+	1 if it could not be read or is malformed, in which case the sinks
+	may have seen part of it.
+*/
+int RunFanout(const char* filename, FanoutSink* sinks, unsigned int numSinks, FanoutStats* stats)
+{
+	FanoutStats localStats;
+	const unsigned char* data;
+	unsigned long size;
+	int inflated;
+
+	if (numSinks > FANOUT_MAX_SINKS)
+		return 1;
+	if (!stats)
+		stats = &localStats;
+	memset(stats, 0, sizeof(FanoutStats));
+
+	if (MapMidiFile(filename, &data, &size, &inflated) != 0)
+		return 1;
+
+	Fanout* fanout = (Fanout *)aligned_alloc(64, sizeof(Fanout));
+	FanoutBatch* ring = (FanoutBatch *)malloc(FANOUT_RING_BATCHES * sizeof(FanoutBatch));
+	if (!fanout || !ring) {
+		free(fanout);
+		free(ring);
+		UnmapMidiFile(data, size, inflated);
+		return 1;
+	}
+
+	memset(fanout, 0, sizeof(Fanout));
+	fanout->ring = ring;
+	fanout->stats = stats;
+	atomic_init(&fanout->published, 0);
+	atomic_init(&fanout->finished, 0);
+	atomic_init(&fanout->numStopped, 0);
+
+	int res = 0;
+	for (unsigned int i=0; i < numSinks; i++) {
+		SinkThread* thread = &fanout->threads[i];
+		sinks[i].numEvents = 0;
+		sinks[i].numStalls = 0;
+		sinks[i].stopped = 0;
+
+		atomic_init(&thread->consumed, 0);
+		thread->fanout = fanout;
+		thread->sink = &sinks[i];
+		if (pthread_create(&thread->thread, NULL, RunSink, thread) != 0) {
+			res = 1;
+			break;
+		}
+		fanout->numSinks++;
+	}
+
+	if (res == 0) {
+		res = VisitMidiBuffer(data, size, &CaptureVisitor, fanout);
+		PublishBatch(fanout);
+	}
+	atomic_store_explicit(&fanout->finished, 1, memory_order_release);
+
+	for (unsigned int i=0; i < fanout->numSinks; i++)
+		pthread_join(fanout->threads[i].thread, NULL);
+
+	free(ring);
+	free(fanout);
+	UnmapMidiFile(data, size, inflated);
+
+	return res;
+}
+
+
+static int StatsHeaderVisit(void* user, const FileInfo* fileInfo)
+{
+	((MidiStats *)user)->fileInfo = *fileInfo;
+
+	return visitContinue;
+}
+
+
+static int StatsTrackStartVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	((MidiStats *)user)->numTracks++;
+
+	return visitContinue;
+}
+
+
+static void CountEvent(MidiStats* stats, unsigned long tick)
+{
+	stats->numEvents++;
+	if (tick > stats->lastTick)
+		stats->lastTick = tick;
+}
+
+
+static int StatsChannelVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	MidiStats* stats = (MidiStats *)user;
+
+	CountEvent(stats, tick);
+	stats->numChannelMessages++;
+	stats->channelMask |= 1 << (event->type & 0x0F);
+
+	if (((event->type & 0xF0) == 0x90) && (event->size > 1) && event->data[1]) {
+		unsigned char key = event->data[0];
+
+		if (!stats->numNotes || (key < stats->lowestNote))
+			stats->lowestNote = key;
+		if (!stats->numNotes || (key > stats->highestNote))
+			stats->highestNote = key;
+		stats->numNotes++;
+	}
+
+	return visitContinue;
+}
+
+
+static int StatsMetaVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	MidiStats* stats = (MidiStats *)user;
+
+	CountEvent(stats, tick);
+	stats->numMetas++;
+	if (event->subtype == 0x51)
+		stats->numTempoChanges++;
+
+	return visitContinue;
+}
+
+
+static int StatsSysexVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	MidiStats* stats = (MidiStats *)user;
+
+	CountEvent(stats, tick);
+	stats->numSysex++;
+
+	return visitContinue;
+}
+
+
+const MidiVisitor StatsVisitor = {
+	StatsHeaderVisit,
+	StatsTrackStartVisit,
+	StatsChannelVisit,
+	StatsMetaVisit,
+	StatsSysexVisit,
+	StatsMetaVisit,
+};
+
+
+static void WriteHexData(FILE* out, const Event* event)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	fputc('"', out);
+	for (unsigned int i=0; i < event->size; i++) {
+		fputc(digits[event->data[i] >> 4], out);
+		fputc(digits[event->data[i] & 0x0F], out);
+	}
+	fputc('"', out);
+}
+
+
+static int NdjsonHeaderVisit(void* user, const FileInfo* fileInfo)
+{
+	FILE* out = (FILE *)user;
+
+	fprintf(out, "{\"type\":\"header\",\"format\":%u,\"tracks\":%u,", fileInfo->formatType, fileInfo->numTracks);
+	if (fileInfo->timeDivisionType == ticksPerBeat)
+		fprintf(out, "\"ticksPerBeat\":%u}\n", fileInfo->timeDivision.ticksPerBeat);
+	else
+		fprintf(out, "\"smpteFrames\":%u,\"ticksPerFrame\":%u}\n", fileInfo->timeDivision.framesPerSecond.smpteFrames,
+			fileInfo->timeDivision.framesPerSecond.ticksPerFrame);
+
+	return visitContinue;
+}
+
+
+static int NdjsonTrackStartVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	fprintf((FILE *)user, "{\"type\":\"track_start\",\"track\":%u}\n", track);
+
+	return visitContinue;
+}
+
+
+static int NdjsonChannelVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	static const char* names[8] = { "note_off", "note_on", "poly_pressure", "control_change",
+		"program_change", "channel_pressure", "pitch_bend", "system" };
+	FILE* out = (FILE *)user;
+
+	fprintf(out, "{\"type\":\"%s\",\"track\":%u,\"tick\":%lu,\"channel\":%u,\"data\":[", names[(event->type >> 4) & 0x07],
+		track, tick, event->type & 0x0F);
+	for (unsigned int i=0; i < event->size; i++)
+		fprintf(out, i ? ",%u" : "%u", event->data[i]);
+	fputs("]}\n", out);
+
+	return visitContinue;
+}
+
+
+static int NdjsonMetaVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	FILE* out = (FILE *)user;
+
+	fprintf(out, "{\"type\":\"meta\",\"track\":%u,\"tick\":%lu,\"subtype\":%u,\"data\":", track, tick, event->subtype);
+	WriteHexData(out, event);
+	fputs("}\n", out);
+
+	return visitContinue;
+}
+
+
+static int NdjsonSysexVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	FILE* out = (FILE *)user;
+
+	fprintf(out, "{\"type\":\"sysex\",\"track\":%u,\"tick\":%lu,\"status\":%u,\"data\":", track, tick, event->type);
+	WriteHexData(out, event);
+	fputs("}\n", out);
+
+	return visitContinue;
+}
+
+
+static int NdjsonEndOfTrackVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	fprintf((FILE *)user, "{\"type\":\"end_of_track\",\"track\":%u,\"tick\":%lu}\n", track, tick);
+
+	return visitContinue;
+}
+
+
+const MidiVisitor NdjsonVisitor = {
+	NdjsonHeaderVisit,
+	NdjsonTrackStartVisit,
+	NdjsonChannelVisit,
+	NdjsonMetaVisit,
+	NdjsonSysexVisit,
+	NdjsonEndOfTrackVisit,
+};
+
+
+static int FingerprintHeaderVisit(void* user, const FileInfo* fileInfo)
+{
+	((FingerprintSinkState *)user)->fileInfo = *fileInfo;
+
+	return visitContinue;
+}
+
+
+static int FingerprintTrackStartVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	FingerprintInit(&((FingerprintSinkState *)user)->track);
+
+	return visitContinue;
+}
+
+
+static int FingerprintEventVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	FingerprintFeedEvent(&((FingerprintSinkState *)user)->track, tick, event);
+
+	return visitContinue;
+}
+
+
+static int FingerprintEndOfTrackVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	FingerprintSinkState* state = (FingerprintSinkState *)user;
+
+	/* empty tracks do not contribute, as in FingerprintSong */
+	if (!state->track.numEvents)
+		return visitContinue;
+
+	if (state->numPrints == state->printCapacity) {
+		unsigned int capacity = state->printCapacity ? state->printCapacity * 2 : 16;
+		Fingerprint* prints = (Fingerprint *)realloc(state->prints, capacity * sizeof(Fingerprint));
+		if (!prints)
+			return visitStop;
+		state->prints = prints;
+		state->printCapacity = capacity;
+	}
+
+	state->prints[state->numPrints++] = FingerprintFinish(&state->track);
+
+	return visitContinue;
+}
+
+
+const MidiVisitor FingerprintVisitor = {
+	FingerprintHeaderVisit,
+	FingerprintTrackStartVisit,
+	FingerprintEventVisit,
+	FingerprintEventVisit,
+	FingerprintEventVisit,
+	FingerprintEndOfTrackVisit,
+};
+
+
+/* Combines the track prints and frees them. */
+Fingerprint FinishFingerprintSink(FingerprintSinkState* state)
+{
+	Fingerprint song = CombineTrackPrints(state->prints, state->numPrints, &state->fileInfo);
+
+	free(state->prints);
+	state->prints = NULL;
+	state->numPrints = 0;
+	state->printCapacity = 0;
+
+	return song;
+}
@@ -0,0 +1,78 @@
+#ifndef __FANOUT_H__
+#define __FANOUT_H__
+
+#include "events.h"
+#include "visitor.h"
+#include "fingerprint.h"
+
+/*
+	Decode once, consume many times. RunFanout decodes a file on the
+	calling thread into batches of events kept in a small ring, and every
+	sink replays the batches through its own MidiVisitor on a thread of
+	its own. The ring needs no locks: the decoder publishes a batch by
+	advancing one cursor and each sink releases it by advancing its own,
+	so a slot is refilled only once the slowest sink is done with it. A
+	full ring stalls the decoder and an empty one stalls the sinks, which
+	bounds memory to FANOUT_RING_BATCHES batches whatever the file size.
+
+	Sinks get the same callbacks in the same order as from VisitMidiFile.
+	visitSkipTrack skips the rest of the track for that sink only, and
+	visitStop detaches it without holding back the others. Event data
+	points into the file, which stays mapped until every sink is done.
+*/
+
+#define FANOUT_BATCH_EVENTS 4096
+#define FANOUT_RING_BATCHES 8
+#define FANOUT_MAX_SINKS 16
+
+typedef struct {
+	const MidiVisitor* visitor;
+	void* user;
+
+	/* filled in by RunFanout */
+	unsigned long numEvents;	/* events handed to the visitor */
+	unsigned long numStalls;	/* times it waited for the decoder */
+	int stopped;			/* a callback returned visitStop */
+} FanoutSink;
+
+typedef struct {
+	unsigned long numEvents;
+	unsigned long numBatches;
+	unsigned long numStalls;	/* times the decoder waited for a sink */
+} FanoutStats;
+
+typedef struct {
+	FileInfo fileInfo;
+	unsigned int numTracks;
+	unsigned long numEvents;
+	unsigned long numChannelMessages;
+	unsigned long numNotes;		/* note ons with a velocity */
+	unsigned long numMetas;
+	unsigned long numSysex;
+	unsigned long numTempoChanges;
+	unsigned long lastTick;
+	unsigned short channelMask;	/* bit n set if channel n is used */
+	unsigned char lowestNote;
+	unsigned char highestNote;
+} MidiStats;
+
+typedef struct {
+	FileInfo fileInfo;
+	FingerprintState track;
+	Fingerprint* prints;		/* one per non-empty track */
+	unsigned int numPrints;
+	unsigned int printCapacity;
+} FingerprintSinkState;
+
+
+/* user is a zeroed MidiStats */
+extern const MidiVisitor StatsVisitor;
+/* user is a FILE*; writes one JSON object per line */
+extern const MidiVisitor NdjsonVisitor;
+/* user is a zeroed FingerprintSinkState; same print as FingerprintSong */
+extern const MidiVisitor FingerprintVisitor;
+
+Fingerprint FinishFingerprintSink(FingerprintSinkState* state);
+int RunFanout(const char* filename, FanoutSink* sinks, unsigned int numSinks, FanoutStats* stats);
+
+#endif
@@ -0,0 +1,338 @@
+/*
+	fingerprint.c :	128-bit fingerprints of tracks and songs, used to
+			find musically identical files in large corpora
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "fingerprint.h"
+
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+
+
+static unsigned long long RotateLeft(unsigned long long value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+
+static unsigned long long Round(unsigned long long acc, unsigned long long input)
+{
+	acc += input * PRIME2;
+	acc = RotateLeft(acc, 31);
+
+	return acc * PRIME1;
+}
+
+
+static unsigned long long Avalanche(unsigned long long hash)
+{
+	hash ^= hash >> 33;
+	hash *= PRIME2;
+	hash ^= hash >> 29;
+	hash *= PRIME3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+
+unsigned long long HashBytes(const void* data, unsigned long size, unsigned long long seed)
+{
+	const unsigned char* bytes = (const unsigned char *)data;
+	unsigned long long hash = seed + PRIME4 + size;
+	unsigned long offset = 0;
+
+	for (; offset + 8 <= size; offset += 8) {
+		unsigned long long word;
+		memcpy(&word, bytes + offset, 8);
+		hash = Round(hash, word);
+	}
+
+	unsigned long long tail = 0;
+	for (unsigned int i=0; offset + i < size; i++) {
+		tail |= (unsigned long long)bytes[offset + i] << (8 * i);
+	}
+
+	return Avalanche(Round(hash, tail));
+}
+
+
+/*
+	Packs an event into a single word after normalisation. Returns 0 for
+	events that do not contribute to the fingerprint.
+*/
+static int NormaliseEvent(const Event* event, unsigned long long* word)
+{
+	if (event->type == 0xFF) {
+		switch (event->subtype) {
+			case 0x51: // Set tempo
+			case 0x54: // SMPTE offset
+			case 0x58: // Set time signature
+			case 0x59: // Set key signature
+				*word = HashBytes(event->data, event->size, 0xFF00 | event->subtype);
+				return 1;
+			default:
+				return 0;
+		}
+	}
+
+	if ((event->type == 0xF0) || (event->type == 0xF7)) {
+		*word = HashBytes(event->data, event->size, 0xF000 | event->type);
+		return 1;
+	}
+
+	unsigned char status = event->type;
+	unsigned char data1 = event->data[0];
+	unsigned char data2 = (event->size > 1) ? event->data[1] : 0;
+
+	if (((status & 0xF0) == 0x90) && (data2 == 0)) {
+		status = 0x80 | (status & 0x0F);
+	}
+	if ((status & 0xF0) == 0x80) {
+		data2 = 0;
+	}
+
+	*word = ((unsigned long long)status << 16) | (data1 << 8) | data2;
+
+	return 1;
+}
+
+
+static void FlushGroup(FingerprintState* state)
+{
+	if (!state->groupCount)
+		return;
+
+	unsigned long long groupWord = Avalanche(state->groupSum ^ RotateLeft(state->groupXor, 17)) ^ state->groupCount;
+
+	state->laneA = Round(state->laneA, state->groupTick);
+	state->laneA = Round(state->laneA, groupWord);
+	state->laneB = Round(state->laneB, groupWord ^ PRIME3);
+	state->laneB = Round(state->laneB, RotateLeft(state->groupTick, 32));
+	state->numGroups++;
+
+	state->groupSum = 0;
+	state->groupXor = 0;
+	state->groupCount = 0;
+}
+
+
+void FingerprintInit(FingerprintState* state)
+{
+	memset(state, 0, sizeof(FingerprintState));
+	state->laneA = PRIME1 + PRIME2;
+	state->laneB = PRIME4;
+}
+
+
+void FingerprintFeedEvent(FingerprintState* state, unsigned long tick, const Event* event)
+{
+	unsigned long long word;
+
+	if (!NormaliseEvent(event, &word))
+		return;
+
+	if (state->groupCount && (tick != state->groupTick)) {
+		FlushGroup(state);
+	}
+
+	/* events sharing a tick are combined order-independently */
+	unsigned long long mixed = Avalanche(word + PRIME3);
+	state->groupTick = tick;
+	state->groupSum += mixed;
+	state->groupXor ^= RotateLeft(mixed, 23) * PRIME4;
+	state->groupCount++;
+	state->numEvents++;
+}
+
+
+Fingerprint FingerprintFinish(FingerprintState* state)
+{
+	Fingerprint print;
+
+	FlushGroup(state);
+
+	print.lo = Avalanche(state->laneA ^ state->numGroups);
+	print.hi = Avalanche(state->laneB ^ RotateLeft(print.lo, 29) ^ state->numEvents);
+
+	return print;
+}
+
+
+Fingerprint FingerprintTrack(ParserContext* ctx, unsigned int track, unsigned long* numHashed)
+{
+	FingerprintState state;
+	Event* events = ContextTrackEvents(ctx, track);
+	unsigned long* ticks = ContextTrackTicks(ctx, track);
+	unsigned int numEvents = ctx->tracks[track].numEvents;
+
+	FingerprintInit(&state);
+	for (unsigned int i=0; i < numEvents; i++) {
+		FingerprintFeedEvent(&state, ticks[i], &events[i]);
+	}
+
+	if (numHashed)
+		*numHashed = state.numEvents;
+
+	return FingerprintFinish(&state);
+}
+
+
+int CompareFingerprints(const Fingerprint* a, const Fingerprint* b)
+{
+	if (a->hi != b->hi)
+		return (a->hi < b->hi) ? -1 : 1;
+	if (a->lo != b->lo)
+		return (a->lo < b->lo) ? -1 : 1;
+
+	return 0;
+}
+
+
+static int CompareFingerprintsQsort(const void* a, const void* b)
+{
+	return CompareFingerprints((const Fingerprint *)a, (const Fingerprint *)b);
+}
+
+
+/*
+	Combines the prints of a song's non-empty tracks. prints is sorted in
+	place, so the result does not depend on track order.
+*/
+Fingerprint CombineTrackPrints(Fingerprint* prints, unsigned int numPrints, const FileInfo* fileInfo)
+{
+	qsort(prints, numPrints, sizeof(Fingerprint), CompareFingerprintsQsort);
+
+	unsigned short division = fileInfo->timeDivisionType == ticksPerBeat ?
+		fileInfo->timeDivision.ticksPerBeat :
+		(fileInfo->timeDivision.framesPerSecond.smpteFrames << 8) | fileInfo->timeDivision.framesPerSecond.ticksPerFrame;
+
+	unsigned long long laneA = Round(PRIME1, division);
+	unsigned long long laneB = Round(PRIME2, numPrints);
+	for (unsigned int i=0; i < numPrints; i++) {
+		laneA = Round(laneA, prints[i].lo);
+		laneB = Round(laneB, prints[i].hi);
+	}
+
+	Fingerprint song;
+	song.lo = Avalanche(laneA ^ RotateLeft(laneB, 32));
+	song.hi = Avalanche(laneB ^ song.lo);
+
+	return song;
+}
+
+
+/*
+	trackPrints, if not NULL, receives one print per track in file order.
+	Returns 1 if there was no memory for the prints of a long song.
+*/
+int FingerprintSong(ParserContext* ctx, Fingerprint* song, Fingerprint* trackPrints)
+{
+	Fingerprint sorted[64];
+	Fingerprint* prints = sorted;
+	unsigned int numPrints = 0;
+
+	if (ctx->numTracks > 64) {
+		prints = (Fingerprint *)malloc(ctx->numTracks * sizeof(Fingerprint));
+		if (!prints) {
+			ctx->error = "Out of memory";
+			return 1;
+		}
+	}
+
+	for (unsigned int i=0; i < ctx->numTracks; i++) {
+		unsigned long numHashed;
+		Fingerprint print = FingerprintTrack(ctx, i, &numHashed);
+
+		if (trackPrints)
+			trackPrints[i] = print;
+		if (numHashed)
+			prints[numPrints++] = print;
+	}
+
+	*song = CombineTrackPrints(prints, numPrints, &ctx->fileInfo);
+
+	if (prints != sorted)
+		free(prints);
+
+	return 0;
+}
+
+
+typedef struct {
+	Fingerprint print;
+	unsigned int index;
+} SortKey;
+
+
+static int CompareSortKeys(const void* a, const void* b)
+{
+	const SortKey* ka = (const SortKey *)a;
+	const SortKey* kb = (const SortKey *)b;
+	int res = CompareFingerprints(&ka->print, &kb->print);
+
+	if (res)
+		return res;
+
+	return (ka->index < kb->index) ? -1 : (ka->index > kb->index);
+}
+
+
+/*
+	Fingerprints every file with a single reused context, then groups
+	entries with identical prints. Returns the number of duplicates.
+*/
+int FingerprintFiles(FingerprintEntry* entries, unsigned int count)
+{
+	ParserContext* ctx = CreateParserContext();
+	SortKey* keys = (SortKey *)malloc((count ? count : 1) * sizeof(SortKey));
+	unsigned int numKeys = 0;
+	int numDuplicates = 0;
+
+	if (!ctx || !keys) {
+		for (unsigned int i=0; i < count; i++) {
+			entries[i].status = 1;
+			entries[i].duplicateOf = -1;
+		}
+		free(keys);
+		FreeParserContext(ctx);
+		return 0;
+	}
+
+	for (unsigned int i=0; i < count; i++) {
+		entries[i].duplicateOf = -1;
+		entries[i].status = ParseMidiFile(ctx, entries[i].filename) ||
+			FingerprintSong(ctx, &entries[i].print, NULL);
+
+		if (entries[i].status == 0) {
+			keys[numKeys].print = entries[i].print;
+			keys[numKeys++].index = i;
+		}
+		else {
+			memset(&entries[i].print, 0, sizeof(Fingerprint));
+		}
+	}
+
+	qsort(keys, numKeys, sizeof(SortKey), CompareSortKeys);
+
+	for (unsigned int i=1; i < numKeys; i++) {
+		FingerprintEntry* previous = &entries[keys[i - 1].index];
+		FingerprintEntry* current = &entries[keys[i].index];
+
+		if (CompareFingerprints(&previous->print, &current->print) == 0) {
+			current->duplicateOf = previous->duplicateOf >= 0 ? previous->duplicateOf : (int)keys[i - 1].index;
+			numDuplicates++;
+		}
+	}
+
+	free(keys);
+	FreeParserContext(ctx);
+
+	return numDuplicates;
+}
@@ -0,0 +1,54 @@
+#ifndef __FINGERPRINT_H__
+#define __FINGERPRINT_H__
+
+#include "events.h"
+#include "context.h"
+
+/*
+	Content fingerprints of the normalised event stream. Events are hashed
+	with their absolute tick and resolved status, so running status, track
+	names and other text metas, and the order of events sharing a tick do
+	not change the result. Note on with velocity 0 counts as note off, and
+	note off velocity is ignored. A song print combines its non-empty track
+	prints in sorted order, so reordering tracks keeps the same print.
+*/
+
+typedef struct {
+	unsigned long long lo;
+	unsigned long long hi;
+} Fingerprint;
+
+typedef struct {
+	unsigned long long laneA;
+	unsigned long long laneB;
+	unsigned long long numGroups;
+	unsigned long numEvents;
+
+	unsigned long groupTick;
+	unsigned long long groupSum;
+	unsigned long long groupXor;
+	unsigned int groupCount;
+} FingerprintState;
+
+typedef struct {
+	const char* filename;
+	Fingerprint print;
+	int status;		/* 0 if the file parsed */
+	int duplicateOf;	/* index of first entry with the same print, or -1 */
+} FingerprintEntry;
+
+
+unsigned long long HashBytes(const void* data, unsigned long size, unsigned long long seed);
+
+void FingerprintInit(FingerprintState* state);
+void FingerprintFeedEvent(FingerprintState* state, unsigned long tick, const Event* event);
+Fingerprint FingerprintFinish(FingerprintState* state);
+
+Fingerprint FingerprintTrack(ParserContext* ctx, unsigned int track, unsigned long* numHashed);
+Fingerprint CombineTrackPrints(Fingerprint* prints, unsigned int numPrints, const FileInfo* fileInfo);
+int FingerprintSong(ParserContext* ctx, Fingerprint* song, Fingerprint* trackPrints);
+int CompareFingerprints(const Fingerprint* a, const Fingerprint* b);
+
+int FingerprintFiles(FingerprintEntry* entries, unsigned int count);
+
+#endif
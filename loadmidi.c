@@ -8,6 +8,7 @@
 #include <string.h>
 
 #include "loadmidi.h"
+#include "context.h"
 #include "events.h"
 #include "eventlist.h"
 #include "util.h"
@@ -215,6 +216,32 @@ int PrintChunk(Chunk* chunk)
 }
 
 
+void PrintContext(ParserContext* ctx)
+{
+	unsigned int track = 0;
+
+	for (unsigned int i=0; i < ctx->numChunks; i++) {
+		Chunk* chunk = &ctx->chunks[i];
+
+		if (memcmp(chunk->type, "MThd", 4) == 0) {
+			PrintFileInfo(&ctx->fileInfo);
+		}
+		else if (memcmp(chunk->type, "MTrk", 4) == 0) {
+			TrackSpan* span = &ctx->tracks[track];
+			Event* nameEvent = FindMetaEvent(ContextTrackEvents(ctx, track), span->numEvents, 0x03);
+			if (nameEvent) {
+				printf("Track name: %.*s\n", (int)nameEvent->size, nameEvent->data);
+			}
+			printf("Track has %i events\n", span->numEvents);
+			track++;
+		}
+		else {
+			printf("Unknown chunk type: %.4s\n", chunk->type);
+		}
+	}
+}
+
+
 unsigned int LoadChunk( FILE* f, Chunk* chunk)
 {
 	chunk->type = (unsigned char *)malloc(sizeof(unsigned char)*5);
@@ -240,30 +267,17 @@ unsigned int LoadChunk( FILE* f, Chunk* chunk)
 
 int LoadMidiFile( const char* filename )
 {
-	FILE* f = fopen(filename, "rb");
+	ParserContext* ctx = CreateParserContext();
+	int res = ParseMidiFile(ctx, filename);
 
-	Chunk* currentChunk = NULL;
-	int finished = 0;
-	unsigned int offset = 0;
-	int res = 0;
-
-	while (!finished) {
-		Chunk* chunk = (Chunk *)malloc(sizeof(Chunk));
-		unsigned int loadRes = LoadChunk(f, chunk);
-		if (loadRes > 0) {
-			offset += loadRes;
-			int res = PrintChunk(chunk);
-			currentChunk = chunk;
-		}
-		else {
-			res = 1;
-		}
-		if ((!currentChunk) || (res != 0)) {
-			finished = 1;
-		}
+	if (res == 0) {
+		PrintContext(ctx);
+	}
+	else {
+		printf("Error loading %s: %s\n", filename, ctx->error);
 	}
 
-	fclose(f);
+	FreeParserContext(ctx);
 
-	return 0;
+	return res;
 }
@@ -1,6 +1,9 @@
 #ifndef __LOADMIDI_H__
 #define __LOADMIDI_H__
 
+#include "context.h"
+
+void PrintContext(ParserContext* ctx);
 int LoadMidiFile( const char* filename );
 
 #endif
@@ -1,12 +1,1397 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "loadmidi.h"
+#include "fingerprint.h"
+#include "transform.h"
+#include "writemidi.h"
+#include "pianoroll.h"
+#include "visitor.h"
+#include "rawmidi.h"
+#include "catalog.h"
+#include "ngram.h"
+#include "parallel.h"
+#include "tempomap.h"
+#include "daemon.h"
+#include "optimise.h"
+#include "synth.h"
+#include "archive.h"
+#include "compressed.h"
+#include "fanout.h"
+#include "chords.h"
+#include "slice.h"
+#include "diff.h"
+
+
+static int FingerprintCommand( int argc, char* argv[] )
+{
+	FingerprintEntry* entries = (FingerprintEntry *)malloc(argc * sizeof(FingerprintEntry));
+
+	for (int i=0; i < argc; i++)
+		entries[i].filename = argv[i];
+
+	int numDuplicates = FingerprintFiles(entries, argc);
+
+	for (int i=0; i < argc; i++) {
+		if (entries[i].status != 0)
+			printf("%-32s  %s (could not parse)\n", "-", entries[i].filename);
+		else if (entries[i].duplicateOf >= 0)
+			printf("%016llx%016llx  %s (duplicate of %s)\n", entries[i].print.hi, entries[i].print.lo,
+				entries[i].filename, entries[entries[i].duplicateOf].filename);
+		else
+			printf("%016llx%016llx  %s\n", entries[i].print.hi, entries[i].print.lo, entries[i].filename);
+	}
+
+	printf("%i duplicates in %i files\n", numDuplicates, argc);
+	free(entries);
+
+	return 0;
+}
+
+
+static int EventsMatch(ParserContext* a, ParserContext* b)
+{
+	if (a->numEvents != b->numEvents)
+		return 0;
+
+	for (unsigned int i=0; i < a->numEvents; i++) {
+		Event* ea = &a->events[i];
+		Event* eb = &b->events[i];
+
+		if ((ea->type != eb->type) || (ea->subtype != eb->subtype) ||
+			(ea->time != eb->time) || (ea->size != eb->size) ||
+			memcmp(ea->data, eb->data, ea->size) != 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static int TransformCommand( int argc, char* argv[] )
+{
+	TransformPipeline pipeline;
+	unsigned char channelMap[16];
+	int check = 0;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi transform <in> <out> [--transpose n] [--velocity scale] [--stretch num/den] [--remap from:to] [--check]\n");
+		return 1;
+	}
+
+	InitTransformPipeline(&pipeline);
+
+	for (int i=2; i < argc; i++) {
+		int res = 0;
+
+		if ((strcmp(argv[i], "--transpose") == 0) && (i + 1 < argc)) {
+			res = AddTranspose(&pipeline, atoi(argv[++i]));
+		}
+		else if ((strcmp(argv[i], "--velocity") == 0) && (i + 1 < argc)) {
+			res = AddVelocityScale(&pipeline, (float)atof(argv[++i]));
+		}
+		else if ((strcmp(argv[i], "--stretch") == 0) && (i + 1 < argc)) {
+			unsigned long numerator, denominator;
+			if (sscanf(argv[++i], "%lu/%lu", &numerator, &denominator) != 2)
+				res = 1;
+			else
+				res = AddTimeStretch(&pipeline, numerator, denominator);
+		}
+		else if ((strcmp(argv[i], "--remap") == 0) && (i + 1 < argc)) {
+			unsigned int from, to;
+			for (int c=0; c < 16; c++)
+				channelMap[c] = c;
+			if ((sscanf(argv[++i], "%u:%u", &from, &to) != 2) || (from > 15) || (to > 15))
+				res = 1;
+			else {
+				channelMap[from] = to;
+				res = AddChannelRemap(&pipeline, channelMap);
+			}
+		}
+		else if (strcmp(argv[i], "--check") == 0) {
+			check = 1;
+		}
+		else {
+			res = 1;
+		}
+
+		if (res) {
+			printf("Bad transform option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	ParserContext* ctx = CreateParserContext();
+	int res = ParseMidiFile(ctx, argv[0]);
+
+	if (res == 0) {
+		if (check) {
+			ParserContext* reference = CreateParserContext();
+			ParseMidiFile(reference, argv[0]);
+			res = ApplyTransformsReference(reference, &pipeline);
+			res |= ApplyTransforms(ctx, &pipeline);
+			if (res == 0)
+				printf("Reference check: %s\n", EventsMatch(ctx, reference) ? "match" : "MISMATCH");
+			FreeParserContext(reference);
+		}
+		else {
+			res = ApplyTransforms(ctx, &pipeline);
+		}
+
+		if (res)
+			printf("Stretch leaves delta times too long for %s\n", argv[1]);
+		else {
+			res = WriteMidiFile(ctx, argv[1]);
+			if (res)
+				printf("Could not write %s\n", argv[1]);
+		}
+	}
+	else {
+		printf("Error loading %s: %s\n", argv[0], ctx->error);
+	}
+
+	FreeParserContext(ctx);
+
+	return res;
+}
+
+
+static int PianoRollCommand( int argc, char* argv[] )
+{
+	PianoRollConfig config;
+	const char* onsetsFilename = NULL;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi pianoroll <in> <out.npy> [--ticks n | --seconds s] [--planes single|channel|track] [--packed] [--onsets file.npy] [--threads n]\n");
+		return 1;
+	}
+
+	memset(&config, 0, sizeof(config));
+	config.ticksPerStep = 0;
+	config.secondsPerStep = 0.05;
+
+	for (int i=2; i < argc; i++) {
+		if ((strcmp(argv[i], "--ticks") == 0) && (i + 1 < argc))
+			config.ticksPerStep = strtoul(argv[++i], NULL, 10);
+		else if ((strcmp(argv[i], "--seconds") == 0) && (i + 1 < argc))
+			config.secondsPerStep = atof(argv[++i]);
+		else if ((strcmp(argv[i], "--planes") == 0) && (i + 1 < argc)) {
+			i++;
+			config.planes = strcmp(argv[i], "channel") == 0 ? channelPlanes :
+				strcmp(argv[i], "track") == 0 ? trackPlanes : singlePlane;
+		}
+		else if (strcmp(argv[i], "--packed") == 0)
+			config.format = packedBits;
+		else if ((strcmp(argv[i], "--onsets") == 0) && (i + 1 < argc))
+			onsetsFilename = argv[++i];
+		else if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			config.numThreads = atoi(argv[++i]);
+		else {
+			printf("Bad piano roll option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	ParserContext* ctx = CreateParserContext();
+	PianoRoll roll;
+	int res = ParseMidiFile(ctx, argv[0]);
+
+	InitPianoRoll(&roll);
+
+	if (res != 0) {
+		printf("Error loading %s: %s\n", argv[0], ctx->error);
+	}
+	else if (PreparePianoRoll(ctx, &config, &roll) != 0) {
+		printf("Could not prepare piano roll\n");
+		res = 1;
+	}
+	else {
+		unsigned long size = PianoRollSize(&roll);
+		unsigned char* output = (unsigned char *)malloc(size ? size : 1);
+		unsigned char* onsets = onsetsFilename ? (unsigned char *)malloc(size ? size : 1) : NULL;
+
+		if (!output || (onsetsFilename && !onsets)) {
+			printf("Out of memory for shape (%u, %lu, %u)\n", roll.numPlanes, roll.numSteps, roll.bytesPerRow);
+			res = 1;
+		}
+		else {
+			RenderPianoRoll(&roll, &config, output, onsets);
+			res = WriteNpyFile(argv[1], output, roll.numPlanes, roll.numSteps, roll.bytesPerRow);
+			if ((res == 0) && onsets)
+				res = WriteNpyFile(onsetsFilename, onsets, roll.numPlanes, roll.numSteps, roll.bytesPerRow);
+
+			printf("%u notes, shape (%u, %lu, %u)\n", roll.numNotes, roll.numPlanes, roll.numSteps, roll.bytesPerRow);
+		}
+		free(output);
+		free(onsets);
+	}
+
+	FreePianoRoll(&roll);
+	FreeParserContext(ctx);
+
+	return res;
+}
+
+
+static void ReplayPrintMessage(void* user, const RawMidiMessage* message)
+{
+	PrintRawMidiMessage(message);
+}
+
+
+static void ReplayCountMessage(void* user, const RawMidiMessage* message)
+{
+	(*(unsigned long *)user)++;
+}
+
+
+static int ReplayRawCommand( int argc, char* argv[] )
+{
+	unsigned long blockSize = 1;
+	int quiet = 0;
+	int res = 0;
+	unsigned char sysexBuffer[65536];
+	unsigned char block[4096];
+
+	for (int i=0; i < argc; i++) {
+		if ((strcmp(argv[i], "--block") == 0) && (i + 1 < argc))
+			blockSize = strtoul(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--quiet") == 0)
+			quiet = 1;
+	}
+
+	if ((blockSize == 0) || (blockSize > sizeof(block)))
+		blockSize = sizeof(block);
+
+	for (int i=0; i < argc; i++) {
+		if ((strcmp(argv[i], "--block") == 0) && (i + 1 < argc)) {
+			i++;
+			continue;
+		}
+		if (strcmp(argv[i], "--quiet") == 0)
+			continue;
+
+		FILE* f = fopen(argv[i], "rb");
+		if (!f) {
+			printf("Could not open %s\n", argv[i]);
+			res = 1;
+			continue;
+		}
+
+		RawMidiParser parser;
+		unsigned long count = 0;
+		InitRawMidiParser(&parser, sysexBuffer, sizeof(sysexBuffer),
+			quiet ? ReplayCountMessage : ReplayPrintMessage, &count);
+
+		unsigned long long start = MonotonicNanos();
+		size_t numRead;
+		while ((numRead = fread(block, 1, blockSize, f)) > 0) {
+			RawMidiPushBlock(&parser, block, numRead, MonotonicNanos());
+		}
+		unsigned long long elapsed = MonotonicNanos() - start;
+		fclose(f);
+
+		printf("%s: %llu bytes, %llu messages, %llu dropped bytes\n",
+			argv[i], parser.numBytes, parser.numMessages, parser.numDropped);
+		if (parser.numMessages) {
+			printf("Latency: min %llu ns, avg %llu ns, max %llu ns; %.1f ns per byte\n",
+				parser.minLatency, parser.totalLatency / parser.numMessages, parser.maxLatency,
+				parser.numBytes ? (double)elapsed / parser.numBytes : 0.0);
+		}
+	}
+
+	return res;
+}
+
+
+static int CatalogCommand( int argc, char* argv[] )
+{
+	Catalog catalog;
+	char** paths = NULL;
+	unsigned int numPaths = 0;
+	unsigned int capacity = 0;
+	unsigned int numThreads = 0;
+	unsigned int numRebuilt = 0;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi catalog <index> <file|dir>... [--threads n]\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			numThreads = atoi(argv[++i]);
+		else if (CollectMidiFiles(argv[i], &paths, &numPaths, &capacity) != 0)
+			printf("Could not read %s\n", argv[i]);
+	}
+
+	InitCatalog(&catalog);
+	LoadCatalog(&catalog, argv[0]);	/* a missing or damaged index just means a full build */
+
+	int res = RefreshCatalog(&catalog, paths, numPaths, numThreads, &numRebuilt);
+	if (res == 0)
+		res = SaveCatalog(&catalog, argv[0]);
+
+	if (res == 0)
+		printf("%u files indexed, %u parsed\n", catalog.numEntries, numRebuilt);
+	else
+		printf("Could not update catalog %s\n", argv[0]);
+
+	for (unsigned int i=0; i < numPaths; i++)
+		free(paths[i]);
+	free(paths);
+	FreeCatalog(&catalog);
+
+	return res;
+}
+
+
+static int CatalogQueryCommand( int argc, char* argv[] )
+{
+	Catalog catalog;
+	CatalogQuery query;
+	unsigned int numMatches = 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi catalog-query <index> [--tempo bpm] [--tolerance bpm] [--tracks n] [--name text]\n");
+		return 1;
+	}
+
+	query.tempoBpm = 0.0;
+	query.tempoTolerance = 0.5;
+	query.numTracks = -1;
+	query.trackName = NULL;
+
+	for (int i=1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--tempo") == 0)
+			query.tempoBpm = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "--tolerance") == 0)
+			query.tempoTolerance = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "--tracks") == 0)
+			query.numTracks = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "--name") == 0)
+			query.trackName = argv[i + 1];
+	}
+
+	InitCatalog(&catalog);
+	if (LoadCatalog(&catalog, argv[0]) != 0) {
+		printf("Could not load catalog %s\n", argv[0]);
+		FreeCatalog(&catalog);
+		return 1;
+	}
+
+	for (unsigned int i=0; i < catalog.numEntries; i++) {
+		CatalogEntry* entry = &catalog.entries[i];
+		if (!MatchCatalogEntry(entry, &query))
+			continue;
+
+		printf("%s: %u tracks, %.1f BPM, %.1f s, %u events\n", entry->path, entry->numTracks,
+			CatalogEntryTempoBpm(entry), entry->durationSeconds, entry->numEvents);
+		numMatches++;
+	}
+
+	printf("%u of %u files match\n", numMatches, catalog.numEntries);
+	FreeCatalog(&catalog);
+
+	return 0;
+}
+
+
+static int NgramBuildCommand( int argc, char* argv[] )
+{
+	char** paths = NULL;
+	unsigned int numPaths = 0;
+	unsigned int capacity = 0;
+	unsigned int numThreads = 0;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi ngram-build <index> <file|dir>... [--threads n]\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			numThreads = atoi(argv[++i]);
+		else if (CollectMidiFiles(argv[i], &paths, &numPaths, &capacity) != 0)
+			printf("Could not read %s\n", argv[i]);
+	}
+
+	int res = BuildNgramIndex(argv[0], paths, numPaths, numThreads);
+	if (res == 0)
+		printf("Indexed %u files\n", numPaths);
+	else
+		printf("Could not build index %s\n", argv[0]);
+
+	for (unsigned int i=0; i < numPaths; i++)
+		free(paths[i]);
+	free(paths);
+
+	return res;
+}
+
+
+static int NgramQueryCommand( int argc, char* argv[] )
+{
+	NgramIndex index;
+	unsigned char pitches[256];
+	unsigned int numPitches = 0;
+	int verify = (argc > 2) && (strcmp(argv[2], "--verify") == 0);
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi ngram-query <index> <pitch,pitch,...> [--verify]\n");
+		return 1;
+	}
+
+	for (char* p = argv[1]; *p; ) {
+		char* end;
+		unsigned long pitch = strtoul(p, &end, 10);
+
+		if ((end == p) || (pitch > 127) || (numPitches == sizeof(pitches))) {
+			printf("Pitches must be up to %u comma-separated MIDI notes from 0 to 127\n", (unsigned int)sizeof(pitches));
+			return 1;
+		}
+
+		pitches[numPitches++] = (unsigned char)pitch;
+		for (p = end; (*p == ',') || (*p == ' '); p++)
+			;
+	}
+
+	if (OpenNgramIndex(&index, argv[0]) != 0) {
+		printf("Could not open index %s\n", argv[0]);
+		return 1;
+	}
+
+	NgramMatch* matches;
+	unsigned int numMatches;
+	unsigned long long start = MonotonicNanos();
+	int res = QueryNgramIndex(&index, pitches, numPitches, &matches, &numMatches);
+	unsigned long long elapsed = MonotonicNanos() - start;
+
+	if (res != 0) {
+		printf("Queries need at least %i pitches\n", NGRAM_LENGTH + 1);
+	}
+	else {
+		if (verify)
+			VerifyNgramMatches(&index, pitches, numPitches, matches, &numMatches);
+
+		for (unsigned int i=0; i < numMatches; i++) {
+			printf("%s: track %u, channel %u, note %u", index.filenames[matches[i].file],
+				matches[i].track, matches[i].channel, matches[i].position);
+			if (verify)
+				printf(", tick %lu", matches[i].tick);
+			printf("\n");
+		}
+		printf("%u matches in %.3f ms\n", numMatches, elapsed / 1000000.0);
+	}
+
+	free(matches);
+	CloseNgramIndex(&index);
+
+	return res;
+}
+
+
+static int SpeculativeCheckCommand( int argc, char* argv[] )
+{
+	unsigned int numThreads = (argc > 2) && (strcmp(argv[1], "--threads") == 0) ? atoi(argv[2]) : 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi speculative-check <filename> [--threads n]\n");
+		return 1;
+	}
+
+	ParserContext* sequential = CreateParserContext();
+	ParserContext* speculative = CreateParserContext();
+	speculative->decodeThreads = numThreads ? numThreads : DefaultThreadCount();
+	if (speculative->decodeThreads < 2)
+		speculative->decodeThreads = 2;
+
+	unsigned long long start = MonotonicNanos();
+	int res = ParseMidiFile(sequential, argv[0]);
+	unsigned long long sequentialTime = MonotonicNanos() - start;
+
+	start = MonotonicNanos();
+	res |= ParseMidiFile(speculative, argv[0]);
+	unsigned long long speculativeTime = MonotonicNanos() - start;
+
+	if (res != 0) {
+		printf("Error loading %s\n", argv[0]);
+	}
+	else {
+		int same = EventsMatch(sequential, speculative) &&
+			(memcmp(sequential->ticks, speculative->ticks, sequential->numEvents * sizeof(unsigned long)) == 0);
+		printf("%u events, %s\n", sequential->numEvents, same ? "identical" : "MISMATCH");
+		printf("Sequential %.2f ms, speculative %.2f ms (%u threads, %u segments, %u re-decoded)\n",
+			sequentialTime / 1000000.0, speculativeTime / 1000000.0, speculative->decodeThreads,
+			speculative->numSpeculativeSegments, speculative->numRedecodedSegments);
+		res = same ? 0 : 1;
+	}
+
+	FreeParserContext(sequential);
+	FreeParserContext(speculative);
+
+	return res;
+}
+
+
+static int OptimiseCommand( int argc, char* argv[] )
+{
+	int check = (argc > 2) && (strcmp(argv[2], "--check") == 0);
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi optimise <in> <out> [--check]\n");
+		return 1;
+	}
+
+	ParserContext* ctx = CreateParserContext();
+	OptimiseStats stats;
+	int res = ParseMidiFile(ctx, argv[0]);
+
+	if (res == 0)
+		res = OptimiseMidi(ctx, &stats);
+	if (res != 0) {
+		printf("Error loading %s: %s\n", argv[0], ctx->error);
+		FreeParserContext(ctx);
+		return 1;
+	}
+
+	res = WriteMidiFile(ctx, argv[1]);
+	if (res) {
+		printf("Could not write %s\n", argv[1]);
+		FreeParserContext(ctx);
+		return 1;
+	}
+
+	printf("Events: %u -> %u (%u controllers, %u programs, %u notes, %u metas removed)\n",
+		stats.eventsBefore, stats.eventsAfter, stats.removedControllers, stats.removedPrograms,
+		stats.removedNotes, stats.removedMetas);
+	printf("Bytes: %lu -> %lu (%ld saved)\n", stats.bytesBefore, stats.bytesAfter,
+		(long)stats.bytesBefore - (long)stats.bytesAfter);
+
+	if (check) {
+		ParserContext* original = CreateParserContext();
+		ParserContext* written = CreateParserContext();
+
+		res = ParseMidiFile(original, argv[0]) || ParseMidiFile(written, argv[1]);
+		Fingerprint optimisedPrint, writtenPrint;
+		res = res || FingerprintSong(ctx, &optimisedPrint, NULL) || FingerprintSong(written, &writtenPrint, NULL);
+		if (res == 0) {
+			int sameState = CompareMidiState(original, written) == 0;
+			int sameEncoding = CompareFingerprints(&optimisedPrint, &writtenPrint) == 0;
+
+			printf("State check: %s\n", sameState ? "equivalent" : "MISMATCH");
+			printf("Round trip: %s\n", sameEncoding ? "match" : "MISMATCH");
+			res = (sameState && sameEncoding) ? 0 : 1;
+		}
+		else {
+			printf("Could not re-read files for checking\n");
+		}
+
+		FreeParserContext(original);
+		FreeParserContext(written);
+	}
+
+	FreeParserContext(ctx);
+
+	return res;
+}
+
+
+static int SynthCommand( int argc, char* argv[] )
+{
+	SynthConfig config;
+	SynthStats stats;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi synth <in> <out.wav> [--rate hz] [--gain g] [--tail seconds] [--threads n]\n");
+		return 1;
+	}
+
+	InitSynthConfig(&config);
+
+	for (int i=2; i < argc; i++) {
+		if ((strcmp(argv[i], "--rate") == 0) && (i + 1 < argc))
+			config.sampleRate = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--gain") == 0) && (i + 1 < argc))
+			config.gain = atof(argv[++i]);
+		else if ((strcmp(argv[i], "--tail") == 0) && (i + 1 < argc))
+			config.tailSeconds = atof(argv[++i]);
+		else if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			config.numThreads = atoi(argv[++i]);
+		else {
+			printf("Bad synth option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	ParserContext* ctx = CreateParserContext();
+	int res = ParseMidiFile(ctx, argv[0]);
+
+	if (res != 0) {
+		printf("Error loading %s: %s\n", argv[0], ctx->error);
+	}
+	else {
+		unsigned long long start = MonotonicNanos();
+		res = RenderWavFile(ctx, &config, argv[1], &stats);
+		double elapsed = (MonotonicNanos() - start) / 1000000000.0;
+
+		if (res != 0) {
+			printf("Could not render %s: %s\n", argv[1], ctx->error);
+		}
+		else {
+			double seconds = (double)stats.numFrames / config.sampleRate;
+			printf("%u notes, %.2f s of audio in %.3f s (%.0fx real time), %u voices stolen, %u samples clipped\n",
+				stats.numNotes, seconds, elapsed, elapsed > 0.0 ? seconds / elapsed : 0.0,
+				stats.numStolen, stats.numClipped);
+		}
+	}
+
+	FreeParserContext(ctx);
+
+	return res;
+}
+
+
+static int PackCommand( int argc, char* argv[] )
+{
+	char** paths = NULL;
+	unsigned int numPaths = 0;
+	unsigned int capacity = 0;
+	unsigned long long bytesAdded;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi pack <archive> <file|dir>...\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if (CollectMidiFiles(argv[i], &paths, &numPaths, &capacity) != 0)
+			printf("Could not read %s\n", argv[i]);
+	}
+
+	int res = AppendToArchive(argv[0], paths, numPaths, &bytesAdded);
+	if (res == 0)
+		printf("%u files, %llu bytes added to %s\n", numPaths, bytesAdded, argv[0]);
+	else
+		printf("Could not append to %s\n", argv[0]);
+
+	for (unsigned int i=0; i < numPaths; i++)
+		free(paths[i]);
+	free(paths);
+
+	return res;
+}
+
+
+static int PackListCommand( int argc, char* argv[] )
+{
+	Archive archive;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi pack-list <archive>\n");
+		return 1;
+	}
+
+	if (OpenArchive(&archive, argv[0]) != 0) {
+		printf("Could not open archive %s\n", argv[0]);
+		return 1;
+	}
+
+	for (unsigned int i=0; i < archive.numEntries; i++) {
+		ArchiveEntry* entry = &archive.entries[i];
+		printf("%016llx%016llx %10llu  %.*s\n", entry->hash.hi, entry->hash.lo, entry->length,
+			(int)entry->nameLength, entry->name);
+	}
+	printf("%u entries\n", archive.numEntries);
+
+	CloseArchive(&archive);
+
+	return 0;
+}
+
+
+static int PackExtractCommand( int argc, char* argv[] )
+{
+	Archive archive;
+
+	if (argc < 3) {
+		printf("Usage: ./loadmidi pack-extract <archive> <name> <out>\n");
+		return 1;
+	}
+
+	if (OpenArchive(&archive, argv[0]) != 0) {
+		printf("Could not open archive %s\n", argv[0]);
+		return 1;
+	}
+
+	int entry = FindArchiveEntry(&archive, argv[1]);
+	int res = 1;
+
+	if (entry < 0)
+		printf("No entry named %s\n", argv[1]);
+	else if ((res = ExtractArchiveEntry(&archive, entry, argv[2])) != 0)
+		printf("Could not extract %s (content hash mismatch or write error)\n", argv[1]);
+
+	CloseArchive(&archive);
+
+	return res;
+}
+
+
+typedef struct {
+	unsigned int numParsed;
+	unsigned int numFailed;
+	unsigned long long numEvents;
+	pthread_mutex_t lock;
+} PackScanTotals;
+
+
+static void CountArchiveEntry(void* arg, unsigned int entry, ParserContext* ctx, int status)
+{
+	PackScanTotals* totals = (PackScanTotals *)arg;
+
+	pthread_mutex_lock(&totals->lock);
+	if (status == 0) {
+		totals->numParsed++;
+		totals->numEvents += ctx->numEvents;
+	}
+	else {
+		totals->numFailed++;
+	}
+	pthread_mutex_unlock(&totals->lock);
+}
+
+
+static int PackScanCommand( int argc, char* argv[] )
+{
+	unsigned int numThreads = (argc > 2) && (strcmp(argv[1], "--threads") == 0) ? atoi(argv[2]) : 0;
+	Archive archive;
+	PackScanTotals totals;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi pack-scan <archive> [--threads n]\n");
+		return 1;
+	}
+
+	unsigned long long start = MonotonicNanos();
+	if (OpenArchive(&archive, argv[0]) != 0) {
+		printf("Could not open archive %s\n", argv[0]);
+		return 1;
+	}
+
+	memset(&totals, 0, sizeof(totals));
+	pthread_mutex_init(&totals.lock, NULL);
+
+	int res = ParseArchive(&archive, numThreads, CountArchiveEntry, &totals);
+	double elapsed = (MonotonicNanos() - start) / 1000000000.0;
+
+	printf("%u entries parsed, %u failed, %llu events in %.3f s (%.1f MB/s)\n", totals.numParsed,
+		totals.numFailed, totals.numEvents, elapsed, elapsed > 0.0 ? archive.size / elapsed / 1000000.0 : 0.0);
+
+	pthread_mutex_destroy(&totals.lock);
+	CloseArchive(&archive);
+
+	return res;
+}
+
+
+static int CompressedCheckCommand( int argc, char* argv[] )
+{
+	unsigned char* data = NULL;
+	unsigned long size = 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi compressed-check <filename>\n");
+		return 1;
+	}
+
+	ParserContext* streamed = CreateParserContext();
+	ParserContext* staged = CreateParserContext();
+
+	/* decompress everything, then parse */
+	unsigned long long start = MonotonicNanos();
+	int res = ReadCompressedFile(argv[0], &data, &size);
+	unsigned long long decompressTime = MonotonicNanos() - start;
+	if (res == 0)
+		res = ParseMidiBuffer(staged, data, size);
+	unsigned long long stagedTime = MonotonicNanos() - start;
+
+	start = MonotonicNanos();
+	res |= ParseMidiFile(streamed, argv[0]);
+	unsigned long long streamedTime = MonotonicNanos() - start;
+
+	if (res != 0) {
+		printf("Error loading %s: %s\n", argv[0], streamed->error ? streamed->error : staged->error);
+	}
+	else {
+		int same = EventsMatch(staged, streamed);
+		printf("%lu bytes, %u events, %s\n", size, streamed->numEvents, same ? "identical" : "MISMATCH");
+		printf("Decompress %.2f ms + parse %.2f ms, streamed %.2f ms\n", decompressTime / 1000000.0,
+			(stagedTime - decompressTime) / 1000000.0, streamedTime / 1000000.0);
+		res = same ? 0 : 1;
+	}
+
+	free(data);
+	FreeParserContext(streamed);
+	FreeParserContext(staged);
+
+	return res;
+}
+
+
+static int StatsMatch(const MidiStats* a, const MidiStats* b)
+{
+	return (a->numTracks == b->numTracks) && (a->numEvents == b->numEvents) &&
+		(a->numChannelMessages == b->numChannelMessages) && (a->numNotes == b->numNotes) &&
+		(a->numMetas == b->numMetas) && (a->numSysex == b->numSysex) &&
+		(a->numTempoChanges == b->numTempoChanges) && (a->lastTick == b->lastTick) &&
+		(a->channelMask == b->channelMask) && (a->lowestNote == b->lowestNote) &&
+		(a->highestNote == b->highestNote);
+}
+
+
+/* Compares two files from the start; both are left at their end. */
+static int OutputsMatch(FILE* a, FILE* b)
+{
+	unsigned char bufferA[4096];
+	unsigned char bufferB[4096];
+
+	rewind(a);
+	rewind(b);
+
+	for (;;) {
+		size_t sizeA = fread(bufferA, 1, sizeof(bufferA), a);
+		size_t sizeB = fread(bufferB, 1, sizeof(bufferB), b);
+
+		if ((sizeA != sizeB) || (memcmp(bufferA, bufferB, sizeA) != 0))
+			return 0;
+		if (sizeA < sizeof(bufferA))
+			return !ferror(a) && !ferror(b);
+	}
+}
+
+
+static int FanoutCommand( int argc, char* argv[] )
+{
+	const char* ndjsonPath = NULL;
+	int compare = 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi fanout <filename> [--ndjson out] [--compare]\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if ((strcmp(argv[i], "--ndjson") == 0) && (i + 1 < argc))
+			ndjsonPath = argv[++i];
+		else if (strcmp(argv[i], "--compare") == 0)
+			compare = 1;
+		else {
+			printf("Bad fanout option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	/* compared NDJSON is read back, and the one-pass copy goes to a temporary file */
+	FILE* ndjson = NULL;
+	FILE* sequentialNdjson = NULL;
+	if (ndjsonPath && !(ndjson = fopen(ndjsonPath, compare ? "w+" : "w"))) {
+		printf("Could not open %s\n", ndjsonPath);
+		return 1;
+	}
+	if (ndjson && compare && !(sequentialNdjson = tmpfile())) {
+		printf("Could not create a temporary file\n");
+		fclose(ndjson);
+		return 1;
+	}
+
+	/* one pass per consumer, for comparison */
+	MidiStats sequentialStats;
+	FingerprintSinkState sequentialPrint;
+	Fingerprint sequentialSong;
+	unsigned long long sequentialTime = 0;
+	int res = 0;
+
+	if (compare) {
+		memset(&sequentialStats, 0, sizeof(MidiStats));
+		memset(&sequentialPrint, 0, sizeof(FingerprintSinkState));
+
+		unsigned long long start = MonotonicNanos();
+		res |= VisitMidiFile(argv[0], &StatsVisitor, &sequentialStats);
+		res |= VisitMidiFile(argv[0], &FingerprintVisitor, &sequentialPrint);
+		if (sequentialNdjson) {
+			res |= VisitMidiFile(argv[0], &NdjsonVisitor, sequentialNdjson);
+			fflush(sequentialNdjson);
+		}
+		sequentialTime = MonotonicNanos() - start;
+		sequentialSong = FinishFingerprintSink(&sequentialPrint);
+	}
+
+	MidiStats stats;
+	FingerprintSinkState print;
+	FanoutSink sinks[3];
+	FanoutStats fanoutStats;
+	unsigned int numSinks = 2;
+
+	memset(&stats, 0, sizeof(MidiStats));
+	memset(&print, 0, sizeof(FingerprintSinkState));
+	sinks[0].visitor = &StatsVisitor;
+	sinks[0].user = &stats;
+	sinks[1].visitor = &FingerprintVisitor;
+	sinks[1].user = &print;
+	if (ndjson) {
+		sinks[2].visitor = &NdjsonVisitor;
+		sinks[2].user = ndjson;
+		numSinks++;
+	}
+
+	unsigned long long start = MonotonicNanos();
+	res |= RunFanout(argv[0], sinks, numSinks, &fanoutStats);
+	if (ndjson)
+		fflush(ndjson);
+	unsigned long long fanoutTime = MonotonicNanos() - start;
+	Fingerprint song = FinishFingerprintSink(&print);
+
+	int sameNdjson = sequentialNdjson ? OutputsMatch(ndjson, sequentialNdjson) : 1;
+
+	if (ndjson)
+		fclose(ndjson);
+	if (sequentialNdjson)
+		fclose(sequentialNdjson);
+
+	if (res != 0) {
+		printf("Error loading %s\n", argv[0]);
+		return 1;
+	}
+
+	printf("%u tracks, %lu events (%lu notes, %lu metas, %lu sysex), last tick %lu\n", stats.numTracks,
+		stats.numEvents, stats.numNotes, stats.numMetas, stats.numSysex, stats.lastTick);
+	printf("%016llx%016llx  %s\n", song.hi, song.lo, argv[0]);
+	printf("%lu batches, decoder stalled %lu times\n", fanoutStats.numBatches, fanoutStats.numStalls);
+	for (unsigned int i=0; i < numSinks; i++)
+		printf("  sink %u: %lu events, waited %lu times\n", i, sinks[i].numEvents, sinks[i].numStalls);
+	printf("Fan-out %.2f ms\n", fanoutTime / 1000000.0);
+
+	if (compare) {
+		int same = StatsMatch(&stats, &sequentialStats) && (CompareFingerprints(&song, &sequentialSong) == 0) && sameNdjson;
+		printf("One pass per sink %.2f ms, results %s\n", sequentialTime / 1000000.0, same ? "identical" : "MISMATCH");
+		res = same ? 0 : 1;
+	}
+
+	return res;
+}
+
+
+static int ChordsCommand( int argc, char* argv[] )
+{
+	const char* midiPath = NULL;
+	int channel = CHORD_ALL_CHANNELS;
+	int quiet = 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi chords <filename> [--channel n] [--midi out] [--quiet]\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if ((strcmp(argv[i], "--channel") == 0) && (i + 1 < argc) && (atoi(argv[i + 1]) >= 0) && (atoi(argv[i + 1]) < 16))
+			channel = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--midi") == 0) && (i + 1 < argc))
+			midiPath = argv[++i];
+		else if (strcmp(argv[i], "--quiet") == 0)
+			quiet = 1;
+		else {
+			printf("Bad chords option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	ParserContext* ctx = CreateParserContext();
+	ChordTrack chords;
+	TempoMap map;
+
+	InitChordTrack(&chords);
+	InitTempoMap(&map);
+
+	int res = ParseMidiFile(ctx, argv[0]);
+	unsigned long long start = MonotonicNanos();
+	if (res == 0)
+		res = AnalyseChords(ctx, channel, &chords);
+	unsigned long long elapsed = MonotonicNanos() - start;
+	if (res == 0)
+		res = BuildTempoMap(ctx, &map);
+
+	if (res != 0) {
+		printf("Error loading %s: %s\n", argv[0], ctx->error);
+	}
+	else {
+		for (unsigned int i=0; !quiet && (i < chords.numLabels); i++) {
+			char name[16];
+			FormatChord(&chords.labels[i], name, sizeof(name));
+			printf("%10lu %10.3f  %s\n", chords.labels[i].tick, TicksToSeconds(&map, chords.labels[i].tick), name);
+		}
+		printf("%u chords from %lu change points in %.1f us\n", chords.numLabels, chords.numChangePoints, elapsed / 1000.0);
+
+		if (midiPath && (WriteChordMidiFile(ctx, &chords, midiPath) != 0)) {
+			printf("Could not write %s\n", midiPath);
+			res = 1;
+		}
+	}
+
+	FreeTempoMap(&map);
+	FreeChordTrack(&chords);
+	FreeParserContext(ctx);
+
+	return res;
+}
+
+
+static int SliceCommand( int argc, char* argv[] )
+{
+	SliceWindow window;
+	SliceStats stats;
+
+	if (argc < 4) {
+		printf("Usage: ./loadmidi slice <in> <out> --ticks from:[to] | --seconds from:[to]\n");
+		return 1;
+	}
+
+	memset(&window, 0, sizeof(SliceWindow));
+	window.toTick = ~0UL;
+	window.toSeconds = -1.0;
+
+	int parsed = 0;
+	if (strcmp(argv[2], "--ticks") == 0)
+		parsed = sscanf(argv[3], "%lu:%lu", &window.fromTick, &window.toTick);
+	else if (strcmp(argv[2], "--seconds") == 0) {
+		window.inSeconds = 1;
+		parsed = sscanf(argv[3], "%lf:%lf", &window.fromSeconds, &window.toSeconds);
+	}
+	if (parsed < 1) {
+		printf("Bad slice window: %s %s\n", argv[2], argv[3]);
+		return 1;
+	}
+
+	unsigned long long start = MonotonicNanos();
+	int res = SliceMidiFile(argv[0], argv[1], &window, &stats);
+	unsigned long long elapsed = MonotonicNanos() - start;
+
+	if (res != 0) {
+		printf("Could not slice %s into %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	if (stats.toTick == ~0UL)
+		printf("Ticks %lu to end: ", stats.fromTick);
+	else
+		printf("Ticks %lu to %lu: ", stats.fromTick, stats.toTick);
+	printf("%u tracks, %lu events copied, %lu folded into %lu state events, %lu notes closed in %.2f ms\n",
+		stats.numTracks, stats.numCopied, stats.numSkipped, stats.numCarried, stats.numClosed, elapsed / 1000000.0);
+
+	return 0;
+}
+
+
+static int DiffCommand( int argc, char* argv[] )
+{
+	unsigned long tolerance = 0;
+	unsigned int maxEntries = 50;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi diff <first> <second> [--tolerance ticks] [--max n]\n");
+		return 1;
+	}
+
+	for (int i=2; i < argc; i++) {
+		if ((strcmp(argv[i], "--tolerance") == 0) && (i + 1 < argc))
+			tolerance = strtoul(argv[++i], NULL, 10);
+		else if ((strcmp(argv[i], "--max") == 0) && (i + 1 < argc))
+			maxEntries = strtoul(argv[++i], NULL, 10);
+		else {
+			printf("Bad diff option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	ParserContext* a = CreateParserContext();
+	ParserContext* b = CreateParserContext();
+	DiffScratch scratch;
+	DiffReport report;
+
+	InitDiffScratch(&scratch);
+	report.maxEntries = maxEntries;
+	report.entries = (DiffEntry *)malloc((maxEntries ? maxEntries : 1) * sizeof(DiffEntry));
+
+	int res = 0;
+	if (ParseMidiFile(a, argv[0]) != 0) {
+		printf("Error loading %s: %s\n", argv[0], a->error);
+		res = 2;
+	}
+	else if (ParseMidiFile(b, argv[1]) != 0) {
+		printf("Error loading %s: %s\n", argv[1], b->error);
+		res = 2;
+	}
+	else if (!report.entries || (DiffSongs(a, b, tolerance, &scratch, &report) != 0)) {
+		printf("Out of memory\n");
+		res = 2;
+	}
+	else {
+		if (report.headerDiffers)
+			printf("Header: format %u -> %u, division %u -> %u\n", a->fileInfo.formatType, b->fileInfo.formatType,
+				a->fileInfo.timeDivision.ticksPerBeat, b->fileInfo.timeDivision.ticksPerBeat);
+
+		for (unsigned int i=0; i < report.numEntries; i++) {
+			char line[160];
+			FormatDiffEntry(&report.entries[i], line, sizeof(line));
+			printf("%s\n", line);
+		}
+		if (report.numEntries < report.numInserted + report.numRemoved + report.numModified + report.numMoved)
+			printf("...\n");
+
+		printf("%u identical, %u changed, %u added, %u removed tracks; %lu inserted, %lu removed, %lu modified, %lu moved events\n",
+			report.numIdenticalTracks, report.numChangedTracks, report.numAddedTracks, report.numRemovedTracks,
+			report.numInserted, report.numRemoved, report.numModified, report.numMoved);
+		res = SongsDiffer(&report) ? 1 : 0;
+	}
+
+	free(report.entries);
+	FreeDiffScratch(&scratch);
+	FreeParserContext(a);
+	FreeParserContext(b);
+
+	return res;
+}
+
+
+/*
+	Reads "first<TAB>second" lines, or two paths split at the first space.
+*/
+static int DiffListCommand( int argc, char* argv[] )
+{
+	unsigned long tolerance = 0;
+	unsigned int numThreads = 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi diff-list <pairs.txt> [--threads n] [--tolerance ticks]\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			numThreads = atoi(argv[++i]);
+		else if ((strcmp(argv[i], "--tolerance") == 0) && (i + 1 < argc))
+			tolerance = strtoul(argv[++i], NULL, 10);
+		else {
+			printf("Bad diff-list option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	FILE* f = fopen(argv[0], "r");
+	if (!f) {
+		printf("Could not open %s\n", argv[0]);
+		return 1;
+	}
+
+	DiffPair* pairs = NULL;
+	unsigned int numPairs = 0;
+	unsigned int capacity = 0;
+	char* line = NULL;
+	size_t lineCapacity = 0;
+	ssize_t length;
+
+	while ((length = getline(&line, &lineCapacity, f)) > 0) {
+		while ((length > 0) && ((line[length - 1] == '\n') || (line[length - 1] == '\r')))
+			line[--length] = '\0';
+
+		char* split = strchr(line, '\t');
+		if (!split)
+			split = strchr(line, ' ');
+		if (!split)
+			continue;
+		*split = '\0';
+
+		if (numPairs == capacity) {
+			capacity = capacity ? capacity * 2 : 256;
+			pairs = (DiffPair *)realloc(pairs, capacity * sizeof(DiffPair));
+		}
+		pairs[numPairs].first = strdup(line);
+		pairs[numPairs].second = strdup(split + 1);
+		numPairs++;
+	}
+
+	free(line);
+	fclose(f);
+
+	unsigned long long start = MonotonicNanos();
+	int numDiffering = DiffPairs(pairs, numPairs, numThreads, tolerance);
+	double elapsed = (MonotonicNanos() - start) / 1000000000.0;
+	unsigned int numFailed = 0;
+
+	if (numDiffering < 0) {
+		printf("Out of memory\n");
+		numDiffering = 0;
+	}
+
+	for (unsigned int i=0; i < numPairs; i++) {
+		DiffReport* report = &pairs[i].report;
+
+		if (pairs[i].status != 0) {
+			printf("error    %s %s\n", pairs[i].first, pairs[i].second);
+			numFailed++;
+		}
+		else if (SongsDiffer(report)) {
+			printf("changed  %s %s: %u/%u tracks, +%lu -%lu ~%lu >%lu%s\n", pairs[i].first, pairs[i].second,
+				report->numChangedTracks + report->numAddedTracks + report->numRemovedTracks,
+				report->numIdenticalTracks + report->numChangedTracks + report->numAddedTracks + report->numRemovedTracks,
+				report->numInserted, report->numRemoved, report->numModified, report->numMoved,
+				report->headerDiffers ? ", header" : "");
+		}
+
+		free((char *)pairs[i].first);
+		free((char *)pairs[i].second);
+	}
+
+	printf("%i of %u pairs differ, %u could not be parsed, %.3f s\n", numDiffering, numPairs, numFailed, elapsed);
+	free(pairs);
+
+	return (numDiffering || numFailed) ? 1 : 0;
+}
+
+
+static int DaemonCommand( int argc, char* argv[] )
+{
+	unsigned long long budget = 256ULL << 20;
+	unsigned int numThreads = 0;
+
+	if (argc < 1) {
+		printf("Usage: ./loadmidi daemon <socket> [--budget megabytes] [--threads n]\n");
+		return 1;
+	}
+
+	for (int i=1; i < argc; i++) {
+		if ((strcmp(argv[i], "--budget") == 0) && (i + 1 < argc))
+			budget = strtoull(argv[++i], NULL, 10) << 20;
+		else if ((strcmp(argv[i], "--threads") == 0) && (i + 1 < argc))
+			numThreads = atoi(argv[++i]);
+	}
+
+	if (RunMidiDaemon(argv[0], budget, numThreads) != 0) {
+		printf("Could not listen on %s\n", argv[0]);
+		return 1;
+	}
+
+	return 0;
+}
+
+
+static int QueryCommand( int argc, char* argv[] )
+{
+	char request[DAEMON_MAX_LINE];
+	unsigned long length = 0;
+
+	if (argc < 2) {
+		printf("Usage: ./loadmidi query <socket> <request>...\n");
+		return 1;
+	}
+
+	request[0] = '\0';
+	for (int i=1; i < argc; i++) {
+		int written = snprintf(request + length, sizeof(request) - length, "%s%s", i > 1 ? " " : "", argv[i]);
+		if ((written < 0) || ((unsigned long)written >= sizeof(request) - length)) {
+			printf("Request too long\n");
+			return 1;
+		}
+		length += written;
+	}
+
+	return MidiDaemonRequest(argv[0], request, stdout);
+}
 
 
 int main( int argc, char* argv[] )
 {
-	if (argc < 2)	// For testing: Super Mario Bros theme!
+	if (argc < 2) {	// For testing: Super Mario Bros theme!
 		printf("Usage: ./loadmidi <filename>\n");
+		printf("       ./loadmidi dump <filename>\n");
+		printf("       ./loadmidi fingerprint <filename>...\n");
+		printf("       ./loadmidi transform <in> <out> [options]\n");
+		printf("       ./loadmidi replay-raw <capture>... [--block n] [--quiet]\n");
+		printf("       ./loadmidi catalog <index> <file|dir>... [--threads n]\n");
+		printf("       ./loadmidi catalog-query <index> [filters]\n");
+		printf("       ./loadmidi ngram-build <index> <file|dir>... [--threads n]\n");
+		printf("       ./loadmidi ngram-query <index> <pitch,pitch,...> [--verify]\n");
+		printf("       ./loadmidi speculative-check <filename> [--threads n]\n");
+		printf("       ./loadmidi pianoroll <in> <out.npy> [options]\n");
+		printf("       ./loadmidi optimise <in> <out> [--check]\n");
+		printf("       ./loadmidi synth <in> <out.wav> [options]\n");
+		printf("       ./loadmidi pack <archive> <file|dir>...\n");
+		printf("       ./loadmidi pack-list <archive>\n");
+		printf("       ./loadmidi pack-extract <archive> <name> <out>\n");
+		printf("       ./loadmidi pack-scan <archive> [--threads n]\n");
+		printf("       ./loadmidi compressed-check <filename>\n");
+		printf("       ./loadmidi fanout <filename> [--ndjson out] [--compare]\n");
+		printf("       ./loadmidi chords <filename> [--channel n] [--midi out] [--quiet]\n");
+		printf("       ./loadmidi slice <in> <out> --ticks from:[to] | --seconds from:[to]\n");
+		printf("       ./loadmidi diff <first> <second> [--tolerance ticks] [--max n]\n");
+		printf("       ./loadmidi diff-list <pairs.txt> [--threads n] [--tolerance ticks]\n");
+		printf("       ./loadmidi daemon <socket> [--budget megabytes] [--threads n]\n");
+		printf("       ./loadmidi query <socket> <request>...\n");
+	}
+	else if ((strcmp(argv[1], "dump") == 0) && (argc > 2)) {
+		if (VisitMidiFile(argv[2], &PrintVisitor, NULL) != 0) {
+			printf("Error loading %s\n", argv[2]);
+			return 1;
+		}
+	}
+	else if (strcmp(argv[1], "fingerprint") == 0)
+		return FingerprintCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "transform") == 0)
+		return TransformCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "replay-raw") == 0)
+		return ReplayRawCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "catalog") == 0)
+		return CatalogCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "catalog-query") == 0)
+		return CatalogQueryCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "ngram-build") == 0)
+		return NgramBuildCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "ngram-query") == 0)
+		return NgramQueryCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "speculative-check") == 0)
+		return SpeculativeCheckCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "pianoroll") == 0)
+		return PianoRollCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "optimise") == 0)
+		return OptimiseCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "synth") == 0)
+		return SynthCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "pack") == 0)
+		return PackCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "pack-list") == 0)
+		return PackListCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "pack-extract") == 0)
+		return PackExtractCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "pack-scan") == 0)
+		return PackScanCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "compressed-check") == 0)
+		return CompressedCheckCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "fanout") == 0)
+		return FanoutCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "chords") == 0)
+		return ChordsCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "slice") == 0)
+		return SliceCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "diff") == 0)
+		return DiffCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "diff-list") == 0)
+		return DiffListCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "daemon") == 0)
+		return DaemonCommand(argc - 2, argv + 2);
+	else if (strcmp(argv[1], "query") == 0)
+		return QueryCommand(argc - 2, argv + 2);
 	else
 		LoadMidiFile(argv[1]);
 
@@ -0,0 +1,862 @@
+/*
+	ngram.c :	Melodic interval n-gram inverted index and query engine
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ngram.h"
+#include "context.h"
+#include "parallel.h"
+#include "util.h"
+
+
+#define NGRAM_MAGIC "MNGR"
+#define NGRAM_VERSION 2
+#define NGRAM_HEADER_SIZE 40
+#define NGRAM_DICTIONARY_ENTRY_SIZE 16
+
+/* postings per skip block, and the size of one skip entry */
+#define NGRAM_SKIP_INTERVAL 128
+#define NGRAM_SKIP_ENTRY_SIZE 12
+
+/* a posting packs file, stream and note position into one sortable word */
+#define FILE_BITS 24
+#define STREAM_BITS 16
+#define POSITION_BITS 24
+#define MAX_FILES (1U << FILE_BITS)
+#define MAX_STREAMS (1U << STREAM_BITS)
+#define MAX_POSITION (1U << POSITION_BITS)
+
+#define DRUM_CHANNEL 9
+
+
+typedef struct {
+	unsigned int key;
+	unsigned long long doc;
+} Posting;
+
+typedef struct {
+	Posting* postings;		/* sorted by key, then doc */
+	unsigned int numPostings;
+	int failed;			/* ran out of memory part way through */
+} FilePostings;
+
+
+static unsigned long long MakeDoc(unsigned int file, unsigned int stream, unsigned int position)
+{
+	return ((unsigned long long)file << (STREAM_BITS + POSITION_BITS)) |
+		((unsigned long long)stream << POSITION_BITS) |
+		position;
+}
+
+
+static unsigned int GramKey(const unsigned char* pitches)
+{
+	unsigned int key = 0;
+
+	for (unsigned int i=0; i < NGRAM_LENGTH; i++) {
+		int interval = (int)pitches[i + 1] - (int)pitches[i];
+		key |= (unsigned int)((interval + 128) & 0xFF) << (8 * i);
+	}
+
+	return key;
+}
+
+
+void InitMelodyScratch(MelodyScratch* scratch)
+{
+	memset(scratch, 0, sizeof(MelodyScratch));
+}
+
+
+void FreeMelodyScratch(MelodyScratch* scratch)
+{
+	for (int c=0; c < 16; c++) {
+		free(scratch->pitches[c]);
+		free(scratch->ticks[c]);
+	}
+	InitMelodyScratch(scratch);
+}
+
+
+/*
+	Splits one track into per-channel melodies, keeping the highest
+	note of every onset tick.
+*/
+int ExtractMelodies(ParserContext* ctx, unsigned int track, MelodyScratch* scratch)
+{
+	Event* events = ContextTrackEvents(ctx, track);
+	unsigned long* ticks = ContextTrackTicks(ctx, track);
+
+	for (int c=0; c < 16; c++)
+		scratch->numNotes[c] = 0;
+
+	for (unsigned int i=0; i < ctx->tracks[track].numEvents; i++) {
+		unsigned char channel = events[i].type & 0x0F;
+
+		if (((events[i].type & 0xF0) != 0x90) || (events[i].data[1] == 0) || (channel == DRUM_CHANNEL))
+			continue;
+
+		unsigned int n = scratch->numNotes[channel];
+		unsigned char key = events[i].data[0];
+
+		if (n && (scratch->ticks[channel][n - 1] == ticks[i])) {
+			if (key > scratch->pitches[channel][n - 1])
+				scratch->pitches[channel][n - 1] = key;
+			continue;
+		}
+
+		if (n == scratch->capacity[channel]) {
+			unsigned int capacity = n ? n * 2 : 256;
+			unsigned char* pitches = (unsigned char *)realloc(scratch->pitches[channel], capacity);
+			if (pitches)
+				scratch->pitches[channel] = pitches;
+			unsigned long* noteTicks = (unsigned long *)realloc(scratch->ticks[channel], capacity * sizeof(unsigned long));
+			if (noteTicks)
+				scratch->ticks[channel] = noteTicks;
+			if (!pitches || !noteTicks)
+				return 1;
+			scratch->capacity[channel] = capacity;
+		}
+
+		scratch->pitches[channel][n] = key;
+		scratch->ticks[channel][n] = ticks[i];
+		scratch->numNotes[channel] = n + 1;
+	}
+
+	return 0;
+}
+
+
+static int ComparePostings(const void* a, const void* b)
+{
+	const Posting* pa = (const Posting *)a;
+	const Posting* pb = (const Posting *)b;
+
+	if (pa->key != pb->key)
+		return (pa->key > pb->key) - (pa->key < pb->key);
+
+	return (pa->doc > pb->doc) - (pa->doc < pb->doc);
+}
+
+
+typedef struct {
+	char** paths;
+	FilePostings* results;
+	ParserContext** contexts;
+	MelodyScratch* scratch;
+} IndexJob;
+
+
+static void IndexFile(void* arg, unsigned int index, unsigned int worker)
+{
+	IndexJob* job = (IndexJob *)arg;
+	ParserContext* ctx = job->contexts[worker];
+	MelodyScratch* scratch = &job->scratch[worker];
+	FilePostings* result = &job->results[index];
+	unsigned int capacity = 0;
+
+	result->postings = NULL;
+	result->numPostings = 0;
+	result->failed = 0;
+
+	if (ParseMidiFile(ctx, job->paths[index]) != 0)
+		return;
+
+	for (unsigned int t=0; (t < ctx->numTracks) && (t * 16 < MAX_STREAMS); t++) {
+		if (ExtractMelodies(ctx, t, scratch) != 0) {
+			result->failed = 1;
+			return;
+		}
+
+		for (unsigned int c=0; c < 16; c++) {
+			unsigned int numNotes = scratch->numNotes[c];
+			if (numNotes > MAX_POSITION)
+				numNotes = MAX_POSITION;
+
+			for (unsigned int p=0; p + NGRAM_LENGTH < numNotes; p++) {
+				if (result->numPostings == capacity) {
+					capacity = capacity ? capacity * 2 : 1024;
+					Posting* grown = (Posting *)realloc(result->postings, capacity * sizeof(Posting));
+					if (!grown) {
+						result->failed = 1;
+						return;
+					}
+					result->postings = grown;
+				}
+
+				Posting* posting = &result->postings[result->numPostings++];
+				posting->key = GramKey(scratch->pitches[c] + p);
+				posting->doc = MakeDoc(index, t * 16 + c, p);
+			}
+		}
+	}
+
+	/* each file is sorted here, so building only has to merge them */
+	qsort(result->postings, result->numPostings, sizeof(Posting), ComparePostings);
+}
+
+
+/*
+	Merges the per-file posting arrays in key then doc order through a
+	binary heap of the files that still have postings.
+*/
+typedef struct {
+	FilePostings* files;
+	unsigned int* next;		/* next unread posting of each file */
+	unsigned int* heap;		/* files, smallest head first */
+	unsigned int size;
+} PostingMerge;
+
+
+static int HeadBefore(const PostingMerge* merge, unsigned int a, unsigned int b)
+{
+	return ComparePostings(&merge->files[a].postings[merge->next[a]], &merge->files[b].postings[merge->next[b]]) < 0;
+}
+
+
+static void SiftDown(PostingMerge* merge, unsigned int i)
+{
+	for (;;) {
+		unsigned int smallest = i;
+		unsigned int left = 2 * i + 1;
+		unsigned int right = left + 1;
+
+		if ((left < merge->size) && HeadBefore(merge, merge->heap[left], merge->heap[smallest]))
+			smallest = left;
+		if ((right < merge->size) && HeadBefore(merge, merge->heap[right], merge->heap[smallest]))
+			smallest = right;
+		if (smallest == i)
+			return;
+
+		unsigned int file = merge->heap[i];
+		merge->heap[i] = merge->heap[smallest];
+		merge->heap[smallest] = file;
+		i = smallest;
+	}
+}
+
+
+static int OpenMerge(PostingMerge* merge, FilePostings* files, unsigned int numFiles)
+{
+	merge->files = files;
+	merge->next = (unsigned int *)calloc(numFiles ? numFiles : 1, sizeof(unsigned int));
+	merge->heap = (unsigned int *)malloc((numFiles ? numFiles : 1) * sizeof(unsigned int));
+	merge->size = 0;
+
+	if (!merge->next || !merge->heap)
+		return 1;
+
+	for (unsigned int i=0; i < numFiles; i++) {
+		if (files[i].numPostings)
+			merge->heap[merge->size++] = i;
+	}
+
+	for (unsigned int i=merge->size / 2; i > 0; i--)
+		SiftDown(merge, i - 1);
+
+	return 0;
+}
+
+
+static void CloseMerge(PostingMerge* merge)
+{
+	free(merge->next);
+	free(merge->heap);
+}
+
+
+/* returns 0 once every file is exhausted */
+static int NextMergedPosting(PostingMerge* merge, Posting* posting)
+{
+	if (merge->size == 0)
+		return 0;
+
+	unsigned int file = merge->heap[0];
+	*posting = merge->files[file].postings[merge->next[file]++];
+
+	if (merge->next[file] == merge->files[file].numPostings)
+		merge->heap[0] = merge->heap[--merge->size];
+	SiftDown(merge, 0);
+
+	return 1;
+}
+
+
+/*
+	Writes one key's docs as a table of skip entries, one per
+	NGRAM_SKIP_INTERVAL postings, holding the first doc of the block and
+	where its deltas start, followed by the deltas. A block's first doc is
+	only in its skip entry, so any block can be decoded on its own.
+	encoded must hold 10 bytes per doc. Returns the bytes written.
+*/
+static unsigned long long WritePostingList(FILE* f, const unsigned long long* docs, unsigned int count, unsigned char* encoded)
+{
+	unsigned int numBlocks = (count + NGRAM_SKIP_INTERVAL - 1) / NGRAM_SKIP_INTERVAL;
+	unsigned long size = 0;
+
+	for (unsigned int b=0; b < numBlocks; b++) {
+		unsigned int start = b * NGRAM_SKIP_INTERVAL;
+		unsigned int end = start + NGRAM_SKIP_INTERVAL < count ? start + NGRAM_SKIP_INTERVAL : count;
+
+		WriteLittleEndian(f, docs[start], 8);
+		WriteLittleEndian(f, size, 4);
+
+		for (unsigned int i=start + 1; i < end; i++)
+			size += PutUVarint(encoded + size, docs[i] - docs[i - 1]);
+	}
+
+	fwrite(encoded, 1, size, f);
+
+	return (unsigned long long)numBlocks * NGRAM_SKIP_ENTRY_SIZE + size;
+}
+
+
+typedef struct {
+	unsigned int key;
+	unsigned int count;
+	unsigned long long offset;
+} KeyEntry;
+
+
+int BuildNgramIndex(const char* indexFilename, char** paths, unsigned int numPaths, unsigned int numThreads)
+{
+	IndexJob job;
+	int res = 0;
+
+	if (numPaths > MAX_FILES)
+		return 1;
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+
+	job.paths = paths;
+	job.results = (FilePostings *)calloc(numPaths ? numPaths : 1, sizeof(FilePostings));
+	job.contexts = (ParserContext **)calloc(numThreads, sizeof(ParserContext *));
+	job.scratch = (MelodyScratch *)malloc(numThreads * sizeof(MelodyScratch));
+
+	if (!job.results || !job.contexts || !job.scratch)
+		res = 1;
+
+	for (unsigned int i=0; job.contexts && job.scratch && (i < numThreads); i++) {
+		InitMelodyScratch(&job.scratch[i]);
+		job.contexts[i] = CreateParserContext();
+		if (!job.contexts[i])
+			res = 1;
+	}
+
+	if (res == 0)
+		ParallelFor(numPaths, numThreads, IndexFile, &job);
+
+	for (unsigned int i=0; job.contexts && job.scratch && (i < numThreads); i++) {
+		FreeParserContext(job.contexts[i]);
+		FreeMelodyScratch(&job.scratch[i]);
+	}
+	free(job.contexts);
+	free(job.scratch);
+
+	for (unsigned int i=0; (res == 0) && (i < numPaths); i++) {
+		if (job.results[i].failed)
+			res = 1;
+	}
+
+	PostingMerge merge;
+	FILE* f = NULL;
+	KeyEntry* keys = NULL;
+	unsigned int numKeys = 0;
+	unsigned int keyCapacity = 0;
+	unsigned long long* docs = NULL;
+	unsigned char* encoded = NULL;
+	unsigned int docCapacity = 0;
+	unsigned long long position = NGRAM_HEADER_SIZE;
+
+	if ((res == 0) && (OpenMerge(&merge, job.results, numPaths) != 0)) {
+		CloseMerge(&merge);
+		res = 1;
+	}
+
+	if (res == 0) {
+		f = fopen(indexFilename, "wb");
+		if (!f) {
+			CloseMerge(&merge);
+			res = 1;
+		}
+	}
+
+	if (res == 0) {
+		/* header, rewritten at the end once the offsets are known */
+		unsigned char header[NGRAM_HEADER_SIZE];
+		memset(header, 0, sizeof(header));
+		fwrite(header, 1, sizeof(header), f);
+
+		/* posting lists, gathering one key's docs at a time */
+		Posting posting;
+		int more = NextMergedPosting(&merge, &posting);
+
+		while (more && (res == 0)) {
+			unsigned int key = posting.key;
+			unsigned int count = 0;
+
+			do {
+				if (count == docCapacity) {
+					unsigned int capacity = docCapacity ? docCapacity * 2 : 1024;
+					unsigned long long* grownDocs = (unsigned long long *)realloc(docs, capacity * sizeof(unsigned long long));
+					if (grownDocs)
+						docs = grownDocs;
+					unsigned char* grownEncoded = (unsigned char *)realloc(encoded, (unsigned long)capacity * 10);
+					if (grownEncoded)
+						encoded = grownEncoded;
+					if (!grownDocs || !grownEncoded) {
+						res = 1;
+						break;
+					}
+					docCapacity = capacity;
+				}
+
+				docs[count++] = posting.doc;
+				more = NextMergedPosting(&merge, &posting);
+			} while (more && (posting.key == key));
+
+			if ((res == 0) && (numKeys == keyCapacity)) {
+				unsigned int capacity = keyCapacity ? keyCapacity * 2 : 4096;
+				KeyEntry* grown = (KeyEntry *)realloc(keys, capacity * sizeof(KeyEntry));
+				if (grown) {
+					keys = grown;
+					keyCapacity = capacity;
+				}
+				else {
+					res = 1;
+				}
+			}
+
+			if (res == 0) {
+				keys[numKeys].key = key;
+				keys[numKeys].count = count;
+				keys[numKeys++].offset = position;
+				position += WritePostingList(f, docs, count, encoded);
+			}
+		}
+
+		CloseMerge(&merge);
+	}
+
+	free(docs);
+	free(encoded);
+	for (unsigned int i=0; job.results && (i < numPaths); i++)
+		free(job.results[i].postings);
+	free(job.results);
+
+	if (res == 0) {
+		unsigned long long dictionaryOffset = position;
+		for (unsigned int i=0; i < numKeys; i++) {
+			WriteLittleEndian(f, keys[i].key, 4);
+			WriteLittleEndian(f, keys[i].count, 4);
+			WriteLittleEndian(f, keys[i].offset, 8);
+		}
+
+		unsigned long long filesOffset = dictionaryOffset + (unsigned long long)numKeys * NGRAM_DICTIONARY_ENTRY_SIZE;
+		for (unsigned int i=0; i < numPaths; i++) {
+			unsigned long length = strlen(paths[i]) + 1;
+			WriteLittleEndian(f, length, 4);
+			fwrite(paths[i], 1, length, f);
+		}
+
+		fseek(f, 0, SEEK_SET);
+		fwrite(NGRAM_MAGIC, 1, 4, f);
+		WriteLittleEndian(f, NGRAM_VERSION, 4);
+		WriteLittleEndian(f, NGRAM_LENGTH, 4);
+		WriteLittleEndian(f, numPaths, 4);
+		WriteLittleEndian(f, numKeys, 4);
+		WriteLittleEndian(f, NGRAM_SKIP_INTERVAL, 4);
+		WriteLittleEndian(f, dictionaryOffset, 8);
+		WriteLittleEndian(f, filesOffset, 8);
+
+		if (ferror(f))
+			res = 1;
+	}
+
+	if (f && (fclose(f) != 0))
+		res = 1;
+
+	free(keys);
+
+	return res;
+}
+
+
+int OpenNgramIndex(NgramIndex* index, const char* filename)
+{
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+
+	memset(index, 0, sizeof(NgramIndex));
+	if (fd < 0)
+		return 1;
+
+	if ((fstat(fd, &st) != 0) || (st.st_size < NGRAM_HEADER_SIZE)) {
+		close(fd);
+		return 1;
+	}
+
+	void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 1;
+
+	index->data = (const unsigned char *)data;
+	index->size = st.st_size;
+
+	if ((memcmp(index->data, NGRAM_MAGIC, 4) != 0) ||
+		(ReadLittleEndian(index->data + 4, 4) != NGRAM_VERSION) ||
+		(ReadLittleEndian(index->data + 8, 4) != NGRAM_LENGTH)) {
+		CloseNgramIndex(index);
+		return 1;
+	}
+
+	index->numFiles = ReadLittleEndian(index->data + 12, 4);
+	index->numKeys = ReadLittleEndian(index->data + 16, 4);
+	index->skipInterval = ReadLittleEndian(index->data + 20, 4);
+	unsigned long long dictionaryOffset = ReadLittleEndian(index->data + 24, 8);
+	unsigned long long filesOffset = ReadLittleEndian(index->data + 32, 8);
+
+	if ((dictionaryOffset + (unsigned long long)index->numKeys * NGRAM_DICTIONARY_ENTRY_SIZE > index->size) ||
+		(filesOffset > index->size) || (index->skipInterval == 0)) {
+		CloseNgramIndex(index);
+		return 1;
+	}
+
+	index->dictionary = index->data + dictionaryOffset;
+	index->postings = index->data + NGRAM_HEADER_SIZE;
+	index->filenames = (const char **)malloc((index->numFiles ? index->numFiles : 1) * sizeof(char *));
+
+	unsigned long long offset = filesOffset;
+	for (unsigned int i=0; i < index->numFiles; i++) {
+		if (offset + 4 > index->size) {
+			CloseNgramIndex(index);
+			return 1;
+		}
+		unsigned long length = ReadLittleEndian(index->data + offset, 4);
+		if ((length == 0) || (offset + 4 + length > index->size)) {
+			CloseNgramIndex(index);
+			return 1;
+		}
+		index->filenames[i] = (const char *)index->data + offset + 4;
+		offset += 4 + length;
+	}
+
+	return 0;
+}
+
+
+void CloseNgramIndex(NgramIndex* index)
+{
+	if (index->data)
+		munmap((void *)index->data, index->size);
+
+	free(index->filenames);
+	memset(index, 0, sizeof(NgramIndex));
+}
+
+
+static const unsigned char* FindKey(const NgramIndex* index, unsigned int key)
+{
+	unsigned int low = 0;
+	unsigned int high = index->numKeys;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		const unsigned char* entry = index->dictionary + (unsigned long)mid * NGRAM_DICTIONARY_ENTRY_SIZE;
+		unsigned int midKey = ReadLittleEndian(entry, 4);
+
+		if (midKey == key)
+			return entry;
+		if (midKey < key)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return NULL;
+}
+
+
+typedef struct {
+	const NgramIndex* index;
+	const unsigned char* skips;
+	unsigned long long dataOffset;	/* of the deltas, in the index file */
+	unsigned int count;
+	unsigned int numBlocks;
+	unsigned int block;
+	unsigned int inBlock;		/* postings of the block already read */
+	unsigned long long offset;	/* of the next delta */
+	unsigned long long doc;
+	int done;
+} PostingCursor;
+
+
+static void LoadBlock(PostingCursor* cursor, unsigned int block)
+{
+	const unsigned char* skip = cursor->skips + (unsigned long)block * NGRAM_SKIP_ENTRY_SIZE;
+
+	cursor->block = block;
+	cursor->inBlock = 1;
+	cursor->doc = ReadLittleEndian(skip, 8);
+	cursor->offset = cursor->dataOffset + ReadLittleEndian(skip + 8, 4);
+}
+
+
+/* Positions the cursor on the first posting of a dictionary entry. */
+static void OpenCursor(const NgramIndex* index, const unsigned char* entry, PostingCursor* cursor)
+{
+	unsigned long long offset = ReadLittleEndian(entry + 8, 8);
+
+	cursor->index = index;
+	cursor->count = ReadLittleEndian(entry + 4, 4);
+	cursor->numBlocks = (cursor->count + index->skipInterval - 1) / index->skipInterval;
+	cursor->skips = index->data + offset;
+	cursor->dataOffset = offset + (unsigned long long)cursor->numBlocks * NGRAM_SKIP_ENTRY_SIZE;
+	cursor->done = (cursor->count == 0) || (cursor->dataOffset > index->size);
+
+	if (!cursor->done)
+		LoadBlock(cursor, 0);
+}
+
+
+static void NextPosting(PostingCursor* cursor)
+{
+	unsigned int blockSize = cursor->block + 1 < cursor->numBlocks ? cursor->index->skipInterval :
+		cursor->count - cursor->block * cursor->index->skipInterval;
+
+	if (cursor->inBlock == blockSize) {
+		if (cursor->block + 1 < cursor->numBlocks)
+			LoadBlock(cursor, cursor->block + 1);
+		else
+			cursor->done = 1;
+		return;
+	}
+
+	unsigned long long delta;
+	unsigned int size = cursor->offset < cursor->index->size ?
+		GetUVarint(cursor->index->data + cursor->offset, cursor->index->size - cursor->offset, &delta) : 0;
+
+	if (!size) {
+		cursor->done = 1;
+		return;
+	}
+
+	cursor->offset += size;
+	cursor->doc += delta;
+	cursor->inBlock++;
+}
+
+
+/*
+	Moves to the first posting at or after doc and says whether it is doc.
+	Whole blocks are passed over using their skip entries, so only the
+	block that may hold doc is decoded. Targets must not decrease.
+*/
+static int SeekPosting(PostingCursor* cursor, unsigned long long doc)
+{
+	if (cursor->done)
+		return 0;
+	if (cursor->doc >= doc)
+		return cursor->doc == doc;
+
+	/* last block starting at or before doc, galloping out from this one */
+	unsigned int low = cursor->block + 1;
+	unsigned int high = low;
+	for (unsigned int step=1; (high < cursor->numBlocks) &&
+		(ReadLittleEndian(cursor->skips + (unsigned long)high * NGRAM_SKIP_ENTRY_SIZE, 8) <= doc); step *= 2) {
+		low = high + 1;
+		high += step;
+	}
+	if (high > cursor->numBlocks)
+		high = cursor->numBlocks;
+
+	while (low < high) {
+		unsigned int mid = (low + high) / 2;
+		if (ReadLittleEndian(cursor->skips + (unsigned long)mid * NGRAM_SKIP_ENTRY_SIZE, 8) <= doc)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	if (low - 1 > cursor->block)
+		LoadBlock(cursor, low - 1);
+
+	while (!cursor->done && (cursor->doc < doc))
+		NextPosting(cursor);
+
+	return !cursor->done && (cursor->doc == doc);
+}
+
+
+/*
+	Finds every stream position where the query's interval sequence
+	starts. The query needs at least NGRAM_LENGTH + 1 pitches. matches is
+	allocated and owned by the caller.
+
+	Only the rarest gram's list is decoded in full. The others are probed
+	from rarest to most common, at the positions still matching, so the
+	cost follows the rarest list rather than the most common one.
+*/
+int QueryNgramIndex(const NgramIndex* index, const unsigned char* pitches, unsigned int numPitches, NgramMatch** matches, unsigned int* numMatches)
+{
+	*matches = NULL;
+	*numMatches = 0;
+
+	if (numPitches < NGRAM_LENGTH + 1)
+		return 1;
+
+	unsigned int numGrams = numPitches - NGRAM_LENGTH;
+	const unsigned char** entries = (const unsigned char **)malloc(numGrams * sizeof(unsigned char *));
+	unsigned int* order = (unsigned int *)malloc(numGrams * sizeof(unsigned int));
+	if (!entries || !order) {
+		free(entries);
+		free(order);
+		return 1;
+	}
+
+	for (unsigned int g=0; g < numGrams; g++) {
+		entries[g] = FindKey(index, GramKey(pitches + g));
+		if (!entries[g]) {
+			free(entries);
+			free(order);
+			return 0;
+		}
+
+		/* insertion sort by list length, there are only a few grams */
+		unsigned int count = ReadLittleEndian(entries[g] + 4, 4);
+		unsigned int k = g;
+		while ((k > 0) && (ReadLittleEndian(entries[order[k - 1]] + 4, 4) > count)) {
+			order[k] = order[k - 1];
+			k--;
+		}
+		order[k] = g;
+	}
+
+	/* candidate starts from the rarest list, which come out sorted */
+	PostingCursor cursor;
+	unsigned int anchor = order[0];
+	unsigned long long* starts = NULL;
+	unsigned int numStarts = 0;
+	unsigned int capacity = 0;
+
+	for (OpenCursor(index, entries[anchor], &cursor); !cursor.done; NextPosting(&cursor)) {
+		if ((cursor.doc & (MAX_POSITION - 1)) < anchor)
+			continue;
+
+		if (numStarts == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			unsigned long long* grown = (unsigned long long *)realloc(starts, capacity * sizeof(unsigned long long));
+			if (!grown) {
+				free(starts);
+				free(entries);
+				free(order);
+				return 1;
+			}
+			starts = grown;
+		}
+		starts[numStarts++] = cursor.doc - anchor;
+	}
+
+	for (unsigned int k=1; (k < numGrams) && numStarts; k++) {
+		unsigned int g = order[k];
+		unsigned int kept = 0;
+
+		OpenCursor(index, entries[g], &cursor);
+		for (unsigned int i=0; i < numStarts; i++) {
+			if (SeekPosting(&cursor, starts[i] + g))
+				starts[kept++] = starts[i];
+		}
+		numStarts = kept;
+	}
+
+	if (numStarts) {
+		*matches = (NgramMatch *)malloc(numStarts * sizeof(NgramMatch));
+		if (!*matches) {
+			free(starts);
+			free(entries);
+			free(order);
+			return 1;
+		}
+	}
+
+	for (unsigned int i=0; i < numStarts; i++) {
+		NgramMatch* match = &(*matches)[i];
+		unsigned int stream = (starts[i] >> POSITION_BITS) & (MAX_STREAMS - 1);
+		match->file = starts[i] >> (STREAM_BITS + POSITION_BITS);
+		match->track = stream / 16;
+		match->channel = stream % 16;
+		match->position = starts[i] & (MAX_POSITION - 1);
+		match->tick = 0;
+	}
+	*numMatches = numStarts;
+
+	free(starts);
+	free(entries);
+	free(order);
+
+	return 0;
+}
+
+
+/*
+	Re-reads the matched files and drops matches that no longer hold,
+	e.g. because a file changed after indexing. Fills in match ticks.
+	Matches from QueryNgramIndex are already grouped by file.
+*/
+int VerifyNgramMatches(const NgramIndex* index, const unsigned char* pitches, unsigned int numPitches, NgramMatch* matches, unsigned int* numMatches)
+{
+	ParserContext* ctx = CreateParserContext();
+	MelodyScratch scratch;
+	unsigned int kept = 0;
+	int loadedFile = -1;
+	int loadedTrack = -1;
+	int parsed = 0;
+
+	InitMelodyScratch(&scratch);
+
+	for (unsigned int i=0; i < *numMatches; i++) {
+		NgramMatch match = matches[i];
+
+		if ((int)match.file != loadedFile) {
+			parsed = (match.file < index->numFiles) && (ParseMidiFile(ctx, index->filenames[match.file]) == 0);
+			loadedFile = match.file;
+			loadedTrack = -1;
+		}
+		if (!parsed || (match.track >= ctx->numTracks))
+			continue;
+
+		if ((int)match.track != loadedTrack) {
+			if (ExtractMelodies(ctx, match.track, &scratch) != 0)
+				continue;
+			loadedTrack = match.track;
+		}
+
+		const unsigned char* melody = scratch.pitches[match.channel];
+		if (match.position + numPitches > scratch.numNotes[match.channel])
+			continue;
+
+		int same = 1;
+		for (unsigned int p=1; (p < numPitches) && same; p++) {
+			same = ((int)melody[match.position + p] - melody[match.position + p - 1]) ==
+				((int)pitches[p] - pitches[p - 1]);
+		}
+		if (!same)
+			continue;
+
+		match.tick = scratch.ticks[match.channel][match.position];
+		matches[kept++] = match;
+	}
+
+	*numMatches = kept;
+	FreeMelodyScratch(&scratch);
+	FreeParserContext(ctx);
+
+	return 0;
+}
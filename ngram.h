@@ -0,0 +1,58 @@
+#ifndef __NGRAM_H__
+#define __NGRAM_H__
+
+#include "context.h"
+
+/*
+	Transposition-invariant melodic search. Each (track, channel) stream
+	is reduced to its highest note per onset tick, then every run of
+	NGRAM_LENGTH consecutive intervals becomes a key. Four intervals fit in
+	32 bits, so keys are exact. The inverted index maps each key to a
+	delta + varint compressed list of (file, stream, note position)
+	postings, cut into blocks with a skip entry each so a list can be
+	probed without decoding all of it. A query intersects the lists on
+	aligned positions, rarest first, and can then verify hits against the
+	files themselves. Drums (channel 10) are
+	not indexed.
+*/
+
+#define NGRAM_LENGTH 4
+
+typedef struct {
+	unsigned char* pitches[16];
+	unsigned long* ticks[16];
+	unsigned int numNotes[16];
+	unsigned int capacity[16];
+} MelodyScratch;
+
+typedef struct {
+	const unsigned char* data;	/* mapped index file */
+	unsigned long size;
+	unsigned int numFiles;
+	unsigned int numKeys;
+	unsigned int skipInterval;	/* postings per skip block */
+	const unsigned char* dictionary;
+	const unsigned char* postings;
+	const char** filenames;
+} NgramIndex;
+
+typedef struct {
+	unsigned int file;
+	unsigned int track;
+	unsigned int channel;
+	unsigned int position;		/* index of the first note in the stream */
+	unsigned long tick;		/* filled in by verification */
+} NgramMatch;
+
+
+void InitMelodyScratch(MelodyScratch* scratch);
+void FreeMelodyScratch(MelodyScratch* scratch);
+int ExtractMelodies(ParserContext* ctx, unsigned int track, MelodyScratch* scratch);
+
+int BuildNgramIndex(const char* indexFilename, char** paths, unsigned int numPaths, unsigned int numThreads);
+int OpenNgramIndex(NgramIndex* index, const char* filename);
+void CloseNgramIndex(NgramIndex* index);
+int QueryNgramIndex(const NgramIndex* index, const unsigned char* pitches, unsigned int numPitches, NgramMatch** matches, unsigned int* numMatches);
+int VerifyNgramMatches(const NgramIndex* index, const unsigned char* pitches, unsigned int numPitches, NgramMatch* matches, unsigned int* numMatches);
+
+#endif
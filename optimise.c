@@ -0,0 +1,694 @@
+/*
+	optimise.c :	Strips semantically redundant events from a decoded
+			file, and checks two files for equivalent playback state
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "optimise.h"
+#include "writemidi.h"
+#include "fingerprint.h"
+
+
+/* a drum hit sounds however short it is, so its notes are never empty */
+#define DRUM_CHANNEL 9
+
+typedef struct {
+	unsigned long tick;
+	unsigned int index;
+} EventRef;
+
+typedef struct {
+	short controllers[16][128];	/* -1 until first seen */
+	short programs[16];
+	int bends[16];
+	short pressures[16];
+	unsigned char bankPending[16];	/* bank select since the last program change */
+	unsigned char sounding[16][128];
+	unsigned int pendingOn[16][128];	/* index + 1 of a note on that started from silence */
+} ChannelState;
+
+
+static int CompareEventRefs(const void* a, const void* b)
+{
+	const EventRef* ra = (const EventRef *)a;
+	const EventRef* rb = (const EventRef *)b;
+
+	if (ra->tick != rb->tick)
+		return (ra->tick < rb->tick) ? -1 : 1;
+	if (ra->index != rb->index)
+		return (ra->index < rb->index) ? -1 : 1;
+
+	return 0;
+}
+
+
+/* Tempo, time signature and key signature: one value in force at a time. */
+static int StateMetaKind(const Event* event)
+{
+	if (event->type != 0xFF)
+		return -1;
+
+	switch (event->subtype) {
+		case 0x51: return 0;	// Set tempo
+		case 0x58: return 1;	// Set time signature
+		case 0x59: return 2;	// Set key signature
+		default: return -1;
+	}
+}
+
+
+static int SameEventData(const Event* a, const Event* b)
+{
+	return (a->size == b->size) && (memcmp(a->data, b->data, a->size) == 0);
+}
+
+
+static unsigned int TrackOfEvent(ParserContext* ctx, unsigned int index)
+{
+	unsigned int lo = 0, hi = ctx->numTracks;
+
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (ctx->tracks[mid].firstEvent <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+
+/*
+	Events of all tracks in playback order: by tick, then file order. In
+	format 2 every track is its own song, so file order is playback order.
+*/
+static EventRef* PlaybackOrder(ParserContext* ctx, int (*filter)(const Event*), unsigned int* numRefs)
+{
+	EventRef* refs = (EventRef *)malloc((ctx->numEvents ? ctx->numEvents : 1) * sizeof(EventRef));
+	unsigned int count = 0;
+
+	if (!refs)
+		return NULL;
+
+	for (unsigned int i=0; i < ctx->numEvents; i++) {
+		if (!filter || filter(&ctx->events[i])) {
+			refs[count].tick = ctx->ticks[i];
+			refs[count].index = i;
+			count++;
+		}
+	}
+
+	if (ctx->fileInfo.formatType != 2)
+		qsort(refs, count, sizeof(EventRef), CompareEventRefs);
+
+	*numRefs = count;
+
+	return refs;
+}
+
+
+static int IsStateMeta(const Event* event)
+{
+	return StateMetaKind(event) >= 0;
+}
+
+
+static int MarkRedundantMetas(ParserContext* ctx, unsigned char* removed, OptimiseStats* stats)
+{
+	unsigned int numRefs;
+	EventRef* refs = PlaybackOrder(ctx, IsStateMeta, &numRefs);
+	const Event* current[3] = {NULL, NULL, NULL};
+	unsigned int currentTrack = 0;
+
+	if (!refs)
+		return 1;
+
+	for (unsigned int start=0; start < numRefs; ) {
+		unsigned int track = TrackOfEvent(ctx, refs[start].index);
+		unsigned int end = start + 1;
+
+		if ((ctx->fileInfo.formatType == 2) && (track != currentTrack)) {
+			current[0] = current[1] = current[2] = NULL;
+			currentTrack = track;
+		}
+
+		while ((end < numRefs) && (refs[end].tick == refs[start].tick) &&
+			((ctx->fileInfo.formatType != 2) || (TrackOfEvent(ctx, refs[end].index) == track)))
+			end++;
+
+		/* within one tick only the last event of each kind takes effect */
+		for (unsigned int i=start; i < end; i++) {
+			Event* event = &ctx->events[refs[i].index];
+			int kind = StateMetaKind(event);
+			int overridden = 0;
+
+			for (unsigned int j=i + 1; (j < end) && !overridden; j++)
+				overridden = StateMetaKind(&ctx->events[refs[j].index]) == kind;
+
+			if (overridden || (current[kind] && SameEventData(current[kind], event))) {
+				removed[refs[i].index] = 1;
+				stats->removedMetas++;
+			}
+			else {
+				current[kind] = event;
+			}
+		}
+
+		start = end;
+	}
+
+	free(refs);
+
+	return 0;
+}
+
+
+static int IsFixedController(unsigned char controller)
+{
+	switch (controller) {
+		case 0:		// Bank select, applied by the next program change
+		case 32:
+		case 6:		// Data entry acts on the selected parameter
+		case 38:
+		case 96:	// Data increment, decrement and parameter numbers
+		case 97:
+		case 98:
+		case 99:
+		case 100:
+		case 101:
+			return 1;
+		default:
+			return controller >= 120;	/* channel mode messages */
+	}
+}
+
+
+/* Controllers that Reset all controllers (CC121) returns to their defaults. */
+static int ClearedByReset(unsigned char controller)
+{
+	return (controller < 120) && (controller != 0) && (controller != 32) && (controller != 7) && (controller != 10);
+}
+
+
+/* GM system on and off, GS reset and XG system on: every channel starts over. */
+static int IsResetSysex(const Event* event)
+{
+	static const unsigned char gsReset[] = {0x42, 0x12, 0x40, 0x00, 0x7F, 0x00, 0x41};
+	static const unsigned char xgReset[] = {0x4C, 0x00, 0x00, 0x7E, 0x00};
+	const unsigned char* data = event->data;
+
+	if (event->type != 0xF0)
+		return 0;
+
+	if ((event->size >= 4) && (data[0] == 0x7E) && (data[2] == 0x09))
+		return (data[3] >= 0x01) && (data[3] <= 0x03);
+	if ((event->size >= 2 + sizeof(gsReset)) && (data[0] == 0x41))
+		return memcmp(data + 2, gsReset, sizeof(gsReset)) == 0;
+	if ((event->size >= 2 + sizeof(xgReset)) && (data[0] == 0x43) && ((data[1] & 0xF0) == 0x10))
+		return memcmp(data + 2, xgReset, sizeof(xgReset)) == 0;
+
+	return 0;
+}
+
+
+static void ForgetChannelValues(ChannelState* state)
+{
+	memset(state->controllers, 0xFF, sizeof(state->controllers));
+	memset(state->programs, 0xFF, sizeof(state->programs));
+	memset(state->bends, 0xFF, sizeof(state->bends));
+	memset(state->pressures, 0xFF, sizeof(state->pressures));
+}
+
+
+static int CompareTicks(const void* a, const void* b)
+{
+	unsigned long ta = *(const unsigned long *)a;
+	unsigned long tb = *(const unsigned long *)b;
+
+	return (ta > tb) - (ta < tb);
+}
+
+
+/*
+	Ticks of the reset sysex events that apply to a track: those of every
+	track, except in format 2 where each track is its own song.
+*/
+static unsigned long* ResetTicks(ParserContext* ctx, unsigned int track, unsigned int* numResets)
+{
+	unsigned int first = 0, last = ctx->numEvents;
+	unsigned int count = 0;
+
+	if (ctx->fileInfo.formatType == 2) {
+		first = ctx->tracks[track].firstEvent;
+		last = first + ctx->tracks[track].numEvents;
+	}
+
+	for (unsigned int i=first; i < last; i++)
+		count += IsResetSysex(&ctx->events[i]);
+
+	unsigned long* ticks = (unsigned long *)malloc((count ? count : 1) * sizeof(unsigned long));
+	if (!ticks)
+		return NULL;
+
+	count = 0;
+	for (unsigned int i=first; i < last; i++) {
+		if (IsResetSysex(&ctx->events[i]))
+			ticks[count++] = ctx->ticks[i];
+	}
+	qsort(ticks, count, sizeof(unsigned long), CompareTicks);
+
+	*numResets = count;
+
+	return ticks;
+}
+
+
+static int MarkRedundantChannelEvents(ParserContext* ctx, unsigned int track, const int* owners, ChannelState* state, unsigned char* removed, OptimiseStats* stats)
+{
+	TrackSpan* span = &ctx->tracks[track];
+	unsigned int numResets = 0;
+	unsigned int nextReset = 0;
+	unsigned long* resets = ResetTicks(ctx, track, &numResets);
+
+	if (!resets)
+		return 1;
+
+	ForgetChannelValues(state);
+	memset(state->bankPending, 0, sizeof(state->bankPending));
+	memset(state->sounding, 0, sizeof(state->sounding));
+	memset(state->pendingOn, 0, sizeof(state->pendingOn));
+
+	for (unsigned int i=span->firstEvent; i < span->firstEvent + span->numEvents; i++) {
+		Event* event = &ctx->events[i];
+
+		while ((nextReset < numResets) && (resets[nextReset] < ctx->ticks[i])) {
+			ForgetChannelValues(state);
+			nextReset++;
+		}
+
+		/*
+			Events sharing a tick with a reset in another track may play
+			before or after it, so they neither go nor leave a known value.
+		*/
+		int beside = (nextReset < numResets) && (resets[nextReset] == ctx->ticks[i]);
+		if (beside)
+			ForgetChannelValues(state);
+
+		if (event->type >= 0xF0)
+			continue;
+
+		unsigned int channel = event->type & 0x0F;
+		unsigned char data1 = event->data[0];
+		unsigned char data2 = (event->size > 1) ? event->data[1] : 0;
+
+		if (owners[channel] != (int)track)
+			continue;
+
+		switch (event->type & 0xF0) {
+			case 0x90:
+				if (data2 > 0) {
+					state->pendingOn[channel][data1] = (state->sounding[channel][data1] == 0) ? i + 1 : 0;
+					if (state->sounding[channel][data1] < 255)
+						state->sounding[channel][data1]++;
+					break;
+				}
+				/* fall through: note on with velocity 0 is a note off */
+			case 0x80: {
+				unsigned int on = state->pendingOn[channel][data1];
+				if ((state->sounding[channel][data1] == 1) && on && (ctx->ticks[on - 1] == ctx->ticks[i]) &&
+					(channel != DRUM_CHANNEL)) {
+					removed[on - 1] = 1;
+					removed[i] = 1;
+					stats->removedNotes++;
+				}
+				state->pendingOn[channel][data1] = 0;
+				if (state->sounding[channel][data1] > 0)
+					state->sounding[channel][data1]--;
+				break;
+			}
+			case 0xB0:
+				if (data1 == 121) {
+					for (unsigned int cc=0; cc < 128; cc++) {
+						if (ClearedByReset(cc))
+							state->controllers[channel][cc] = -1;
+					}
+					state->bends[channel] = -1;
+					state->pressures[channel] = -1;
+				}
+				else if (IsFixedController(data1)) {
+					if ((data1 == 0) || (data1 == 32))
+						state->bankPending[channel] = 1;
+				}
+				else if (state->controllers[channel][data1] == data2) {
+					removed[i] = 1;
+					stats->removedControllers++;
+				}
+				else {
+					state->controllers[channel][data1] = data2;
+				}
+				break;
+			case 0xC0:
+				if (!state->bankPending[channel] && (state->programs[channel] == data1)) {
+					removed[i] = 1;
+					stats->removedPrograms++;
+				}
+				state->programs[channel] = data1;
+				state->bankPending[channel] = 0;
+				break;
+			case 0xD0:
+				if (state->pressures[channel] == data1) {
+					removed[i] = 1;
+					stats->removedControllers++;
+				}
+				state->pressures[channel] = data1;
+				break;
+			case 0xE0: {
+				int bend = data1 | (data2 << 7);
+				if (state->bends[channel] == bend) {
+					removed[i] = 1;
+					stats->removedControllers++;
+				}
+				state->bends[channel] = bend;
+				break;
+			}
+			default:
+				break;
+		}
+
+		if (beside)
+			ForgetChannelValues(state);
+	}
+
+	free(resets);
+
+	return 0;
+}
+
+
+/* Size of the file WriteMidiFile would produce for ctx. */
+unsigned long EncodedMidiSize(ParserContext* ctx)
+{
+	unsigned long size = 14;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++)
+		size += 8 + EmitTrackEvents(NULL, ContextTrackEvents(ctx, t), ctx->tracks[t].numEvents);
+
+	return size;
+}
+
+
+int OptimiseMidi(ParserContext* ctx, OptimiseStats* stats)
+{
+	int owners[16];
+
+	memset(stats, 0, sizeof(OptimiseStats));
+	stats->eventsBefore = ctx->numEvents;
+	stats->bytesBefore = ctx->size;
+
+	unsigned char* removed = (unsigned char *)calloc(ctx->numEvents ? ctx->numEvents : 1, sizeof(unsigned char));
+	ChannelState* state = (ChannelState *)malloc(sizeof(ChannelState));
+	if (!removed || !state || MarkRedundantMetas(ctx, removed, stats)) {
+		free(removed);
+		free(state);
+		ctx->error = "Out of memory";
+		return 1;
+	}
+
+	/* -1: unused, -2: shared by several tracks, otherwise the owning track */
+	for (int c=0; c < 16; c++)
+		owners[c] = -1;
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		Event* events = ContextTrackEvents(ctx, t);
+		for (unsigned int i=0; i < ctx->tracks[t].numEvents; i++) {
+			if (events[i].type < 0xF0) {
+				int* owner = &owners[events[i].type & 0x0F];
+				if (*owner == -1)
+					*owner = t;
+				else if (*owner != (int)t)
+					*owner = -2;
+			}
+		}
+	}
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		if (MarkRedundantChannelEvents(ctx, t, owners, state, removed, stats)) {
+			free(removed);
+			free(state);
+			ctx->error = "Out of memory";
+			return 1;
+		}
+	}
+
+	/* compact in place; deltas come from absolute ticks */
+	unsigned int write = 0;
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		TrackSpan* span = &ctx->tracks[t];
+		unsigned int first = write;
+		unsigned long previousTick = 0;
+
+		for (unsigned int i=span->firstEvent; i < span->firstEvent + span->numEvents; i++) {
+			if (removed[i])
+				continue;
+
+			unsigned long tick = ctx->ticks[i];
+			ctx->events[write] = ctx->events[i];
+			ctx->events[write].time = tick - previousTick;
+			ctx->ticks[write] = tick;
+			previousTick = tick;
+			write++;
+		}
+
+		span->firstEvent = first;
+		span->numEvents = write - first;
+	}
+	ctx->numEvents = write;
+
+	stats->eventsAfter = ctx->numEvents;
+	stats->bytesAfter = EncodedMidiSize(ctx);
+
+	free(state);
+	free(removed);
+
+	return 0;
+}
+
+
+#define SLOT_CONTROLLER 0
+#define SLOT_PROGRAM (SLOT_CONTROLLER + 16 * 128)
+#define SLOT_BEND (SLOT_PROGRAM + 16)
+#define SLOT_PRESSURE (SLOT_BEND + 16)
+#define SLOT_META (SLOT_PRESSURE + 16)
+#define SLOT_NOTE (SLOT_META + 3)
+#define NUM_SLOTS (SLOT_NOTE + 16 * 128)
+#define UNKNOWN_VALUE (~0ULL)
+
+typedef struct {
+	unsigned long tick;
+	unsigned int track;
+	unsigned long long hash;
+} StateChange;
+
+typedef struct {
+	unsigned long long values[NUM_SLOTS];
+	unsigned long long previous[NUM_SLOTS];
+	unsigned int stamps[NUM_SLOTS];
+	unsigned int touched[NUM_SLOTS];
+	unsigned int numTouched;
+	unsigned int group;
+} StateTracker;
+
+
+static void SetSlot(StateTracker* tracker, unsigned int slot, unsigned long long value)
+{
+	if (tracker->stamps[slot] != tracker->group) {
+		tracker->stamps[slot] = tracker->group;
+		tracker->previous[slot] = tracker->values[slot];
+		tracker->touched[tracker->numTouched++] = slot;
+	}
+
+	tracker->values[slot] = value;
+}
+
+
+/* Returns every channel value slot to unknown, as after a reset sysex. */
+static void ForgetTrackedValues(StateTracker* tracker)
+{
+	for (unsigned int slot=SLOT_CONTROLLER; slot < SLOT_META; slot++)
+		SetSlot(tracker, slot, UNKNOWN_VALUE);
+}
+
+
+static void ResetTracker(StateTracker* tracker)
+{
+	for (unsigned int s=0; s < NUM_SLOTS; s++)
+		tracker->values[s] = s >= SLOT_NOTE ? 0 : UNKNOWN_VALUE;
+}
+
+
+/*
+	Applies one event to the state, or returns a hash for events outside
+	the tracked state, which are compared as they are.
+*/
+static unsigned long long TrackEvent(StateTracker* tracker, const Event* event)
+{
+	int kind = StateMetaKind(event);
+
+	if (kind >= 0) {
+		SetSlot(tracker, SLOT_META + kind, HashBytes(event->data, event->size, kind) >> 1);
+		return 0;
+	}
+	if (event->type >= 0xF0) {
+		if (IsResetSysex(event))
+			ForgetTrackedValues(tracker);
+		return HashBytes(event->data, event->size, (event->type << 8) | event->subtype) | 1;
+	}
+
+	unsigned int channel = event->type & 0x0F;
+	unsigned char data1 = event->data[0];
+	unsigned char data2 = (event->size > 1) ? event->data[1] : 0;
+	unsigned int slot;
+
+	switch (event->type & 0xF0) {
+		case 0x90:
+			if (data2 > 0) {
+				slot = SLOT_NOTE + channel * 128 + data1;
+				SetSlot(tracker, slot, tracker->values[slot] + 1);
+				if (channel != DRUM_CHANNEL)
+					return 0;
+				/* every drum hit counts, even one that stops on the same tick */
+				unsigned char hit[3] = {event->type, data1, data2};
+				return HashBytes(hit, sizeof(hit), 0xD9) | 1;
+			}
+			/* fall through */
+		case 0x80:
+			slot = SLOT_NOTE + channel * 128 + data1;
+			if (tracker->values[slot] > 0)
+				SetSlot(tracker, slot, tracker->values[slot] - 1);
+			return 0;
+		case 0xB0:
+			if (data1 == 121) {
+				for (unsigned int cc=0; cc < 128; cc++) {
+					if (ClearedByReset(cc))
+						SetSlot(tracker, SLOT_CONTROLLER + channel * 128 + cc, UNKNOWN_VALUE);
+				}
+				SetSlot(tracker, SLOT_BEND + channel, UNKNOWN_VALUE);
+				SetSlot(tracker, SLOT_PRESSURE + channel, UNKNOWN_VALUE);
+			}
+			if (IsFixedController(data1))
+				break;
+			SetSlot(tracker, SLOT_CONTROLLER + channel * 128 + data1, data2);
+			return 0;
+		case 0xC0:
+			SetSlot(tracker, SLOT_PROGRAM + channel, data1);
+			return 0;
+		case 0xD0:
+			SetSlot(tracker, SLOT_PRESSURE + channel, data1);
+			return 0;
+		case 0xE0:
+			SetSlot(tracker, SLOT_BEND + channel, data1 | (data2 << 7));
+			return 0;
+		default:
+			break;
+	}
+
+	unsigned char bytes[3] = {event->type, data1, data2};
+	return HashBytes(bytes, sizeof(bytes), 0xC4) | 1;
+}
+
+
+/*
+	Reduces a file to the list of ticks at which its playback state
+	changes, each with a hash of the changes and of any other events.
+*/
+static StateChange* StateTimeline(ParserContext* ctx, StateTracker* tracker, unsigned int* numChanges)
+{
+	unsigned int numRefs;
+	EventRef* refs = PlaybackOrder(ctx, NULL, &numRefs);
+	StateChange* changes = (StateChange *)malloc((numRefs ? numRefs : 1) * sizeof(StateChange));
+	unsigned int count = 0;
+	unsigned int currentTrack = 0;
+
+	if (!refs || !changes) {
+		free(refs);
+		free(changes);
+		return NULL;
+	}
+
+	ResetTracker(tracker);
+
+	for (unsigned int start=0; start < numRefs; ) {
+		unsigned int track = ctx->fileInfo.formatType == 2 ? TrackOfEvent(ctx, refs[start].index) : 0;
+		unsigned long long hash = 0;
+		unsigned int end = start;
+
+		if (track != currentTrack) {
+			ResetTracker(tracker);
+			currentTrack = track;
+		}
+
+		tracker->group++;
+		tracker->numTouched = 0;
+
+		while ((end < numRefs) && (refs[end].tick == refs[start].tick) &&
+			((ctx->fileInfo.formatType != 2) || (TrackOfEvent(ctx, refs[end].index) == track))) {
+			hash += TrackEvent(tracker, &ctx->events[refs[end].index]);
+			end++;
+		}
+
+		for (unsigned int i=0; i < tracker->numTouched; i++) {
+			unsigned int slot = tracker->touched[i];
+			if (tracker->values[slot] != tracker->previous[slot]) {
+				unsigned long long pair[2] = {slot, tracker->values[slot]};
+				hash += HashBytes(pair, sizeof(pair), 0x5A) | 1;
+			}
+		}
+
+		if (hash) {
+			changes[count].tick = refs[start].tick;
+			changes[count].track = track;
+			changes[count].hash = hash;
+			count++;
+		}
+
+		start = end;
+	}
+
+	free(refs);
+	*numChanges = count;
+
+	return changes;
+}
+
+
+/*
+	Returns 0 when both files drive a player through the same states at
+	the same ticks: same tempo, signature, controller, program, bend and
+	pressure values, same sounding notes, the same drum hits, and
+	identical other events.
+*/
+int CompareMidiState(ParserContext* a, ParserContext* b)
+{
+	StateTracker* tracker = (StateTracker *)calloc(1, sizeof(StateTracker));
+	unsigned int numA = 0, numB = 0;
+	StateChange* changesA = tracker ? StateTimeline(a, tracker, &numA) : NULL;
+	StateChange* changesB = tracker ? StateTimeline(b, tracker, &numB) : NULL;
+	int res = 1;
+
+	if (changesA && changesB && (numA == numB)) {
+		res = 0;
+		for (unsigned int i=0; (i < numA) && (res == 0); i++) {
+			if ((changesA[i].tick != changesB[i].tick) || (changesA[i].track != changesB[i].track) ||
+				(changesA[i].hash != changesB[i].hash))
+				res = 1;
+		}
+	}
+
+	free(changesA);
+	free(changesB);
+	free(tracker);
+
+	return res;
+}
@@ -0,0 +1,39 @@
+#ifndef __OPTIMISE_H__
+#define __OPTIMISE_H__
+
+#include "context.h"
+
+/*
+	Removes events that cannot change what a file sounds like, in place:
+	controller, program, pitch bend and channel pressure messages that
+	repeat the channel's current value, notes that start and stop on the
+	same tick outside the drum channel, and tempo, time signature and key signature events that
+	repeat the current value or are overridden on the same tick. Channel
+	state is only tracked for channels that a single track uses, because
+	events from different tracks sharing a tick have no defined order.
+	The first value of every kind is always kept, since the state before
+	it depends on the player, and so is the first value after a Reset all
+	controllers or a GM, GS or XG reset sysex.
+
+	Deltas are recomputed from absolute ticks, so timing is unchanged.
+	Writing the result with WriteMidiFile adds maximal running status.
+*/
+
+typedef struct {
+	unsigned int eventsBefore;
+	unsigned int eventsAfter;
+	unsigned long bytesBefore;
+	unsigned long bytesAfter;
+
+	unsigned int removedControllers;	/* includes pitch bend and channel pressure */
+	unsigned int removedPrograms;
+	unsigned int removedNotes;		/* note on/off pairs */
+	unsigned int removedMetas;
+} OptimiseStats;
+
+
+unsigned long EncodedMidiSize(ParserContext* ctx);
+int OptimiseMidi(ParserContext* ctx, OptimiseStats* stats);
+int CompareMidiState(ParserContext* a, ParserContext* b);
+
+#endif
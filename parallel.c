@@ -0,0 +1,83 @@
+#include "parallel.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+
+typedef struct {
+	ParallelTask task;
+	void* arg;
+	unsigned int count;
+	atomic_uint next;
+} ParallelJob;
+
+typedef struct {
+	ParallelJob* job;
+	unsigned int worker;
+} ParallelWorker;
+
+
+unsigned int DefaultThreadCount(void)
+{
+	long numCpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return numCpus > 0 ? (unsigned int)numCpus : 1;
+}
+
+
+static void* RunWorker(void* arg)
+{
+	ParallelWorker* worker = (ParallelWorker *)arg;
+	ParallelJob* job = worker->job;
+	unsigned int index;
+
+	while ((index = atomic_fetch_add(&job->next, 1)) < job->count) {
+		job->task(job->arg, index, worker->worker);
+	}
+
+	return NULL;
+}
+
+
+int ParallelFor(unsigned int count, unsigned int numThreads, ParallelTask task, void* arg)
+{
+	ParallelJob job;
+	job.task = task;
+	job.arg = arg;
+	job.count = count;
+	atomic_init(&job.next, 0);
+
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+	if (numThreads > count)
+		numThreads = count ? count : 1;
+
+	pthread_t* threads = (pthread_t *)malloc(numThreads * sizeof(pthread_t));
+	ParallelWorker* workers = (ParallelWorker *)malloc(numThreads * sizeof(ParallelWorker));
+	unsigned int numStarted = 1;
+
+	for (unsigned int i=0; i < numThreads; i++) {
+		workers[i].job = &job;
+		workers[i].worker = i;
+	}
+
+	/* the calling thread is worker 0 */
+	for (unsigned int i=1; i < numThreads; i++) {
+		if (pthread_create(&threads[i], NULL, RunWorker, &workers[i]) != 0)
+			break;
+		numStarted++;
+	}
+
+	RunWorker(&workers[0]);
+
+	for (unsigned int i=1; i < numStarted; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(workers);
+
+	return 0;
+}
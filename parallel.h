@@ -0,0 +1,16 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+/*
+	Minimal fork-join helper. ParallelFor runs task(arg, index, worker) for
+	every index in [0, count) on up to numThreads threads, handing out
+	indices dynamically. worker is in [0, numThreads) and lets tasks keep
+	per-thread scratch state such as a ParserContext.
+*/
+
+typedef void (*ParallelTask)(void* arg, unsigned int index, unsigned int worker);
+
+unsigned int DefaultThreadCount(void);
+int ParallelFor(unsigned int count, unsigned int numThreads, ParallelTask task, void* arg);
+
+#endif
@@ -0,0 +1,324 @@
+/*
+	pianoroll.c :	Piano-roll and onset tensors for ML pipelines. Notes
+			are gathered once, then time blocks are filled in
+			parallel since each block owns a disjoint set of rows.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "pianoroll.h"
+#include "tempomap.h"
+#include "parallel.h"
+
+
+#define STEPS_PER_BLOCK 1024
+
+
+void InitPianoRoll(PianoRoll* roll)
+{
+	memset(roll, 0, sizeof(PianoRoll));
+}
+
+
+void FreePianoRoll(PianoRoll* roll)
+{
+	free(roll->notes);
+	free(roll->blockFirst);
+	free(roll->blockNotes);
+	InitPianoRoll(roll);
+}
+
+
+static unsigned long TickToStep(const PianoRollConfig* config, const TempoMap* map, unsigned long tick)
+{
+	if (config->ticksPerStep)
+		return tick / config->ticksPerStep;
+
+	return (unsigned long)(TicksToSeconds(map, tick) / config->secondsPerStep);
+}
+
+
+static int AddNote(PianoRoll* roll, unsigned long startStep, unsigned long endStep, unsigned char key, unsigned char velocity, unsigned short plane)
+{
+	if (roll->numNotes == roll->capacity) {
+		unsigned int capacity = roll->capacity ? roll->capacity * 2 : 1024;
+		NoteSpan* grown = (NoteSpan *)realloc(roll->notes, capacity * sizeof(NoteSpan));
+		if (!grown)
+			return 1;
+		roll->notes = grown;
+		roll->capacity = capacity;
+	}
+
+	/* every note covers at least the step it starts on */
+	if (endStep <= startStep)
+		endStep = startStep + 1;
+
+	NoteSpan* note = &roll->notes[roll->numNotes++];
+	note->startStep = startStep;
+	note->endStep = endStep;
+	note->key = key;
+	note->velocity = velocity;
+	note->plane = plane;
+
+	if (endStep > roll->numSteps)
+		roll->numSteps = endStep;
+
+	return 0;
+}
+
+
+static int CompareNoteStarts(const void* a, const void* b)
+{
+	const NoteSpan* na = (const NoteSpan *)a;
+	const NoteSpan* nb = (const NoteSpan *)b;
+
+	return (na->startStep > nb->startStep) - (na->startStep < nb->startStep);
+}
+
+
+/*
+	Lists the notes overlapping each block, so a block only visits the
+	notes it draws and the whole render costs the notes plus the cells
+	they cover.
+*/
+static int IndexBlocks(PianoRoll* roll)
+{
+	unsigned long numBlocks = (roll->numSteps + STEPS_PER_BLOCK - 1) / STEPS_PER_BLOCK;
+	unsigned long* first = (unsigned long *)calloc(numBlocks + 1, sizeof(unsigned long));
+	if (!first)
+		return 1;
+
+	for (unsigned int n=0; n < roll->numNotes; n++) {
+		const NoteSpan* note = &roll->notes[n];
+		for (unsigned long b=note->startStep / STEPS_PER_BLOCK; b <= (note->endStep - 1) / STEPS_PER_BLOCK; b++)
+			first[b + 1]++;
+	}
+
+	for (unsigned long b=0; b < numBlocks; b++)
+		first[b + 1] += first[b];
+
+	unsigned int* notes = NULL;
+	if (first[numBlocks] < ULONG_MAX / sizeof(unsigned int))
+		notes = (unsigned int *)malloc((first[numBlocks] ? first[numBlocks] : 1) * sizeof(unsigned int));
+	if (!notes) {
+		free(first);
+		return 1;
+	}
+
+	/* fill in note order, then shift the offsets back into place */
+	for (unsigned int n=0; n < roll->numNotes; n++) {
+		const NoteSpan* note = &roll->notes[n];
+		for (unsigned long b=note->startStep / STEPS_PER_BLOCK; b <= (note->endStep - 1) / STEPS_PER_BLOCK; b++)
+			notes[first[b]++] = n;
+	}
+
+	for (unsigned long b=numBlocks; b > 0; b--)
+		first[b] = first[b - 1];
+	first[0] = 0;
+
+	free(roll->blockFirst);
+	free(roll->blockNotes);
+	roll->blockFirst = first;
+	roll->blockNotes = notes;
+	roll->numBlocks = numBlocks;
+
+	return 0;
+}
+
+
+/*
+	Pairs note on and note off events into spans and sizes the output.
+	A note on for a key that is already sounding ends the earlier note.
+	Returns 1 if memory runs out or the shape is too large to address.
+*/
+int PreparePianoRoll(ParserContext* ctx, const PianoRollConfig* config, PianoRoll* roll)
+{
+	TempoMap map;
+	long pending[16][128];
+	unsigned char pendingVelocity[16][128];
+
+	if (!config->ticksPerStep && !(config->secondsPerStep > 0.0))
+		return 1;
+
+	InitTempoMap(&map);
+	if (!config->ticksPerStep && BuildTempoMap(ctx, &map))
+		return 1;
+
+	roll->numNotes = 0;
+	roll->numSteps = 0;
+	roll->numPlanes = config->planes == channelPlanes ? 16 : config->planes == trackPlanes ? ctx->numTracks : 1;
+	roll->bytesPerRow = config->format == packedBits ? 16 : 128;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		Event* events = ContextTrackEvents(ctx, t);
+		unsigned long* ticks = ContextTrackTicks(ctx, t);
+
+		memset(pending, 0xFF, sizeof(pending));
+
+		for (unsigned int i=0; i < ctx->tracks[t].numEvents; i++) {
+			unsigned char status = events[i].type & 0xF0;
+			unsigned char channel = events[i].type & 0x0F;
+
+			if ((status != 0x80) && (status != 0x90))
+				continue;
+
+			unsigned char key = events[i].data[0];
+			unsigned char velocity = events[i].data[1];
+			unsigned short plane = config->planes == channelPlanes ? channel : config->planes == trackPlanes ? t : 0;
+
+			if (pending[channel][key] >= 0) {
+				unsigned long startStep = TickToStep(config, &map, pending[channel][key]);
+				unsigned long endStep = TickToStep(config, &map, ticks[i]);
+				if (AddNote(roll, startStep, endStep, key, pendingVelocity[channel][key], plane)) {
+					FreeTempoMap(&map);
+					return 1;
+				}
+				pending[channel][key] = -1;
+			}
+
+			if ((status == 0x90) && (velocity > 0)) {
+				pending[channel][key] = ticks[i];
+				pendingVelocity[channel][key] = velocity;
+			}
+		}
+
+		/* notes left sounding end with the track */
+		unsigned long lastTick = ctx->tracks[t].numEvents ? ticks[ctx->tracks[t].numEvents - 1] : 0;
+		for (unsigned int c=0; c < 16; c++) {
+			for (unsigned int k=0; k < 128; k++) {
+				if (pending[c][k] < 0)
+					continue;
+				unsigned short plane = config->planes == channelPlanes ? c : config->planes == trackPlanes ? t : 0;
+				if (AddNote(roll, TickToStep(config, &map, pending[c][k]), TickToStep(config, &map, lastTick), k, pendingVelocity[c][k], plane)) {
+					FreeTempoMap(&map);
+					return 1;
+				}
+			}
+		}
+	}
+
+	FreeTempoMap(&map);
+
+	/* the tensor size must fit an unsigned long and the blocks an unsigned int */
+	if (roll->numPlanes && (roll->numSteps > ULONG_MAX / roll->numPlanes / roll->bytesPerRow))
+		return 1;
+	if (roll->numSteps / STEPS_PER_BLOCK >= UINT_MAX)
+		return 1;
+
+	qsort(roll->notes, roll->numNotes, sizeof(NoteSpan), CompareNoteStarts);
+
+	return IndexBlocks(roll);
+}
+
+
+unsigned long PianoRollSize(const PianoRoll* roll)
+{
+	return (unsigned long)roll->numPlanes * roll->numSteps * roll->bytesPerRow;
+}
+
+
+typedef struct {
+	const PianoRoll* roll;
+	int packed;
+	unsigned char* output;
+	unsigned char* onsets;
+} RenderJob;
+
+
+static void SetCell(unsigned char* row, int packed, unsigned char key, unsigned char velocity)
+{
+	if (packed)
+		row[key >> 3] |= 1 << (key & 7);
+	else if (row[key] < velocity)
+		row[key] = velocity;
+}
+
+
+static void RenderBlock(void* arg, unsigned int block, unsigned int worker)
+{
+	RenderJob* job = (RenderJob *)arg;
+	const PianoRoll* roll = job->roll;
+	unsigned long blockStart = (unsigned long)block * STEPS_PER_BLOCK;
+	unsigned long blockEnd = blockStart + STEPS_PER_BLOCK;
+	unsigned int rowSize = roll->bytesPerRow;
+
+	if (blockEnd > roll->numSteps)
+		blockEnd = roll->numSteps;
+
+	for (unsigned int p=0; p < roll->numPlanes; p++) {
+		unsigned long offset = ((unsigned long)p * roll->numSteps + blockStart) * rowSize;
+		memset(job->output + offset, 0, (blockEnd - blockStart) * rowSize);
+		if (job->onsets)
+			memset(job->onsets + offset, 0, (blockEnd - blockStart) * rowSize);
+	}
+
+	for (unsigned long i=roll->blockFirst[block]; i < roll->blockFirst[block + 1]; i++) {
+		const NoteSpan* note = &roll->notes[roll->blockNotes[i]];
+		unsigned long first = note->startStep > blockStart ? note->startStep : blockStart;
+		unsigned long last = note->endStep < blockEnd ? note->endStep : blockEnd;
+		unsigned char* plane = job->output + (unsigned long)note->plane * roll->numSteps * rowSize;
+
+		for (unsigned long s=first; s < last; s++) {
+			SetCell(plane + s * rowSize, job->packed, note->key, note->velocity);
+		}
+
+		if (job->onsets && (note->startStep >= blockStart)) {
+			unsigned char* onsetPlane = job->onsets + (unsigned long)note->plane * roll->numSteps * rowSize;
+			SetCell(onsetPlane + note->startStep * rowSize, job->packed, note->key, note->velocity);
+		}
+	}
+}
+
+
+/*
+	output (and onsets, if not NULL) must hold PianoRollSize(roll) bytes.
+*/
+void RenderPianoRoll(const PianoRoll* roll, const PianoRollConfig* config, unsigned char* output, unsigned char* onsets)
+{
+	RenderJob job;
+	job.roll = roll;
+	job.packed = config->format == packedBits;
+	job.output = output;
+	job.onsets = onsets;
+
+	ParallelFor(roll->numBlocks, config->numThreads, RenderBlock, &job);
+}
+
+
+int WriteNpyFile(const char* filename, const unsigned char* data, unsigned int numPlanes, unsigned long numSteps, unsigned int rowSize)
+{
+	char header[128];
+	int length = snprintf(header + 10, sizeof(header) - 10,
+		"{'descr': '|u1', 'fortran_order': False, 'shape': (%u, %lu, %u), }",
+		numPlanes, numSteps, rowSize);
+
+	/* pad with spaces so the data starts on a 64-byte boundary */
+	int total = 10 + length + 1;
+	int padded = (total + 63) / 64 * 64;
+	if (padded > (int)sizeof(header))
+		return 1;
+
+	memset(header + 10 + length, ' ', padded - total);
+	header[padded - 1] = '\n';
+	memcpy(header, "\x93NUMPY\x01\x00", 8);
+	header[8] = (padded - 10) & 0xFF;
+	header[9] = ((padded - 10) >> 8) & 0xFF;
+
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return 1;
+
+	unsigned long size = (unsigned long)numPlanes * numSteps * rowSize;
+	int res = 0;
+	if (fwrite(header, padded, 1, f) != 1)
+		res = 1;
+	if (size && (fwrite(data, size, 1, f) != 1))
+		res = 1;
+	if (fclose(f) != 0)
+		res = 1;
+
+	return res;
+}
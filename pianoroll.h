@@ -0,0 +1,64 @@
+#ifndef __PIANOROLL_H__
+#define __PIANOROLL_H__
+
+#include "context.h"
+
+/*
+	Renders decoded notes into piano-roll tensors of shape
+	(planes, steps, 128) for dense output or (planes, steps, 16) for
+	bit-packed output, where bit i of byte k is pitch 8k+i. Dense cells
+	hold the note velocity. The optional onset tensor has the same shape
+	and marks only the step each note starts on.
+*/
+
+enum PianoRollPlanes {
+	singlePlane = 0,
+	channelPlanes = 1,
+	trackPlanes = 2,
+};
+
+enum PianoRollFormat {
+	denseVelocity = 0,
+	packedBits = 1,
+};
+
+typedef struct {
+	unsigned long ticksPerStep;	/* step size in ticks, or 0 to use secondsPerStep */
+	double secondsPerStep;
+	enum PianoRollPlanes planes;
+	enum PianoRollFormat format;
+	unsigned int numThreads;	/* 0 for one per CPU */
+} PianoRollConfig;
+
+typedef struct {
+	unsigned long startStep;
+	unsigned long endStep;		/* exclusive */
+	unsigned char key;
+	unsigned char velocity;
+	unsigned short plane;
+} NoteSpan;
+
+typedef struct {
+	NoteSpan* notes;
+	unsigned int numNotes;
+	unsigned int capacity;
+
+	unsigned int numPlanes;
+	unsigned long numSteps;
+	unsigned int bytesPerRow;
+
+	/* notes overlapping block b are blockNotes[blockFirst[b] .. blockFirst[b + 1]) */
+	unsigned long* blockFirst;
+	unsigned int* blockNotes;
+	unsigned long numBlocks;
+} PianoRoll;
+
+
+void InitPianoRoll(PianoRoll* roll);
+void FreePianoRoll(PianoRoll* roll);
+int PreparePianoRoll(ParserContext* ctx, const PianoRollConfig* config, PianoRoll* roll);
+unsigned long PianoRollSize(const PianoRoll* roll);
+void RenderPianoRoll(const PianoRoll* roll, const PianoRollConfig* config, unsigned char* output, unsigned char* onsets);
+int WriteNpyFile(const char* filename, const unsigned char* data, unsigned int numPlanes, unsigned long numSteps, unsigned int rowSize);
+
+#endif
@@ -0,0 +1,225 @@
+/*
+	rawmidi.c :	Byte-at-a-time parser for live MIDI streams
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "rawmidi.h"
+
+
+unsigned long long MonotonicNanos(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+void InitRawMidiParser(RawMidiParser* parser, unsigned char* sysexBuffer, unsigned long sysexCapacity, RawMidiCallback callback, void* user)
+{
+	memset(parser, 0, sizeof(RawMidiParser));
+	parser->callback = callback;
+	parser->user = user;
+	parser->sysexBuffer = sysexBuffer;
+	parser->sysexCapacity = sysexBuffer ? sysexCapacity : 0;
+	parser->minLatency = ~0ULL;
+}
+
+
+static void Emit(RawMidiParser* parser, RawMidiMessage* message, unsigned long long arrival)
+{
+	parser->callback(parser->user, message);
+
+	/* latency runs from the arrival of the completing byte to the callback returning */
+	unsigned long long latency = MonotonicNanos() - arrival;
+	parser->numMessages++;
+	parser->totalLatency += latency;
+	if (latency < parser->minLatency)
+		parser->minLatency = latency;
+	if (latency > parser->maxLatency)
+		parser->maxLatency = latency;
+}
+
+
+static void EmitShort(RawMidiParser* parser, unsigned char status, unsigned long long start, unsigned long long arrival)
+{
+	RawMidiMessage message;
+	message.timestamp = start;
+	message.status = status;
+	message.data[0] = parser->data[0];
+	message.data[1] = parser->data[1];
+	message.size = parser->numData;
+	message.sysex = NULL;
+	message.truncated = 0;
+
+	Emit(parser, &message, arrival);
+}
+
+
+static void EndSysex(RawMidiParser* parser, int truncated, unsigned long long arrival)
+{
+	RawMidiMessage message;
+	message.timestamp = parser->messageStart;
+	message.status = 0xF0;
+	message.data[0] = 0;
+	message.data[1] = 0;
+	message.size = parser->sysexLength;
+	message.sysex = parser->sysexBuffer;
+	message.truncated = truncated || parser->sysexOverflow;
+
+	parser->inSysex = 0;
+	parser->started = 0;
+	Emit(parser, &message, arrival);
+}
+
+
+static unsigned int DataBytesForStatus(unsigned char status)
+{
+	switch (status & 0xF0) {
+		case 0xC0:
+		case 0xD0:
+			return 1;
+		case 0xF0:
+			break;
+		default:
+			return 2;
+	}
+
+	switch (status) {
+		case 0xF1: // MTC quarter frame
+		case 0xF3: // Song select
+			return 1;
+		case 0xF2: // Song position pointer
+			return 2;
+		default:
+			return 0;
+	}
+}
+
+
+void RawMidiPushByte(RawMidiParser* parser, unsigned char byte, unsigned long long timestamp)
+{
+	parser->numBytes++;
+
+	if (byte >= 0xF8) {
+		/* real-time messages may appear anywhere and leave all state alone */
+		RawMidiMessage message;
+		memset(&message, 0, sizeof(message));
+		message.timestamp = timestamp;
+		message.status = byte;
+		Emit(parser, &message, timestamp);
+		return;
+	}
+
+	if (byte & 0x80) {
+		if (parser->inSysex) {
+			EndSysex(parser, byte != 0xF7, timestamp);
+			if (byte == 0xF7)
+				return;
+		}
+		else if (byte == 0xF7) {
+			parser->numDropped++;	/* stray end of exclusive */
+			return;
+		}
+
+		parser->numData = 0;
+		parser->messageStart = timestamp;
+		parser->started = 1;
+
+		if (byte < 0xF0) {
+			parser->runningStatus = byte;
+			parser->status = byte;
+			parser->expected = DataBytesForStatus(byte);
+			return;
+		}
+
+		/* system exclusive and system common messages cancel running status */
+		parser->runningStatus = '\0';
+		parser->status = '\0';
+
+		if (byte == 0xF0) {
+			parser->inSysex = 1;
+			parser->sysexLength = 0;
+			parser->sysexOverflow = 0;
+			return;
+		}
+
+		parser->expected = DataBytesForStatus(byte);
+		if (parser->expected == 0) {
+			EmitShort(parser, byte, timestamp, timestamp);
+			parser->started = 0;
+		}
+		else {
+			parser->status = byte;
+		}
+		return;
+	}
+
+	if (parser->inSysex) {
+		if (parser->sysexLength < parser->sysexCapacity)
+			parser->sysexBuffer[parser->sysexLength++] = byte;
+		else
+			parser->sysexOverflow = 1;
+		return;
+	}
+
+	if (!parser->status) {
+		if (!parser->runningStatus) {
+			parser->numDropped++;
+			return;
+		}
+		parser->status = parser->runningStatus;
+	}
+
+	if (!parser->started) {
+		parser->messageStart = timestamp;
+		parser->started = 1;
+	}
+
+	parser->data[parser->numData++] = byte;
+
+	if (parser->numData == parser->expected) {
+		unsigned char status = parser->status;
+
+		if (parser->expected == 1)
+			parser->data[1] = 0;
+
+		EmitShort(parser, status, parser->messageStart, timestamp);
+		parser->numData = 0;
+		parser->started = 0;
+		parser->status = (status < 0xF0) ? status : '\0';
+	}
+}
+
+
+void RawMidiPushBlock(RawMidiParser* parser, const unsigned char* bytes, unsigned long count, unsigned long long timestamp)
+{
+	for (unsigned long i=0; i < count; i++) {
+		RawMidiPushByte(parser, bytes[i], timestamp);
+	}
+}
+
+
+void PrintRawMidiMessage(const RawMidiMessage* message)
+{
+	printf("%llu ns: ", message->timestamp);
+
+	if (message->status == 0xF0) {
+		printf("SysEx (%u bytes%s): 0x", message->size, message->truncated ? ", truncated" : "");
+		for (unsigned int i=0; i < message->size; i++)
+			printf("%02x", message->sysex[i]);
+		printf("\n");
+	}
+	else if (message->size == 2) {
+		printf("%02x %02x %02x\n", message->status, message->data[0], message->data[1]);
+	}
+	else if (message->size == 1) {
+		printf("%02x %02x\n", message->status, message->data[0]);
+	}
+	else {
+		printf("%02x\n", message->status);
+	}
+}
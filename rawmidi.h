@@ -0,0 +1,58 @@
+#ifndef __RAWMIDI_H__
+#define __RAWMIDI_H__
+
+/*
+	Push parser for the live MIDI wire protocol, as read from ports or raw
+	captures. Unlike SMF there are no delta times: bytes are stamped when
+	they arrive and each message is passed to the callback as soon as its
+	last byte is pushed. Real-time bytes (0xF8-0xFF) are passed on at once,
+	even between the data bytes of another message, without disturbing it.
+	System exclusive runs from 0xF0 to 0xF7. Any other status byte also
+	ends it, and the message is then flagged as truncated.
+*/
+
+typedef struct {
+	unsigned long long timestamp;	/* arrival of the first byte, in ns */
+	unsigned char status;
+	unsigned char data[2];
+	unsigned int size;		/* data bytes, or sysex payload length */
+	const unsigned char* sysex;	/* payload after 0xF0, valid during the callback */
+	int truncated;
+} RawMidiMessage;
+
+typedef void (*RawMidiCallback)(void* user, const RawMidiMessage* message);
+
+typedef struct {
+	RawMidiCallback callback;
+	void* user;
+
+	unsigned char runningStatus;
+	unsigned char status;
+	unsigned char data[2];
+	unsigned int numData;
+	unsigned int expected;
+	unsigned long long messageStart;
+	int started;
+
+	int inSysex;
+	unsigned char* sysexBuffer;
+	unsigned long sysexCapacity;
+	unsigned long sysexLength;
+	int sysexOverflow;
+
+	unsigned long long numBytes;
+	unsigned long long numMessages;
+	unsigned long long numDropped;
+	unsigned long long minLatency;
+	unsigned long long maxLatency;
+	unsigned long long totalLatency;
+} RawMidiParser;
+
+
+unsigned long long MonotonicNanos(void);
+void InitRawMidiParser(RawMidiParser* parser, unsigned char* sysexBuffer, unsigned long sysexCapacity, RawMidiCallback callback, void* user);
+void RawMidiPushByte(RawMidiParser* parser, unsigned char byte, unsigned long long timestamp);
+void RawMidiPushBlock(RawMidiParser* parser, const unsigned char* bytes, unsigned long count, unsigned long long timestamp);
+void PrintRawMidiMessage(const RawMidiMessage* message);
+
+#endif
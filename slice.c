@@ -0,0 +1,541 @@
+/*
+	slice.c :	Time-range slicing into a new Standard MIDI File, with
+			the state in effect at the window start carried forward
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "slice.h"
+#include "events.h"
+#include "visitor.h"
+#include "tempomap.h"
+#include "writemidi.h"
+
+#define NOT_SET 0xFF
+#define SCRATCH_PER_CHANNEL (4 + 128 * 2 + 128 * 2 + 128 * 2)
+
+
+enum CarriedMeta {
+	carriedName = 0,
+	carriedInstrument = 1,
+	carriedTimeSignature = 2,
+	carriedKeySignature = 3,
+	carriedTempo = 4,
+	numCarriedMetas = 5,
+};
+
+typedef struct {
+	short program;			/* -1 until set */
+	short pressure;
+	int bend;
+	unsigned char controllers[128];	/* NOT_SET until set */
+	unsigned char velocity[128];	/* of each sounding key, 0 if silent */
+	unsigned char lastParameter;	/* 98 for NRPN, 100 for RPN, 0 for neither */
+} ChannelState;
+
+typedef struct {
+	FILE* f;
+	FileInfo fileInfo;
+	int hasHeader;
+	unsigned long fromTick;
+	unsigned long toTick;
+	SliceStats* stats;
+	int error;
+
+	/* the track being sliced */
+	int inTrack;
+	int started;			/* carried state has been written */
+	int reachedEnd;			/* the track runs past the window */
+	unsigned long endTick;		/* of its End of track, in output ticks */
+	ChannelState channels[16];
+	Event metas[numCarriedMetas];
+	unsigned int hasMeta;		/* bit per CarriedMeta */
+
+	Event* events;
+	unsigned int numEvents;
+	unsigned int capacity;
+	unsigned long lastTick;		/* output tick of the last event */
+
+	/* data bytes of generated events */
+	unsigned char scratch[16 * SCRATCH_PER_CHANNEL];
+	unsigned int scratchUsed;
+} Slicer;
+
+
+static void ResetTrack(Slicer* slicer)
+{
+	memset(slicer->channels, 0, sizeof(slicer->channels));
+	for (int c=0; c < 16; c++) {
+		slicer->channels[c].program = -1;
+		slicer->channels[c].pressure = -1;
+		slicer->channels[c].bend = -1;
+		memset(slicer->channels[c].controllers, NOT_SET, 128);
+	}
+
+	slicer->hasMeta = 0;
+	slicer->started = 0;
+	slicer->reachedEnd = 0;
+	slicer->endTick = 0;
+	slicer->numEvents = 0;
+	slicer->lastTick = 0;
+	slicer->scratchUsed = 0;
+}
+
+
+static void AppendEvent(Slicer* slicer, unsigned long tick, const Event* event)
+{
+	if (slicer->numEvents == slicer->capacity) {
+		unsigned int capacity = slicer->capacity ? slicer->capacity * 2 : 1024;
+		Event* grown = (Event *)realloc(slicer->events, capacity * sizeof(Event));
+		if (!grown) {
+			slicer->error = 1;
+			return;
+		}
+		slicer->events = grown;
+		slicer->capacity = capacity;
+	}
+
+	Event* copy = &slicer->events[slicer->numEvents++];
+	*copy = *event;
+	copy->time = tick - slicer->lastTick;
+	slicer->lastTick = tick;
+}
+
+
+static void AppendMessage(Slicer* slicer, unsigned long tick, unsigned char status, unsigned char data1, unsigned char data2)
+{
+	Event event;
+
+	event.type = status;
+	event.subtype = '\0';
+	event.size = SizeForMidiEvent(event);
+	event.data = slicer->scratch + slicer->scratchUsed;
+	event.data[0] = data1;
+	if (event.size > 1)
+		event.data[1] = data2;
+	slicer->scratchUsed += event.size;
+
+	AppendEvent(slicer, tick, &event);
+}
+
+
+/* Keeps what an event before the window leaves behind. */
+static void FoldEvent(Slicer* slicer, const Event* event)
+{
+	if (event->type == 0xFF) {
+		int meta;
+		switch (event->subtype) {
+			case 0x03: meta = carriedName; break;
+			case 0x04: meta = carriedInstrument; break;
+			case 0x51: meta = carriedTempo; break;
+			case 0x58: meta = carriedTimeSignature; break;
+			case 0x59: meta = carriedKeySignature; break;
+			default: return;
+		}
+		slicer->metas[meta] = *event;
+		slicer->hasMeta |= 1 << meta;
+		return;
+	}
+
+	if (event->type >= 0xF0)
+		return;
+
+	ChannelState* channel = &slicer->channels[event->type & 0x0F];
+	unsigned char data1 = event->data[0];
+	unsigned char data2 = (event->size > 1) ? event->data[1] : 0;
+
+	switch (event->type & 0xF0) {
+		case 0x80:
+			channel->velocity[data1] = 0;
+			break;
+		case 0x90:
+			channel->velocity[data1] = data2;
+			break;
+		case 0xB0:
+			if (data1 == 121) {		/* Reset all controllers */
+				for (int cc=0; cc < 120; cc++) {
+					if ((cc != 0) && (cc != 32) && (cc != 7) && (cc != 10))
+						channel->controllers[cc] = NOT_SET;
+				}
+				channel->bend = -1;
+				channel->pressure = -1;
+			}
+			else if ((data1 == 120) || (data1 >= 123)) {
+				memset(channel->velocity, 0, 128);
+			}
+			else if (data1 < 120) {
+				channel->controllers[data1] = data2;
+				if ((data1 == 98) || (data1 == 99))
+					channel->lastParameter = 98;
+				else if ((data1 == 100) || (data1 == 101))
+					channel->lastParameter = 100;
+			}
+			break;
+		case 0xC0:
+			channel->program = data1;
+			break;
+		case 0xD0:
+			channel->pressure = data1;
+			break;
+		case 0xE0:
+			channel->bend = data1 | (data2 << 7);
+			break;
+	}
+}
+
+
+static void AppendController(Slicer* slicer, unsigned char channel, unsigned char cc)
+{
+	unsigned char value = slicer->channels[channel].controllers[cc];
+
+	if (value != NOT_SET) {
+		AppendMessage(slicer, 0, 0xB0 | channel, cc, value);
+		slicer->stats->numCarried++;
+	}
+}
+
+
+/*
+	Writes the folded state at the window start. Bank select goes before
+	the program, and the parameter number before its data entry.
+*/
+static void WriteCarriedState(Slicer* slicer)
+{
+	for (int meta=0; meta < numCarriedMetas; meta++) {
+		if (slicer->hasMeta & (1 << meta)) {
+			AppendEvent(slicer, 0, &slicer->metas[meta]);
+			slicer->stats->numCarried++;
+		}
+	}
+
+	for (unsigned char c=0; c < 16; c++) {
+		ChannelState* channel = &slicer->channels[c];
+
+		AppendController(slicer, c, 0);
+		AppendController(slicer, c, 32);
+		if (channel->program >= 0) {
+			AppendMessage(slicer, 0, 0xC0 | c, channel->program, 0);
+			slicer->stats->numCarried++;
+		}
+
+		for (unsigned char cc=1; cc < 120; cc++) {
+			if ((cc != 32) && (cc != 6) && (cc != 38) && ((cc < 96) || (cc > 101)))
+				AppendController(slicer, c, cc);
+		}
+
+		if (channel->lastParameter) {
+			AppendController(slicer, c, channel->lastParameter + 1);
+			AppendController(slicer, c, channel->lastParameter);
+			AppendController(slicer, c, 6);
+			AppendController(slicer, c, 38);
+		}
+
+		if (channel->bend >= 0) {
+			AppendMessage(slicer, 0, 0xE0 | c, channel->bend & 0x7F, channel->bend >> 7);
+			slicer->stats->numCarried++;
+		}
+		if (channel->pressure >= 0) {
+			AppendMessage(slicer, 0, 0xD0 | c, channel->pressure, 0);
+			slicer->stats->numCarried++;
+		}
+
+		for (unsigned int key=0; key < 128; key++) {
+			if (channel->velocity[key]) {
+				AppendMessage(slicer, 0, 0x90 | c, key, channel->velocity[key]);
+				slicer->stats->numCarried++;
+			}
+		}
+	}
+
+	slicer->started = 1;
+}
+
+
+static void FinishTrack(Slicer* slicer)
+{
+	if (!slicer->started)
+		WriteCarriedState(slicer);
+
+	unsigned long endTick = slicer->reachedEnd ? slicer->toTick - slicer->fromTick : slicer->endTick;
+	if (endTick < slicer->lastTick)
+		endTick = slicer->lastTick;
+
+	for (unsigned char c=0; c < 16; c++) {
+		for (unsigned int key=0; key < 128; key++) {
+			if (slicer->channels[c].velocity[key]) {
+				AppendMessage(slicer, endTick, 0x80 | c, key, 0);
+				slicer->stats->numClosed++;
+			}
+		}
+	}
+
+	Event endOfTrack;
+	memset(&endOfTrack, 0, sizeof(Event));
+	endOfTrack.type = 0xFF;
+	endOfTrack.subtype = 0x2F;
+	AppendEvent(slicer, endTick, &endOfTrack);
+
+	if (!slicer->error && (WriteTrackChunk(slicer->f, slicer->events, slicer->numEvents) != 0))
+		slicer->error = 1;
+
+	slicer->stats->numTracks++;
+	slicer->inTrack = 0;
+}
+
+
+static int SliceHeaderVisit(void* user, const FileInfo* fileInfo)
+{
+	Slicer* slicer = (Slicer *)user;
+
+	if (slicer->hasHeader)
+		return visitContinue;
+
+	/* the track count is written again once the tracks are done */
+	slicer->fileInfo = *fileInfo;
+	slicer->hasHeader = 1;
+	if (WriteHeaderChunk(slicer->f, &slicer->fileInfo, fileInfo->numTracks) != 0)
+		slicer->error = 1;
+
+	return slicer->error ? visitStop : visitContinue;
+}
+
+
+static int SliceTrackStartVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	Slicer* slicer = (Slicer *)user;
+
+	/* a skipped track gets no End of track callback */
+	if (slicer->inTrack)
+		FinishTrack(slicer);
+
+	ResetTrack(slicer);
+	slicer->inTrack = 1;
+
+	return slicer->error ? visitStop : visitContinue;
+}
+
+
+static int SliceEventVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	Slicer* slicer = (Slicer *)user;
+
+	if (tick >= slicer->toTick) {
+		slicer->reachedEnd = 1;
+		return visitSkipTrack;
+	}
+
+	if (tick < slicer->fromTick) {
+		FoldEvent(slicer, event);
+		slicer->stats->numSkipped++;
+		return visitContinue;
+	}
+
+	if (!slicer->started)
+		WriteCarriedState(slicer);
+
+	AppendEvent(slicer, tick - slicer->fromTick, event);
+	slicer->stats->numCopied++;
+
+	/* keep following the sounding notes so they can be closed */
+	if (event->type < 0xF0)
+		FoldEvent(slicer, event);
+
+	return slicer->error ? visitStop : visitContinue;
+}
+
+
+static int SliceEndOfTrackVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	Slicer* slicer = (Slicer *)user;
+
+	if (tick >= slicer->toTick)
+		slicer->reachedEnd = 1;
+	else if (tick > slicer->fromTick)
+		slicer->endTick = tick - slicer->fromTick;
+
+	return visitContinue;
+}
+
+
+static const MidiVisitor SliceVisitor = {
+	SliceHeaderVisit,
+	SliceTrackStartVisit,
+	SliceEventVisit,
+	SliceEventVisit,
+	SliceEventVisit,
+	SliceEndOfTrackVisit,
+};
+
+
+/*
+	Writes events in [fromTick, toTick) to filename. Returns 0 on success
+	and 1 if the input is malformed or the output could not be written.
+*/
+int SliceMidiBuffer(const unsigned char* data, unsigned long size, unsigned long fromTick, unsigned long toTick, const char* filename, SliceStats* stats)
+{
+	memset(stats, 0, sizeof(SliceStats));
+	stats->fromTick = fromTick;
+	stats->toTick = toTick;
+
+	if (fromTick >= toTick)
+		return 1;
+
+	Slicer* slicer = (Slicer *)calloc(1, sizeof(Slicer));
+	if (!slicer)
+		return 1;
+
+	slicer->fromTick = fromTick;
+	slicer->toTick = toTick;
+	slicer->stats = stats;
+	slicer->f = fopen(filename, "wb");
+
+	int res = 1;
+	if (slicer->f) {
+		res = VisitMidiBuffer(data, size, &SliceVisitor, slicer);
+		if (slicer->inTrack)
+			FinishTrack(slicer);
+
+		/* the header gets the number of tracks actually written */
+		if ((res == 0) && !slicer->error && (fseek(slicer->f, 0, SEEK_SET) == 0))
+			res = WriteHeaderChunk(slicer->f, &slicer->fileInfo, stats->numTracks);
+		if ((fclose(slicer->f) != 0) || slicer->error || !slicer->hasHeader)
+			res = 1;
+	}
+
+	free(slicer->events);
+	free(slicer);
+
+	return res;
+}
+
+
+/*
+	Finding the window in seconds only needs the tempo changes before its
+	end, so each track is read only as far as the end tick the changes
+	found so far give. A track read later can add a change that moves the
+	end past where an earlier track was cut, and then the scan is repeated
+	reading every track at least to the new end.
+*/
+typedef struct {
+	TempoMap map;
+	double toSeconds;
+	unsigned long floorTick;	/* every track is read at least this far */
+	unsigned long bound;		/* the current track is read up to here */
+	unsigned long firstUnread;	/* lowest tick a track was cut at */
+} TempoScan;
+
+
+static unsigned long ScanBound(TempoScan* scan)
+{
+	FinishTempoMap(&scan->map);
+
+	unsigned long bound = SecondsToTicks(&scan->map, scan->toSeconds);
+
+	return (bound > scan->floorTick) ? bound : scan->floorTick;
+}
+
+
+static int TempoHeaderVisit(void* user, const FileInfo* fileInfo)
+{
+	return StartTempoMap(&((TempoScan *)user)->map, fileInfo) ? visitStop : visitContinue;
+}
+
+
+static int TempoTrackStartVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	TempoScan* scan = (TempoScan *)user;
+
+	scan->bound = (scan->toSeconds < 0.0) ? ~0UL : ScanBound(scan);
+
+	return visitContinue;
+}
+
+
+static int TempoEventVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	TempoScan* scan = (TempoScan *)user;
+
+	if ((tick > scan->bound) && (tick > (scan->bound = ScanBound(scan)))) {
+		if (tick < scan->firstUnread)
+			scan->firstUnread = tick;
+		return visitSkipTrack;
+	}
+
+	return AddTempoEvent(&scan->map, tick, event) ? visitStop : visitContinue;
+}
+
+
+static const MidiVisitor TempoVisitor = {
+	TempoHeaderVisit,
+	TempoTrackStartVisit,
+	TempoEventVisit,
+	TempoEventVisit,
+	TempoEventVisit,
+	NULL,
+};
+
+
+static int ResolveSecondsWindow(const unsigned char* data, unsigned long size, const SliceWindow* window, unsigned long* fromTick, unsigned long* toTick)
+{
+	TempoScan scan;
+	int res;
+
+	InitTempoMap(&scan.map);
+	scan.toSeconds = window->toSeconds;
+	scan.floorTick = 0;
+
+	for (;;) {
+		scan.firstUnread = ~0UL;
+		scan.map.numChanges = 0;
+		scan.map.secondsPerTick = 0.0;
+
+		res = VisitMidiBuffer(data, size, &TempoVisitor, &scan);
+		if ((res != 0) || (!scan.map.numChanges && (scan.map.secondsPerTick == 0.0))) {
+			res = 1;
+			break;
+		}
+
+		FinishTempoMap(&scan.map);
+		*fromTick = SecondsToTicks(&scan.map, window->fromSeconds);
+		*toTick = (window->toSeconds < 0.0) ? ~0UL : SecondsToTicks(&scan.map, window->toSeconds);
+
+		if (scan.firstUnread >= *toTick)
+			break;
+		scan.floorTick = *toTick;
+	}
+
+	FreeTempoMap(&scan.map);
+
+	return res;
+}
+
+
+/*
+	A window in seconds with toSeconds below 0, or in ticks with toTick
+	of ~0UL, runs to the end of the file.
+*/
+int SliceMidiFile(const char* input, const char* output, const SliceWindow* window, SliceStats* stats)
+{
+	const unsigned char* data;
+	unsigned long size;
+	int inflated;
+	unsigned long fromTick = window->fromTick;
+	unsigned long toTick = window->toTick;
+
+	memset(stats, 0, sizeof(SliceStats));
+
+	if (MapMidiFile(input, &data, &size, &inflated) != 0)
+		return 1;
+
+	if (window->inSeconds && (ResolveSecondsWindow(data, size, window, &fromTick, &toTick) != 0)) {
+		UnmapMidiFile(data, size, inflated);
+		return 1;
+	}
+
+	int res = SliceMidiBuffer(data, size, fromTick, toTick, output, stats);
+	UnmapMidiFile(data, size, inflated);
+
+	return res;
+}
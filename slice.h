@@ -0,0 +1,41 @@
+#ifndef __SLICE_H__
+#define __SLICE_H__
+
+/*
+	Cuts a time window out of a file and writes it as a Standard MIDI
+	File of its own. The input is walked with the visitor decoder, so
+	events before the window are never stored: they only update the state
+	of their track (names, tempo, time and key signature, program,
+	controllers, pitch bend, channel pressure and sounding notes), which
+	is written at the start of the slice. Each track is skipped as soon
+	as it reaches the end of the window, and notes still sounding there
+	are closed. Tracks keep their order and events keep their track.
+
+	Windows given in seconds are turned into ticks with the tempo changes
+	before the window end, which usually takes one extra pass over that
+	part of each track.
+*/
+
+typedef struct {
+	int inSeconds;
+	unsigned long fromTick;
+	unsigned long toTick;		/* exclusive */
+	double fromSeconds;
+	double toSeconds;
+} SliceWindow;
+
+typedef struct {
+	unsigned long fromTick;		/* window actually cut */
+	unsigned long toTick;
+	unsigned int numTracks;
+	unsigned long numSkipped;	/* events before the window, folded into state */
+	unsigned long numCopied;	/* events inside the window */
+	unsigned long numCarried;	/* state events written at the window start */
+	unsigned long numClosed;	/* notes cut off at the window end */
+} SliceStats;
+
+
+int SliceMidiBuffer(const unsigned char* data, unsigned long size, unsigned long fromTick, unsigned long toTick, const char* filename, SliceStats* stats);
+int SliceMidiFile(const char* input, const char* output, const SliceWindow* window, SliceStats* stats);
+
+#endif
@@ -0,0 +1,304 @@
+/*
+	speculative.c :	Intra-track parallel decoding with boundary guessing
+			and a validating stitch pass
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "speculative.h"
+#include "context.h"
+#include "parallel.h"
+
+
+typedef struct {
+	unsigned long begin;		/* byte range this segment is responsible for */
+	unsigned long end;
+	unsigned long start;		/* guessed offset of its first event */
+	unsigned long stop;		/* offset after its last event */
+	unsigned char runningStatus;	/* running status after its last event, 0 if never set */
+	int found;
+	int failed;
+	int ended;			/* decoded the End of track event */
+
+	Event* events;
+	unsigned int numEvents;
+	unsigned int capacity;
+} Segment;
+
+typedef struct {
+	const unsigned char* data;
+	unsigned long length;
+	Segment* segments;
+} SpeculativeJob;
+
+
+static int IsEndOfTrack(const Event* event)
+{
+	return (event->type == 0xFF) && (event->subtype == 0x2F);
+}
+
+
+/*
+	A position looks like an event boundary when a run of events decodes
+	from it without running status and with sane meta types.
+*/
+static int LooksLikeBoundary(const unsigned char* data, unsigned long length, unsigned long offset)
+{
+	unsigned char runningStatus = '\0';
+	Event event;
+
+	for (int i=0; i < SPECULATIVE_RESYNC_EVENTS; i++) {
+		if (offset >= length)
+			return 1;
+
+		unsigned long size = DecodeEvent(data + offset, length - offset, &event, &runningStatus);
+		if (!size)
+			return 0;
+		if ((event.type == 0xFF) && (event.subtype & 0x80))
+			return 0;
+		if (IsEndOfTrack(&event))
+			return 1;
+
+		offset += size;
+	}
+
+	return 1;
+}
+
+
+static int AppendSegmentEvent(Segment* segment, const Event* event)
+{
+	if (segment->numEvents == segment->capacity) {
+		unsigned int capacity = segment->capacity ? segment->capacity * 2 : 4096;
+		Event* grown = (Event *)realloc(segment->events, capacity * sizeof(Event));
+		if (!grown)
+			return 1;
+		segment->events = grown;
+		segment->capacity = capacity;
+	}
+
+	segment->events[segment->numEvents++] = *event;
+
+	return 0;
+}
+
+
+/*
+	Decodes events starting in [segment->start, segment->end) with the
+	given running status.
+*/
+static void DecodeSegment(const unsigned char* data, unsigned long length, Segment* segment, unsigned char runningStatus)
+{
+	unsigned long offset = segment->start;
+	Event event;
+
+	segment->numEvents = 0;
+	segment->failed = 0;
+	segment->ended = 0;
+
+	while ((offset < segment->end) && (offset < length)) {
+		unsigned long size = DecodeEvent(data + offset, length - offset, &event, &runningStatus);
+		if (!size || AppendSegmentEvent(segment, &event)) {
+			segment->failed = 1;
+			break;
+		}
+
+		offset += size;
+		if (IsEndOfTrack(&event)) {
+			segment->ended = 1;
+			break;
+		}
+	}
+
+	segment->stop = offset;
+	segment->runningStatus = runningStatus;
+}
+
+
+static void SpeculateSegment(void* arg, unsigned int index, unsigned int worker)
+{
+	SpeculativeJob* job = (SpeculativeJob *)arg;
+	Segment* segment = &job->segments[index];
+
+	segment->found = 0;
+
+	if (index == 0) {
+		segment->start = 0;
+		segment->found = 1;
+		DecodeSegment(job->data, job->length, segment, '\0');
+		return;
+	}
+
+	/*
+		A false boundary often decodes cleanly for a long way, above all in
+		running status tracks where a shifted stream of data bytes still
+		reads as events, and only fails near the end of the segment. Each
+		guess can cost a whole segment, so after a few the segment is left
+		to the stitch pass, which decodes it sequentially.
+	*/
+	unsigned int numGuesses = 0;
+	for (unsigned long p = segment->begin; (p < segment->end) && (numGuesses < SPECULATIVE_MAX_GUESSES); p++) {
+		if (!LooksLikeBoundary(job->data, job->length, p))
+			continue;
+
+		segment->start = p;
+		numGuesses++;
+		DecodeSegment(job->data, job->length, segment, '\0');
+		if (!segment->failed) {
+			segment->found = 1;
+			break;
+		}
+	}
+}
+
+
+typedef struct {
+	unsigned long offset;
+	unsigned long tick;
+	unsigned char runningStatus;
+	int ended;
+} StitchState;
+
+
+static int AppendEvent(ParserContext* ctx, TrackSpan* span, const Event* event, StitchState* state)
+{
+	if (ReserveEvents(ctx, 1))
+		return 1;
+
+	state->tick += event->time;
+	ctx->events[ctx->numEvents] = *event;
+	ctx->ticks[ctx->numEvents++] = state->tick;
+	span->numEvents++;
+
+	if (IsEndOfTrack(event))
+		state->ended = 1;
+
+	return 0;
+}
+
+
+/*
+	Decodes the true event stream from state->offset for every event
+	starting before limit.
+*/
+static int StitchSequential(ParserContext* ctx, TrackSpan* span, const unsigned char* data, unsigned long length, unsigned long limit, StitchState* state)
+{
+	Event event;
+
+	while ((state->offset < limit) && (state->offset < length) && !state->ended) {
+		unsigned long size = DecodeEvent(data + state->offset, length - state->offset, &event, &state->runningStatus);
+		if (!size) {
+			ctx->error = "Malformed event in track chunk";
+			return 1;
+		}
+
+		state->offset += size;
+		if (AppendEvent(ctx, span, &event, state))
+			return 1;
+	}
+
+	return 0;
+}
+
+
+static int AppendSegment(ParserContext* ctx, TrackSpan* span, Segment* segment, StitchState* state)
+{
+	unsigned int count = segment->numEvents;
+	if (ReserveEvents(ctx, count))
+		return 1;
+
+	/* a segment only holds an End of track as its last event */
+	memcpy(ctx->events + ctx->numEvents, segment->events, (size_t)count * sizeof(Event));
+	unsigned long* ticks = ctx->ticks + ctx->numEvents;
+	for (unsigned int e=0; e < count; e++) {
+		state->tick += segment->events[e].time;
+		ticks[e] = state->tick;
+	}
+
+	ctx->numEvents += count;
+	span->numEvents += count;
+	if (segment->ended)
+		state->ended = 1;
+
+	state->offset = segment->stop;
+	if (segment->runningStatus)
+		state->runningStatus = segment->runningStatus;
+
+	return 0;
+}
+
+
+/*
+	Appends the decoded events of one track to ctx, like the sequential
+	decoder. The caller has already opened the track span.
+*/
+int DecodeTrackSpeculative(ParserContext* ctx, const unsigned char* data, unsigned long length, unsigned int numThreads)
+{
+	unsigned int numSegments = length / SPECULATIVE_SEGMENT_SIZE;
+
+	if (numThreads == 0)
+		numThreads = DefaultThreadCount();
+	if (numSegments > numThreads * 4)
+		numSegments = numThreads * 4;
+	if (numSegments < 1)
+		numSegments = 1;
+
+	SpeculativeJob job;
+	job.data = data;
+	job.length = length;
+	job.segments = (Segment *)calloc(numSegments, sizeof(Segment));
+	if (!job.segments) {
+		ctx->error = "Out of memory";
+		return 1;
+	}
+
+	for (unsigned int i=0; i < numSegments; i++) {
+		job.segments[i].begin = (unsigned long)((unsigned long long)length * i / numSegments);
+		job.segments[i].end = (unsigned long)((unsigned long long)length * (i + 1) / numSegments);
+	}
+
+	ParallelFor(numSegments, numThreads, SpeculateSegment, &job);
+
+	/*
+		Stitch: walk the true boundaries in order. Events between the true
+		end of the previous segment and a segment's guessed start are
+		decoded here; if that lands exactly on the guess, the speculative
+		events are correct, otherwise the segment is decoded again.
+	*/
+	TrackSpan* span = &ctx->tracks[ctx->numTracks - 1];
+	StitchState state;
+	state.offset = 0;
+	state.tick = 0;
+	state.runningStatus = '\0';
+	state.ended = 0;
+	int res = 0;
+
+	for (unsigned int i=0; (i < numSegments) && !state.ended && (res == 0); i++) {
+		Segment* segment = &job.segments[i];
+
+		if (state.offset >= segment->end)
+			continue;	/* the previous segment's last event covered this one */
+
+		ctx->numSpeculativeSegments++;
+
+		if (segment->found && !segment->failed && (segment->start >= state.offset)) {
+			res = StitchSequential(ctx, span, data, length, segment->start, &state);
+			if ((res == 0) && !state.ended && (state.offset == segment->start)) {
+				res = AppendSegment(ctx, span, segment, &state);
+				continue;
+			}
+		}
+
+		if ((res == 0) && !state.ended) {
+			ctx->numRedecodedSegments++;
+			res = StitchSequential(ctx, span, data, length, segment->end, &state);
+		}
+	}
+
+	for (unsigned int i=0; i < numSegments; i++)
+		free(job.segments[i].events);
+	free(job.segments);
+
+	return res;
+}
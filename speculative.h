@@ -0,0 +1,22 @@
+#ifndef __SPECULATIVE_H__
+#define __SPECULATIVE_H__
+
+#include "context.h"
+
+/*
+	Speculative parallel decoding of a single large track. The body is cut
+	into segments, and each segment guesses its first event boundary by
+	looking for a position from which a run of events decodes cleanly, and
+	decodes from there on its own thread. A sequential stitch pass then
+	checks that every guessed start equals the true end of the previous
+	segment, and decodes any segment that guessed wrong again, in order.
+	The result is identical to sequential decoding.
+*/
+
+#define SPECULATIVE_SEGMENT_SIZE (1UL << 20)
+#define SPECULATIVE_RESYNC_EVENTS 64
+#define SPECULATIVE_MAX_GUESSES 2
+
+int DecodeTrackSpeculative(ParserContext* ctx, const unsigned char* data, unsigned long length, unsigned int numThreads);
+
+#endif
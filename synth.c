@@ -0,0 +1,621 @@
+/*
+	synth.c :	Wavetable synthesiser that renders decoded channel events
+			to a WAV file, one thread per channel within each window
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "synth.h"
+#include "tempomap.h"
+#include "parallel.h"
+#include "util.h"
+
+#define NUM_HARMONICS 16
+#define DRUM_CHANNEL 9
+
+#if defined(__GNUC__)
+/* four floats at any float-aligned address; clang and gcc both emit SIMD for these */
+typedef float Float4 __attribute__((vector_size(16), aligned(4), may_alias));
+#endif
+
+
+enum SynthWave {
+	sineWave = 0,
+	triangleWave = 1,
+	sawWave = 2,
+	squareWave = 3,
+	noiseWave = 4,
+};
+
+/* waveform and whether notes die away, by General MIDI family (program / 8) */
+static const unsigned char familyWaves[16] = {
+	triangleWave, sineWave, squareWave, sawWave, triangleWave, sawWave, sawWave, sawWave,
+	squareWave, sineWave, squareWave, triangleWave, sineWave, sawWave, sineWave, sineWave,
+};
+static const unsigned char familyDecays[16] = {1, 1, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1};
+
+typedef struct {
+	unsigned long long frame;
+	unsigned long tick;
+	unsigned int order;		/* index in the context, breaks tick ties */
+	unsigned char status;
+	unsigned char data1;
+	unsigned char data2;
+} SynthEvent;
+
+typedef struct {
+	int active;
+	int attacking;
+	int releasing;
+	int sustained;			/* released while the pedal was down */
+	unsigned char key;
+	unsigned char wave;
+	float velocity;
+	float phase;
+	float increment;		/* table positions per frame, before pitch bend */
+	float level;
+	float attackStep;
+	float decay;			/* level multiplier per frame while held */
+	float releaseStep;
+	unsigned int noise;
+} Voice;
+
+typedef struct {
+	SynthEvent* events;
+	unsigned int numEvents;
+	unsigned int capacity;
+	unsigned int nextEvent;
+
+	Voice voices[SYNTH_MAX_VOICES];
+	unsigned char program;
+	unsigned char volume;
+	unsigned char expression;
+	unsigned char pan;
+	unsigned char sustain;
+	float bendFactor;
+
+	float* left;
+	float* right;
+	float* scratch;
+	int silent;			/* nothing rendered in the current window */
+	unsigned int numNotes;
+	unsigned int numStolen;
+} SynthChannel;
+
+typedef struct {
+	float sampleRate;
+	float tables[4][SYNTH_TABLE_SIZE + 1];	/* last entry repeats the first for interpolation */
+	SynthChannel channels[16];
+	unsigned int active[16];
+	unsigned int numActive;
+	unsigned long long windowStart;
+	unsigned int windowFrames;
+} SynthJob;
+
+
+void InitSynthConfig(SynthConfig* config)
+{
+	memset(config, 0, sizeof(SynthConfig));
+	config->sampleRate = 44100;
+	config->gain = 1.0f;
+	config->tailSeconds = 1.0;
+}
+
+
+/* Band-limited single cycles built from a few harmonics, peak normalised. */
+static void BuildWavetables(SynthJob* job)
+{
+	for (int w=0; w < 4; w++) {
+		float* table = job->tables[w];
+		float peak = 0.0f;
+
+		for (int i=0; i < SYNTH_TABLE_SIZE; i++) {
+			double x = 2.0 * M_PI * i / SYNTH_TABLE_SIZE;
+			double value = 0.0;
+
+			for (int k=1; k <= NUM_HARMONICS; k++) {
+				switch (w) {
+					case sineWave:
+						if (k == 1)
+							value = sin(x);
+						break;
+					case triangleWave:
+						if (k & 1)
+							value += ((k & 2) ? -1.0 : 1.0) * sin(k * x) / (k * k);
+						break;
+					case sawWave:
+						value += sin(k * x) / k;
+						break;
+					case squareWave:
+						if (k & 1)
+							value += sin(k * x) / k;
+						break;
+				}
+			}
+
+			table[i] = (float)value;
+			if (fabsf(table[i]) > peak)
+				peak = fabsf(table[i]);
+		}
+
+		for (int i=0; i < SYNTH_TABLE_SIZE; i++)
+			table[i] /= peak;
+		table[SYNTH_TABLE_SIZE] = table[0];
+	}
+}
+
+
+/* out[i] += in[i] * gain */
+static void AddScaled(float* out, const float* in, float gain, unsigned int count)
+{
+	unsigned int i = 0;
+
+#if defined(__GNUC__)
+	Float4 gains = {gain, gain, gain, gain};
+	for (; i + 4 <= count; i += 4)
+		*(Float4 *)(out + i) += *(const Float4 *)(in + i) * gains;
+#endif
+
+	for (; i < count; i++)
+		out[i] += in[i] * gain;
+}
+
+
+static int AddSynthEvent(SynthChannel* channel, const SynthEvent* event)
+{
+	if (channel->numEvents == channel->capacity) {
+		unsigned int capacity = channel->capacity ? channel->capacity * 2 : 256;
+		SynthEvent* grown = (SynthEvent *)realloc(channel->events, capacity * sizeof(SynthEvent));
+		if (!grown)
+			return 1;
+		channel->events = grown;
+		channel->capacity = capacity;
+	}
+
+	channel->events[channel->numEvents++] = *event;
+
+	return 0;
+}
+
+
+static int CompareSynthEvents(const void* a, const void* b)
+{
+	const SynthEvent* ea = (const SynthEvent *)a;
+	const SynthEvent* eb = (const SynthEvent *)b;
+
+	if (ea->tick != eb->tick)
+		return (ea->tick < eb->tick) ? -1 : 1;
+	if (ea->order != eb->order)
+		return (ea->order < eb->order) ? -1 : 1;
+
+	return 0;
+}
+
+
+static void ReleaseVoice(Voice* voice, float sampleRate)
+{
+	voice->attacking = 0;
+	voice->releasing = 1;
+	voice->sustained = 0;
+	voice->releaseStep = voice->level / (0.08f * sampleRate);
+	if (voice->releaseStep <= 0.0f)
+		voice->active = 0;
+}
+
+
+static void NoteOn(SynthChannel* channel, unsigned int index, unsigned char key, unsigned char velocity, float sampleRate)
+{
+	Voice* voice = NULL;
+
+	for (int v=0; (v < SYNTH_MAX_VOICES) && !voice; v++) {
+		if (!channel->voices[v].active)
+			voice = &channel->voices[v];
+	}
+	if (!voice) {
+		voice = &channel->voices[0];
+		for (int v=1; v < SYNTH_MAX_VOICES; v++) {
+			if (channel->voices[v].level < voice->level)
+				voice = &channel->voices[v];
+		}
+		channel->numStolen++;
+	}
+
+	memset(voice, 0, sizeof(Voice));
+	voice->active = 1;
+	voice->attacking = 1;
+	voice->key = key;
+	voice->velocity = (velocity / 127.0f) * (velocity / 127.0f) * 0.25f;
+	voice->attackStep = 1.0f / (0.005f * sampleRate);
+	voice->decay = 1.0f;
+
+	if (index == DRUM_CHANNEL) {
+		/* low keys are kicks and toms, the rest are noise */
+		voice->wave = key < 48 ? sineWave : noiseWave;
+		voice->increment = (key < 48 ? 45.0f + 3.0f * (key > 35 ? key - 35 : 0) : 0.0f) * SYNTH_TABLE_SIZE / sampleRate;
+		voice->decay = expf(-1.0f / ((key < 48 ? 0.2f : 0.1f) * sampleRate));
+		voice->noise = 0x9E3779B9u ^ (key * 2654435761u);
+	}
+	else {
+		unsigned int family = channel->program >> 3;
+		voice->wave = familyWaves[family];
+		voice->increment = 440.0f * powf(2.0f, (key - 69) / 12.0f) * SYNTH_TABLE_SIZE / sampleRate;
+		if (familyDecays[family])
+			voice->decay = expf(-1.0f / (1.5f * sampleRate));
+	}
+
+	channel->numNotes++;
+}
+
+
+static void NoteOff(SynthChannel* channel, unsigned int index, unsigned char key, float sampleRate)
+{
+	if (index == DRUM_CHANNEL)
+		return;		/* drums always ring out */
+
+	for (int v=0; v < SYNTH_MAX_VOICES; v++) {
+		Voice* voice = &channel->voices[v];
+		if (!voice->active || voice->releasing || voice->sustained || (voice->key != key))
+			continue;
+
+		if (channel->sustain >= 64)
+			voice->sustained = 1;
+		else
+			ReleaseVoice(voice, sampleRate);
+	}
+}
+
+
+static void ApplySynthEvent(SynthChannel* channel, unsigned int index, const SynthEvent* event, float sampleRate)
+{
+	switch (event->status & 0xF0) {
+		case 0x80:
+			NoteOff(channel, index, event->data1, sampleRate);
+			break;
+		case 0x90:
+			if (event->data2 > 0)
+				NoteOn(channel, index, event->data1, event->data2, sampleRate);
+			else
+				NoteOff(channel, index, event->data1, sampleRate);
+			break;
+		case 0xB0:
+			switch (event->data1) {
+				case 7: channel->volume = event->data2; break;
+				case 10: channel->pan = event->data2; break;
+				case 11: channel->expression = event->data2; break;
+				case 64:
+					channel->sustain = event->data2;
+					for (int v=0; (v < SYNTH_MAX_VOICES) && (event->data2 < 64); v++) {
+						if (channel->voices[v].active && channel->voices[v].sustained)
+							ReleaseVoice(&channel->voices[v], sampleRate);
+					}
+					break;
+				case 120:	// All sound off
+					for (int v=0; v < SYNTH_MAX_VOICES; v++)
+						channel->voices[v].active = 0;
+					break;
+				case 121:	// Reset all controllers
+					channel->expression = 127;
+					channel->sustain = 0;
+					channel->bendFactor = 1.0f;
+					break;
+				case 123:	// All notes off
+					for (int v=0; v < SYNTH_MAX_VOICES; v++) {
+						if (channel->voices[v].active && !channel->voices[v].releasing)
+							ReleaseVoice(&channel->voices[v], sampleRate);
+					}
+					break;
+			}
+			break;
+		case 0xC0:
+			channel->program = event->data1;
+			break;
+		case 0xE0: {
+			/* lsb and msb as in PrintPitchBendEvent, centred on 8192, +-2 semitones */
+			int bend = (event->data1 | (event->data2 << 7)) - 8192;
+			channel->bendFactor = powf(2.0f, (bend / 8192.0f) * 2.0f / 12.0f);
+			break;
+		}
+	}
+}
+
+
+static int RenderVoices(SynthJob* job, SynthChannel* channel, unsigned int index, float* out, unsigned int count)
+{
+	int sounding = 0;
+
+	memset(out, 0, count * sizeof(float));
+
+	for (int v=0; v < SYNTH_MAX_VOICES; v++) {
+		Voice* voice = &channel->voices[v];
+		if (!voice->active)
+			continue;
+
+		const float* table = job->tables[voice->wave == noiseWave ? sineWave : voice->wave];
+		float increment = voice->increment * (index == DRUM_CHANNEL ? 1.0f : channel->bendFactor);
+		float phase = voice->phase;
+		float level = voice->level;
+
+		for (unsigned int i=0; i < count; i++) {
+			float sample;
+
+			if (voice->wave == noiseWave) {
+				voice->noise = voice->noise * 1664525u + 1013904223u;
+				sample = (float)(int)voice->noise / 2147483648.0f;
+			}
+			else {
+				unsigned int position = (unsigned int)phase;
+				float frac = phase - position;
+				sample = table[position] + (table[position + 1] - table[position]) * frac;
+				phase += increment;
+				if (phase >= SYNTH_TABLE_SIZE)
+					phase -= SYNTH_TABLE_SIZE;
+			}
+
+			if (voice->attacking) {
+				level += voice->attackStep;
+				if (level >= 1.0f) {
+					level = 1.0f;
+					voice->attacking = 0;
+				}
+			}
+			else if (voice->releasing) {
+				level -= voice->releaseStep;
+				if (level <= 0.0f) {
+					voice->active = 0;
+					break;
+				}
+			}
+			else {
+				level *= voice->decay;
+				if (level < 0.0001f) {
+					voice->active = 0;
+					break;
+				}
+			}
+
+			out[i] += sample * level * voice->velocity;
+		}
+
+		voice->phase = phase;
+		voice->level = level;
+		sounding = 1;
+	}
+
+	return sounding;
+}
+
+
+static void RenderChannelWindow(void* arg, unsigned int index, unsigned int worker)
+{
+	SynthJob* job = (SynthJob *)arg;
+	unsigned int channelIndex = job->active[index];
+	SynthChannel* channel = &job->channels[channelIndex];
+	unsigned long long start = job->windowStart;
+	unsigned int frames = job->windowFrames;
+	unsigned int position = 0;
+
+	memset(channel->left, 0, frames * sizeof(float));
+	memset(channel->right, 0, frames * sizeof(float));
+	channel->silent = 1;
+
+	while (position < frames) {
+		while ((channel->nextEvent < channel->numEvents) && (channel->events[channel->nextEvent].frame <= start + position)) {
+			ApplySynthEvent(channel, channelIndex, &channel->events[channel->nextEvent], job->sampleRate);
+			channel->nextEvent++;
+		}
+
+		unsigned int end = frames;
+		if ((channel->nextEvent < channel->numEvents) && (channel->events[channel->nextEvent].frame < start + frames))
+			end = (unsigned int)(channel->events[channel->nextEvent].frame - start);
+
+		if (RenderVoices(job, channel, channelIndex, channel->scratch, end - position)) {
+			/* squared volume, expression, and constant power pan */
+			float gain = (channel->volume / 127.0f) * (channel->volume / 127.0f) * (channel->expression / 127.0f);
+			float angle = (channel->pan / 127.0f) * (float)M_PI * 0.5f;
+
+			AddScaled(channel->left + position, channel->scratch, gain * cosf(angle), end - position);
+			AddScaled(channel->right + position, channel->scratch, gain * sinf(angle), end - position);
+			channel->silent = 0;
+		}
+
+		position = end;
+	}
+}
+
+
+static void PutSample(unsigned char* out, float value, unsigned int* numClipped)
+{
+	int sample = (int)lrintf(value * 32767.0f);
+
+	if (sample > 32767) {
+		sample = 32767;
+		(*numClipped)++;
+	}
+	else if (sample < -32768) {
+		sample = -32768;
+		(*numClipped)++;
+	}
+
+	out[0] = sample & 0xFF;
+	out[1] = (sample >> 8) & 0xFF;
+}
+
+
+static void WriteWavHeader(FILE* f, unsigned int sampleRate, unsigned long long numFrames)
+{
+	unsigned long long dataSize = numFrames * 4;
+
+	fwrite("RIFF", 1, 4, f);
+	WriteLittleEndian(f, 36 + dataSize, 4);
+	fwrite("WAVEfmt ", 1, 8, f);
+	WriteLittleEndian(f, 16, 4);
+	WriteLittleEndian(f, 1, 2);			/* PCM */
+	WriteLittleEndian(f, 2, 2);			/* stereo */
+	WriteLittleEndian(f, sampleRate, 4);
+	WriteLittleEndian(f, sampleRate * 4, 4);	/* bytes per second */
+	WriteLittleEndian(f, 4, 2);			/* bytes per frame */
+	WriteLittleEndian(f, 16, 2);
+	fwrite("data", 1, 4, f);
+	WriteLittleEndian(f, dataSize, 4);
+}
+
+
+static int CollectSynthEvents(ParserContext* ctx, SynthJob* job, unsigned int sampleRate, unsigned long long* lastFrame)
+{
+	TempoMap map;
+
+	InitTempoMap(&map);
+	if (BuildTempoMap(ctx, &map) != 0) {
+		FreeTempoMap(&map);
+		return 1;
+	}
+
+	*lastFrame = 0;
+
+	for (unsigned int i=0; i < ctx->numEvents; i++) {
+		Event* event = &ctx->events[i];
+		SynthEvent synthEvent;
+
+		if (event->type >= 0xF0)
+			continue;
+
+		synthEvent.tick = ctx->ticks[i];
+		synthEvent.frame = (unsigned long long)(TicksToSeconds(&map, ctx->ticks[i]) * sampleRate + 0.5);
+		synthEvent.order = i;
+		synthEvent.status = event->type;
+		synthEvent.data1 = event->data[0];
+		synthEvent.data2 = (event->size > 1) ? event->data[1] : 0;
+
+		if (AddSynthEvent(&job->channels[event->type & 0x0F], &synthEvent) != 0) {
+			FreeTempoMap(&map);
+			return 1;
+		}
+		if (synthEvent.frame > *lastFrame)
+			*lastFrame = synthEvent.frame;
+	}
+
+	FreeTempoMap(&map);
+
+	/* tracks are merged here, so restore playback order per channel */
+	for (int c=0; c < 16; c++) {
+		SynthChannel* channel = &job->channels[c];
+		if (channel->numEvents)
+			qsort(channel->events, channel->numEvents, sizeof(SynthEvent), CompareSynthEvents);
+	}
+
+	return 0;
+}
+
+
+static void FreeSynthJob(SynthJob* job)
+{
+	for (int c=0; c < 16; c++) {
+		free(job->channels[c].events);
+		free(job->channels[c].left);
+		free(job->channels[c].right);
+		free(job->channels[c].scratch);
+	}
+	free(job);
+}
+
+
+int RenderWavFile(ParserContext* ctx, const SynthConfig* config, const char* filename, SynthStats* stats)
+{
+	SynthJob* job = (SynthJob *)calloc(1, sizeof(SynthJob));
+	unsigned long long lastFrame;
+
+	memset(stats, 0, sizeof(SynthStats));
+
+	if (!job || (config->sampleRate == 0) || (CollectSynthEvents(ctx, job, config->sampleRate, &lastFrame) != 0)) {
+		if (job)
+			FreeSynthJob(job);
+		ctx->error = "Could not prepare events for rendering";
+		return 1;
+	}
+
+	job->sampleRate = (float)config->sampleRate;
+	BuildWavetables(job);
+
+	for (int c=0; c < 16; c++) {
+		SynthChannel* channel = &job->channels[c];
+		if (!channel->numEvents)
+			continue;
+
+		channel->volume = 100;
+		channel->expression = 127;
+		channel->pan = 64;
+		channel->bendFactor = 1.0f;
+		channel->left = (float *)malloc(SYNTH_WINDOW_FRAMES * sizeof(float));
+		channel->right = (float *)malloc(SYNTH_WINDOW_FRAMES * sizeof(float));
+		channel->scratch = (float *)malloc(SYNTH_WINDOW_FRAMES * sizeof(float));
+		if (!channel->left || !channel->right || !channel->scratch) {
+			FreeSynthJob(job);
+			ctx->error = "Out of memory";
+			return 1;
+		}
+		job->active[job->numActive++] = c;
+	}
+
+	unsigned long long numFrames = lastFrame + (unsigned long long)(config->tailSeconds * config->sampleRate) + 1;
+	if (numFrames * 4 > 0xFFFFFFFFULL - 36) {
+		FreeSynthJob(job);
+		ctx->error = "Too long for a WAV file";
+		return 1;
+	}
+
+	FILE* f = fopen(filename, "wb");
+	float* mixLeft = (float *)malloc(SYNTH_WINDOW_FRAMES * sizeof(float));
+	float* mixRight = (float *)malloc(SYNTH_WINDOW_FRAMES * sizeof(float));
+	unsigned char* pcm = (unsigned char *)malloc(SYNTH_WINDOW_FRAMES * 4);
+	int res = (f && mixLeft && mixRight && pcm) ? 0 : 1;
+
+	if (res == 0)
+		WriteWavHeader(f, config->sampleRate, numFrames);
+
+	for (unsigned long long start=0; (res == 0) && (start < numFrames); start += SYNTH_WINDOW_FRAMES) {
+		unsigned int frames = (numFrames - start < SYNTH_WINDOW_FRAMES) ? (unsigned int)(numFrames - start) : SYNTH_WINDOW_FRAMES;
+
+		job->windowStart = start;
+		job->windowFrames = frames;
+		ParallelFor(job->numActive, config->numThreads, RenderChannelWindow, job);
+
+		memset(mixLeft, 0, frames * sizeof(float));
+		memset(mixRight, 0, frames * sizeof(float));
+		for (unsigned int a=0; a < job->numActive; a++) {
+			SynthChannel* channel = &job->channels[job->active[a]];
+			if (channel->silent)
+				continue;
+			AddScaled(mixLeft, channel->left, config->gain, frames);
+			AddScaled(mixRight, channel->right, config->gain, frames);
+		}
+
+		for (unsigned int i=0; i < frames; i++) {
+			PutSample(pcm + 4 * i, mixLeft[i], &stats->numClipped);
+			PutSample(pcm + 4 * i + 2, mixRight[i], &stats->numClipped);
+		}
+
+		if (fwrite(pcm, 4, frames, f) != frames)
+			res = 1;
+	}
+
+	if (f && (fclose(f) != 0))
+		res = 1;
+	if (res != 0)
+		ctx->error = "Could not write WAV file";
+
+	stats->numFrames = numFrames;
+	for (int c=0; c < 16; c++) {
+		stats->numNotes += job->channels[c].numNotes;
+		stats->numStolen += job->channels[c].numStolen;
+	}
+
+	free(pcm);
+	free(mixRight);
+	free(mixLeft);
+	FreeSynthJob(job);
+
+	return res;
+}
@@ -0,0 +1,41 @@
+#ifndef __SYNTH_H__
+#define __SYNTH_H__
+
+#include "context.h"
+
+/*
+	A small software synthesiser for audition previews. Each note plays one
+	wavetable voice whose waveform and envelope follow the General MIDI
+	family of the channel's program; channel 10 plays noise and thump drums.
+	Pitch bend uses the default range of two semitones, and CC 7, 10, 11
+	and 64 set volume, pan, expression and sustain.
+
+	Audio is rendered in windows of SYNTH_WINDOW_FRAMES. Channels do not
+	share any state, so within a window each channel renders on its own
+	thread into its own buffers, and the channels are then mixed down and
+	appended to a 16-bit stereo WAV file.
+*/
+
+#define SYNTH_WINDOW_FRAMES 16384
+#define SYNTH_MAX_VOICES 32
+#define SYNTH_TABLE_SIZE 2048
+
+typedef struct {
+	unsigned int sampleRate;
+	float gain;
+	double tailSeconds;		/* rendered after the last event so notes can release */
+	unsigned int numThreads;	/* 0 for one per CPU */
+} SynthConfig;
+
+typedef struct {
+	unsigned long long numFrames;
+	unsigned int numNotes;
+	unsigned int numStolen;		/* voices taken over while still sounding */
+	unsigned int numClipped;	/* samples limited to the 16-bit range */
+} SynthStats;
+
+
+void InitSynthConfig(SynthConfig* config);
+int RenderWavFile(ParserContext* ctx, const SynthConfig* config, const char* filename, SynthStats* stats);
+
+#endif
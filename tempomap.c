@@ -0,0 +1,161 @@
+#include "tempomap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+#define DEFAULT_MICROS_PER_QUARTER 500000
+
+
+void InitTempoMap(TempoMap* map)
+{
+	memset(map, 0, sizeof(TempoMap));
+}
+
+
+void FreeTempoMap(TempoMap* map)
+{
+	free(map->changes);
+	InitTempoMap(map);
+}
+
+
+static int AddTempoChange(TempoMap* map, unsigned long tick, unsigned long microsPerQuarter)
+{
+	if (map->numChanges == map->capacity) {
+		unsigned int capacity = map->capacity ? map->capacity * 2 : 16;
+		TempoChange* grown = (TempoChange *)realloc(map->changes, capacity * sizeof(TempoChange));
+		if (!grown)
+			return 1;
+		map->changes = grown;
+		map->capacity = capacity;
+	}
+
+	map->changes[map->numChanges].tick = tick;
+	map->changes[map->numChanges].microsPerQuarter = microsPerQuarter;
+	map->numChanges++;
+
+	return 0;
+}
+
+
+/*
+	Maps can also be built while walking a file: StartTempoMap, then
+	AddTempoEvent for every event in any order of tracks, then
+	FinishTempoMap.
+*/
+int StartTempoMap(TempoMap* map, const FileInfo* fileInfo)
+{
+	map->numChanges = 0;
+	map->secondsPerTick = 0.0;
+	map->ticksPerBeat = fileInfo->timeDivision.ticksPerBeat;
+
+	if (fileInfo->timeDivisionType == framesPerSecond) {
+		struct FramesPerSecond fps = fileInfo->timeDivision.framesPerSecond;
+		/* the frame rate is stored as a negative two's complement byte */
+		unsigned int frames = (unsigned char)(-(signed char)(fps.smpteFrames | 0x80));
+		map->secondsPerTick = 1.0 / ((frames ? frames : 30) * (fps.ticksPerFrame ? fps.ticksPerFrame : 1));
+		return 0;
+	}
+
+	if (!map->ticksPerBeat)
+		map->ticksPerBeat = 480;
+
+	return AddTempoChange(map, 0, DEFAULT_MICROS_PER_QUARTER);
+}
+
+
+int AddTempoEvent(TempoMap* map, unsigned long tick, const Event* event)
+{
+	if ((map->secondsPerTick > 0.0) || (event->type != 0xFF) || (event->subtype != 0x51) || (event->size < 3))
+		return 0;
+
+	unsigned long micros = (event->data[0] << 16) | (event->data[1] << 8) | event->data[2];
+
+	return AddTempoChange(map, tick, micros ? micros : DEFAULT_MICROS_PER_QUARTER);
+}
+
+
+void FinishTempoMap(TempoMap* map)
+{
+	if (map->secondsPerTick > 0.0)
+		return;
+
+	/* changes from later tracks may be out of order; keep same-tick changes in file order */
+	for (unsigned int i=1; i < map->numChanges; i++) {
+		TempoChange change = map->changes[i];
+		unsigned int j = i;
+		while ((j > 0) && (map->changes[j - 1].tick > change.tick)) {
+			map->changes[j] = map->changes[j - 1];
+			j--;
+		}
+		map->changes[j] = change;
+	}
+
+	map->changes[0].seconds = 0.0;
+	for (unsigned int i=1; i < map->numChanges; i++) {
+		TempoChange* previous = &map->changes[i - 1];
+		map->changes[i].seconds = previous->seconds +
+			(double)(map->changes[i].tick - previous->tick) * previous->microsPerQuarter / (1000000.0 * map->ticksPerBeat);
+	}
+}
+
+
+int BuildTempoMap(ParserContext* ctx, TempoMap* map)
+{
+	if (StartTempoMap(map, &ctx->fileInfo))
+		return 1;
+
+	for (unsigned int i=0; (map->secondsPerTick == 0.0) && (i < ctx->numEvents); i++) {
+		if (AddTempoEvent(map, ctx->ticks[i], &ctx->events[i]))
+			return 1;
+	}
+
+	FinishTempoMap(map);
+
+	return 0;
+}
+
+
+static unsigned int FindChangeAtTick(const TempoMap* map, unsigned long tick)
+{
+	unsigned int low = 0;
+	unsigned int high = map->numChanges;
+
+	while (high - low > 1) {
+		unsigned int mid = (low + high) / 2;
+		if (map->changes[mid].tick <= tick)
+			low = mid;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+
+double TicksToSeconds(const TempoMap* map, unsigned long tick)
+{
+	if (map->secondsPerTick > 0.0)
+		return tick * map->secondsPerTick;
+
+	const TempoChange* change = &map->changes[FindChangeAtTick(map, tick)];
+
+	return change->seconds + (double)(tick - change->tick) * change->microsPerQuarter / (1000000.0 * map->ticksPerBeat);
+}
+
+
+unsigned long SecondsToTicks(const TempoMap* map, double seconds)
+{
+	if (map->secondsPerTick > 0.0)
+		return (unsigned long)(seconds / map->secondsPerTick);
+
+	unsigned int index = 0;
+	while ((index + 1 < map->numChanges) && (map->changes[index + 1].seconds <= seconds))
+		index++;
+
+	const TempoChange* change = &map->changes[index];
+	double ticks = (seconds - change->seconds) * 1000000.0 * map->ticksPerBeat / change->microsPerQuarter;
+
+	return change->tick + (ticks > 0.0 ? (unsigned long)(ticks + 0.5) : 0);
+}
@@ -0,0 +1,35 @@
+#ifndef __TEMPOMAP_H__
+#define __TEMPOMAP_H__
+
+#include "context.h"
+
+/*
+	Converts between ticks and seconds using every Set tempo event in the
+	file, whichever track it is on. SMPTE-timed files have a fixed rate.
+*/
+
+typedef struct {
+	unsigned long tick;
+	unsigned long microsPerQuarter;
+	double seconds;		/* time at tick */
+} TempoChange;
+
+typedef struct {
+	TempoChange* changes;
+	unsigned int numChanges;
+	unsigned int capacity;
+	double secondsPerTick;	/* for SMPTE time division, 0 otherwise */
+	unsigned short ticksPerBeat;
+} TempoMap;
+
+
+void InitTempoMap(TempoMap* map);
+void FreeTempoMap(TempoMap* map);
+int StartTempoMap(TempoMap* map, const FileInfo* fileInfo);
+int AddTempoEvent(TempoMap* map, unsigned long tick, const Event* event);
+void FinishTempoMap(TempoMap* map);
+int BuildTempoMap(ParserContext* ctx, TempoMap* map);
+double TicksToSeconds(const TempoMap* map, unsigned long tick);
+unsigned long SecondsToTicks(const TempoMap* map, double seconds);
+
+#endif
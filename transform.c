@@ -0,0 +1,297 @@
+/*
+	transform.c :	In-place edits of decoded events for data augmentation:
+			transpose, velocity scale, time stretch, channel remap
+*/
+
+#include <string.h>
+
+#include "transform.h"
+#include "events.h"
+#include "writemidi.h"
+
+
+static unsigned char ClampData(int value, int low)
+{
+	if (value < low)
+		return low;
+	if (value > 127)
+		return 127;
+
+	return (unsigned char)value;
+}
+
+
+static unsigned char TransposeKey(unsigned char key, int semitones)
+{
+	return ClampData((int)key + semitones, 0);
+}
+
+
+static unsigned char ScaleVelocity(unsigned char velocity, float scale)
+{
+	/* velocity 0 means note off, and scaling must not turn a note on into one */
+	if (velocity == 0)
+		return 0;
+
+	return ClampData((int)(velocity * scale + 0.5f), 1);
+}
+
+
+static unsigned char RemapStatus(unsigned char status, const unsigned char channelMap[16])
+{
+	if (status >= 0xF0)
+		return status;
+
+	return (status & 0xF0) | (channelMap[status & 0x0F] & 0x0F);
+}
+
+
+static unsigned long long GreatestCommonDivisor(unsigned long long a, unsigned long long b)
+{
+	while (b) {
+		unsigned long long t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+
+void InitTransformPipeline(TransformPipeline* pipeline)
+{
+	pipeline->numOps = 0;
+
+	for (int i=0; i < 256; i++)
+		pipeline->statusMap[i] = i;
+	for (int i=0; i < 128; i++) {
+		pipeline->keyMap[i] = i;
+		pipeline->velocityMap[i] = i;
+	}
+
+	pipeline->stretchNumerator = 1;
+	pipeline->stretchDenominator = 1;
+}
+
+
+static TransformOp* NewOp(TransformPipeline* pipeline, enum TransformOpType type)
+{
+	if (pipeline->numOps == MAX_TRANSFORM_OPS)
+		return NULL;
+
+	TransformOp* op = &pipeline->ops[pipeline->numOps++];
+	memset(op, 0, sizeof(TransformOp));
+	op->type = type;
+
+	return op;
+}
+
+
+int AddTranspose(TransformPipeline* pipeline, int semitones)
+{
+	TransformOp* op = NewOp(pipeline, transposeOp);
+	if (!op)
+		return 1;
+
+	op->semitones = semitones;
+	for (int i=0; i < 128; i++)
+		pipeline->keyMap[i] = TransposeKey(pipeline->keyMap[i], semitones);
+
+	return 0;
+}
+
+
+int AddVelocityScale(TransformPipeline* pipeline, float scale)
+{
+	TransformOp* op = NewOp(pipeline, velocityScaleOp);
+	if (!op)
+		return 1;
+
+	op->scale = scale;
+	for (int i=0; i < 128; i++)
+		pipeline->velocityMap[i] = ScaleVelocity(pipeline->velocityMap[i], scale);
+
+	return 0;
+}
+
+
+int AddTimeStretch(TransformPipeline* pipeline, unsigned long numerator, unsigned long denominator)
+{
+	if (!numerator || !denominator)
+		return 1;
+
+	TransformOp* op = NewOp(pipeline, timeStretchOp);
+	if (!op)
+		return 1;
+
+	op->numerator = numerator;
+	op->denominator = denominator;
+
+	pipeline->stretchNumerator *= numerator;
+	pipeline->stretchDenominator *= denominator;
+
+	unsigned long long divisor = GreatestCommonDivisor(pipeline->stretchNumerator, pipeline->stretchDenominator);
+	pipeline->stretchNumerator /= divisor;
+	pipeline->stretchDenominator /= divisor;
+
+	return 0;
+}
+
+
+int AddChannelRemap(TransformPipeline* pipeline, const unsigned char channelMap[16])
+{
+	TransformOp* op = NewOp(pipeline, channelRemapOp);
+	if (!op)
+		return 1;
+
+	memcpy(op->channelMap, channelMap, 16);
+	for (int i=0; i < 256; i++)
+		pipeline->statusMap[i] = RemapStatus(pipeline->statusMap[i], channelMap);
+
+	return 0;
+}
+
+
+/*
+	Checks that every stretched tick can be computed without overflow and
+	every stretched delta still fits a variable-length quantity.
+*/
+static int StretchFits(ParserContext* ctx, unsigned long long numerator, unsigned long long denominator)
+{
+	unsigned long long half = denominator / 2;
+	unsigned long long limit = (~0ULL - half) / numerator;
+
+	if ((numerator == 1) && (denominator == 1))
+		return 1;
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		unsigned long* trackTicks = ContextTrackTicks(ctx, t);
+		unsigned long long previous = 0;
+
+		for (unsigned int i=0; i < ctx->tracks[t].numEvents; i++) {
+			if (trackTicks[i] > limit)
+				return 0;
+
+			unsigned long long tick = (trackTicks[i] * numerator + half) / denominator;
+			if ((tick > (unsigned long)~0UL) || (tick - previous > MAX_VARLEN))
+				return 0;
+			previous = tick;
+		}
+	}
+
+	return 1;
+}
+
+
+static void StretchTicks(ParserContext* ctx, unsigned long long numerator, unsigned long long denominator)
+{
+	unsigned long* ticks = ctx->ticks;
+	unsigned long long half = denominator / 2;
+
+	if ((numerator == 1) && (denominator == 1))
+		return;
+
+	for (unsigned int i=0; i < ctx->numEvents; i++) {
+		ticks[i] = (ticks[i] * numerator + half) / denominator;
+	}
+
+	for (unsigned int t=0; t < ctx->numTracks; t++) {
+		Event* events = ContextTrackEvents(ctx, t);
+		unsigned long* trackTicks = ContextTrackTicks(ctx, t);
+		unsigned long previous = 0;
+
+		for (unsigned int i=0; i < ctx->tracks[t].numEvents; i++) {
+			events[i].time = trackTicks[i] - previous;
+			previous = trackTicks[i];
+		}
+	}
+}
+
+
+int ApplyTransforms(ParserContext* ctx, const TransformPipeline* pipeline)
+{
+	const unsigned char* keyMap = pipeline->keyMap;
+	const unsigned char* velocityMap = pipeline->velocityMap;
+	const unsigned char* statusMap = pipeline->statusMap;
+	Event* events = ctx->events;
+
+	if (!StretchFits(ctx, pipeline->stretchNumerator, pipeline->stretchDenominator))
+		return 1;
+
+	for (unsigned int i=0; i < ctx->numEvents; i++) {
+		unsigned char type = events[i].type;
+		unsigned char status = type & 0xF0;
+		unsigned char* data = events[i].data;
+
+		if (type >= 0xF0)
+			continue;
+
+		if (status <= 0xA0) {
+			data[0] = keyMap[data[0]];
+			if (status == 0x90)
+				data[1] = velocityMap[data[1]];
+		}
+		events[i].type = statusMap[type];
+	}
+
+	StretchTicks(ctx, pipeline->stretchNumerator, pipeline->stretchDenominator);
+
+	return 0;
+}
+
+
+/*
+	Applies the ops one at a time to every event, without lookup tables.
+	Gives the same result as ApplyTransforms and exists to check it.
+*/
+int ApplyTransformsReference(ParserContext* ctx, const TransformPipeline* pipeline)
+{
+	unsigned long long numerator = 1;
+	unsigned long long denominator = 1;
+
+	for (unsigned int o=0; o < pipeline->numOps; o++) {
+		if (pipeline->ops[o].type == timeStretchOp) {
+			numerator *= pipeline->ops[o].numerator;
+			denominator *= pipeline->ops[o].denominator;
+		}
+	}
+
+	unsigned long long divisor = GreatestCommonDivisor(numerator, denominator);
+	numerator /= divisor;
+	denominator /= divisor;
+
+	if (!StretchFits(ctx, numerator, denominator))
+		return 1;
+
+	for (unsigned int i=0; i < ctx->numEvents; i++) {
+		Event* event = &ctx->events[i];
+
+		if (event->type >= 0xF0)
+			continue;
+
+		for (unsigned int o=0; o < pipeline->numOps; o++) {
+			const TransformOp* op = &pipeline->ops[o];
+			unsigned char status = event->type & 0xF0;
+
+			switch (op->type) {
+				case transposeOp:
+					if ((status == 0x80) || (status == 0x90) || (status == 0xA0))
+						event->data[0] = TransposeKey(event->data[0], op->semitones);
+					break;
+				case velocityScaleOp:
+					if (status == 0x90)
+						event->data[1] = ScaleVelocity(event->data[1], op->scale);
+					break;
+				case channelRemapOp:
+					event->type = RemapStatus(event->type, op->channelMap);
+					break;
+				case timeStretchOp:
+					break;
+			}
+		}
+	}
+
+	StretchTicks(ctx, numerator, denominator);
+
+	return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+#include "context.h"
+
+/*
+	A TransformPipeline is a chain of simple edits applied in place to the
+	events held by a ParserContext. Data edits are folded into lookup tables
+	when the pipeline is built, so applying any chain costs one table lookup
+	per byte. Meta and sysex events are never touched. Payloads are edited
+	where they lie in the file buffer, so the context must have been parsed
+	from writable memory (ParseMidiFile always is).
+
+	Time stretches multiply exactly and are rounded once, from absolute
+	ticks, so long files do not drift. A stretch that would leave a delta
+	time too long for a Standard MIDI File is refused before any event is
+	edited, and applying returns 1.
+*/
+
+#define MAX_TRANSFORM_OPS 32
+
+enum TransformOpType {
+	transposeOp = 0,
+	velocityScaleOp = 1,
+	timeStretchOp = 2,
+	channelRemapOp = 3,
+};
+
+typedef struct {
+	enum TransformOpType type;
+	int semitones;
+	float scale;
+	unsigned long numerator;
+	unsigned long denominator;
+	unsigned char channelMap[16];
+} TransformOp;
+
+typedef struct {
+	TransformOp ops[MAX_TRANSFORM_OPS];
+	unsigned int numOps;
+
+	unsigned char statusMap[256];
+	unsigned char keyMap[128];
+	unsigned char velocityMap[128];
+	unsigned long long stretchNumerator;
+	unsigned long long stretchDenominator;
+} TransformPipeline;
+
+
+void InitTransformPipeline(TransformPipeline* pipeline);
+int AddTranspose(TransformPipeline* pipeline, int semitones);
+int AddVelocityScale(TransformPipeline* pipeline, float scale);
+int AddTimeStretch(TransformPipeline* pipeline, unsigned long numerator, unsigned long denominator);
+int AddChannelRemap(TransformPipeline* pipeline, const unsigned char channelMap[16]);
+
+int ApplyTransforms(ParserContext* ctx, const TransformPipeline* pipeline);
+int ApplyTransformsReference(ParserContext* ctx, const TransformPipeline* pipeline);
+
+#endif
@@ -28,3 +28,54 @@ void PrintBytes( unsigned char* data, unsigned int numBytes )
 	}
 	printf("\n");
 }
+
+void WriteLittleEndian( FILE* f, unsigned long long value, unsigned int numBytes )
+{
+	unsigned char bytes[8];
+
+	for (unsigned int i=0; i < numBytes; i++) {
+		bytes[i] = (value >> (8 * i)) & 0xFF;
+	}
+
+	fwrite(bytes, 1, numBytes, f);
+}
+
+unsigned long long ReadLittleEndian( const unsigned char* data, unsigned int numBytes )
+{
+	unsigned long long value = 0;
+
+	for (unsigned int i=0; i < numBytes; i++) {
+		value |= (unsigned long long)data[i] << (8 * i);
+	}
+
+	return value;
+}
+
+/* LEB128 varints: seven bits per byte, least significant group first */
+unsigned int PutUVarint( unsigned char* out, unsigned long long value )
+{
+	unsigned int count = 0;
+
+	while (value >= 0x80) {
+		out[count++] = (value & 0x7F) | 0x80;
+		value >>= 7;
+	}
+	out[count++] = value;
+
+	return count;
+}
+
+unsigned int GetUVarint( const unsigned char* data, unsigned long length, unsigned long long* value )
+{
+	unsigned long long result = 0;
+
+	for (unsigned int i=0; (i < length) && (i < 10); i++) {
+		result |= (unsigned long long)(data[i] & 0x7F) << (7 * i);
+		if (!(data[i] & 0x80)) {
+			*value = result;
+			return i + 1;
+		}
+	}
+
+	return 0;
+}
@@ -1,8 +1,14 @@
 #ifndef __UTIL_H__
 #define __UTIL_H__
 
+#include <stdio.h>
+
 void SwapEndianness32( unsigned int *num );
 void SwapEndianness16( unsigned short *num );
 void PrintBytes( unsigned char* data, unsigned int numBytes );
+void WriteLittleEndian( FILE* f, unsigned long long value, unsigned int numBytes );
+unsigned long long ReadLittleEndian( const unsigned char* data, unsigned int numBytes );
+unsigned int PutUVarint( unsigned char* out, unsigned long long value );
+unsigned int GetUVarint( const unsigned char* data, unsigned long length, unsigned long long* value );
 
 #endif
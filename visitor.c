@@ -0,0 +1,255 @@
+/*
+	visitor.c :	Callback decoding with no per-event storage, and the
+			event printer built on top of it
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "visitor.h"
+#include "context.h"
+#include "compressed.h"
+
+
+int DispatchEvent(const MidiVisitor* visitor, void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	VisitEventCallback callback;
+
+	switch (event->type) {
+		case 0xFF:
+			callback = (event->subtype == 0x2F) ? visitor->endOfTrack : visitor->meta;
+			break;
+		case 0xF0:
+		case 0xF7:
+			callback = visitor->sysex;
+			break;
+		default:
+			callback = visitor->channelMessage;
+			break;
+	}
+
+	return callback ? callback(user, track, tick, event) : visitContinue;
+}
+
+
+/*
+	Returns a VisitResult, or -1 if the track is malformed.
+*/
+int VisitTrack(const unsigned char* data, unsigned long length, unsigned int track, const MidiVisitor* visitor, void* user)
+{
+	unsigned long offset = 0;
+	unsigned long tick = 0;
+	unsigned char runningStatus = '\0';
+	Event event;
+
+	if (visitor->trackStart) {
+		int res = visitor->trackStart(user, track, 0, NULL);
+		if (res != visitContinue)
+			return res;
+	}
+
+	while (offset < length) {
+		unsigned long size = DecodeEvent(data + offset, length - offset, &event, &runningStatus);
+		if (!size)
+			return -1;
+
+		offset += size;
+		tick += event.time;
+
+		int res = DispatchEvent(visitor, user, track, tick, &event);
+		if ((event.type == 0xFF) && (event.subtype == 0x2F))
+			return res;	// End of track
+		if (res != visitContinue)
+			return res;
+	}
+
+	/* the track ran out without an End of track event */
+	if (visitor->endOfTrack) {
+		memset(&event, 0, sizeof(Event));
+		event.type = 0xFF;
+		event.subtype = 0x2F;
+		return visitor->endOfTrack(user, track, tick, &event);
+	}
+
+	return visitContinue;
+}
+
+
+/*
+	Returns 0 when the file was walked (or a callback stopped it early)
+	and 1 if it is malformed.
+*/
+int VisitMidiBuffer(const unsigned char* data, unsigned long size, const MidiVisitor* visitor, void* user)
+{
+	unsigned long offset = 0;
+	unsigned int track = 0;
+	int hasHeader = 0;
+
+	while (offset + 8 <= size) {
+		const unsigned char* type = data + offset;
+		unsigned long length =	((unsigned long)data[offset + 4] << 24) |
+					(data[offset + 5] << 16) |
+					(data[offset + 6] << 8) |
+					data[offset + 7];
+
+		if (length > size - offset - 8)
+			return 1;
+
+		const unsigned char* body = data + offset + 8;
+		offset += 8 + length;
+
+		if (memcmp(type, "MThd", 4) == 0) {
+			if (length < 6)
+				return 1;
+
+			FileInfo fileInfo;
+			unsigned short division = (body[4] << 8) | body[5];
+			fileInfo.formatType = (body[0] << 8) | body[1];
+			fileInfo.numTracks = (body[2] << 8) | body[3];
+			fileInfo.timeDivisionType = GetTimeDivisionType(division);
+			fileInfo.timeDivision = GetTimeDivision(division);
+			hasHeader = 1;
+
+			if (visitor->header && (visitor->header(user, &fileInfo) == visitStop))
+				return 0;
+		}
+		else if (memcmp(type, "MTrk", 4) == 0) {
+			if (!hasHeader)
+				return 1;
+
+			int res = VisitTrack(body, length, track++, visitor, user);
+			if (res < 0)
+				return 1;
+			if (res == visitStop)
+				return 0;
+		}
+	}
+
+	return hasHeader ? 0 : 1;
+}
+
+
+/*
+	Maps a file read-only, or inflates it into memory if it is compressed.
+	Pass the same arguments to UnmapMidiFile to release the bytes.
+*/
+int MapMidiFile(const char* filename, const unsigned char** data, unsigned long* size, int* inflated)
+{
+	int fd = open(filename, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0)
+		return 1;
+
+	if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+		close(fd);
+		return 1;
+	}
+
+	void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (mapped == MAP_FAILED)
+		return 1;
+
+	if (DetectCompression((const unsigned char *)mapped, st.st_size) == noCompression) {
+		*data = (const unsigned char *)mapped;
+		*size = st.st_size;
+		*inflated = 0;
+		return 0;
+	}
+
+	unsigned char* bytes = NULL;
+	munmap(mapped, st.st_size);
+
+	if (ReadCompressedFile(filename, &bytes, size) != 0)
+		return 1;
+
+	*data = bytes;
+	*inflated = 1;
+
+	return 0;
+}
+
+
+void UnmapMidiFile(const unsigned char* data, unsigned long size, int inflated)
+{
+	if (inflated)
+		free((void *)data);
+	else
+		munmap((void *)data, size);
+}
+
+
+int VisitMidiFile(const char* filename, const MidiVisitor* visitor, void* user)
+{
+	const unsigned char* data;
+	unsigned long size;
+	int inflated;
+
+	if (MapMidiFile(filename, &data, &size, &inflated) != 0)
+		return 1;
+
+	int res = VisitMidiBuffer(data, size, visitor, user);
+	UnmapMidiFile(data, size, inflated);
+
+	return res;
+}
+
+
+static int PrintHeaderVisit(void* user, const FileInfo* fileInfo)
+{
+	PrintFileInfo((FileInfo *)fileInfo);
+
+	return visitContinue;
+}
+
+
+static int PrintTrackStartVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	printf("Track %u\n", track);
+
+	return visitContinue;
+}
+
+
+static int PrintMidiVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	printf("dTime: %lu\n", event->time);
+	PrintMidiEvent((Event *)event);
+
+	return visitContinue;
+}
+
+
+static int PrintMetaVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	printf("dTime: %lu\n", event->time);
+	PrintMetaEvent((Event *)event);
+
+	return visitContinue;
+}
+
+
+static int PrintSysexVisit(void* user, unsigned int track, unsigned long tick, const Event* event)
+{
+	printf("dTime: %lu\n", event->time);
+	PrintSysexEvent((Event *)event);
+
+	return visitContinue;
+}
+
+
+const MidiVisitor PrintVisitor = {
+	PrintHeaderVisit,
+	PrintTrackStartVisit,
+	PrintMidiVisit,
+	PrintMetaVisit,
+	PrintSysexVisit,
+	PrintMetaVisit,
+};
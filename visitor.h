@@ -0,0 +1,42 @@
+#ifndef __VISITOR_H__
+#define __VISITOR_H__
+
+#include "events.h"
+
+/*
+	Callback decoding. The decoder walks the file and hands every event to
+	the matching callback without storing anything. The Event passed in
+	lives on the decoder's stack and its data points into the caller's
+	buffer; copy whatever must outlive the callback. Callbacks return
+	visitContinue, visitSkipTrack to jump to the next track, or visitStop
+	to end decoding. Any callback may be NULL.
+*/
+
+enum VisitResult {
+	visitContinue = 0,
+	visitStop = 1,
+	visitSkipTrack = 2,
+};
+
+typedef int (*VisitHeaderCallback)(void* user, const FileInfo* fileInfo);
+typedef int (*VisitEventCallback)(void* user, unsigned int track, unsigned long tick, const Event* event);
+
+typedef struct {
+	VisitHeaderCallback header;
+	VisitEventCallback trackStart;	/* event is NULL */
+	VisitEventCallback channelMessage;
+	VisitEventCallback meta;
+	VisitEventCallback sysex;
+	VisitEventCallback endOfTrack;
+} MidiVisitor;
+
+extern const MidiVisitor PrintVisitor;
+
+int DispatchEvent(const MidiVisitor* visitor, void* user, unsigned int track, unsigned long tick, const Event* event);
+int VisitTrack(const unsigned char* data, unsigned long length, unsigned int track, const MidiVisitor* visitor, void* user);
+int VisitMidiBuffer(const unsigned char* data, unsigned long size, const MidiVisitor* visitor, void* user);
+int MapMidiFile(const char* filename, const unsigned char** data, unsigned long* size, int* inflated);
+void UnmapMidiFile(const unsigned char* data, unsigned long size, int inflated);
+int VisitMidiFile(const char* filename, const MidiVisitor* visitor, void* user);
+
+#endif
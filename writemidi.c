@@ -0,0 +1,166 @@
+/*
+	writemidi.c :	Encodes decoded events back into a Standard MIDI File.
+			Channel messages use running status wherever it is
+			allowed, and every track ends with an End of track event.
+*/
+
+#include <stdio.h>
+
+#include "writemidi.h"
+#include "events.h"
+
+
+unsigned int PutVarLen(unsigned char* out, unsigned long value)
+{
+	unsigned char bytes[(sizeof(unsigned long) * 8 + 6) / 7];
+	unsigned int count = 0;
+
+	bytes[count++] = value & 0x7F;
+	while (value >>= 7) {
+		bytes[count++] = (value & 0x7F) | 0x80;
+	}
+
+	for (unsigned int i=0; i < count; i++) {
+		out[i] = bytes[count - 1 - i];
+	}
+
+	return count;
+}
+
+
+static unsigned long Emit(FILE* f, const unsigned char* bytes, unsigned long size)
+{
+	if (f && size)
+		fwrite(bytes, sizeof(unsigned char), size, f);
+
+	return size;
+}
+
+
+/*
+	Writes the body of a track chunk to f, or only measures it when f is
+	NULL. Returns the number of bytes in the body.
+*/
+unsigned long EmitTrackEvents(FILE* f, Event* events, unsigned int numEvents)
+{
+	unsigned char prefix[32];
+	unsigned long total = 0;
+	unsigned char runningStatus = '\0';
+	int ended = 0;
+
+	for (unsigned int i=0; i < numEvents; i++) {
+		Event* event = &events[i];
+		unsigned int prefixSize = PutVarLen(prefix, event->time);
+
+		switch (event->type) {
+			case 0xFF: {
+				prefix[prefixSize++] = 0xFF;
+				prefix[prefixSize++] = event->subtype;
+				prefixSize += PutVarLen(prefix + prefixSize, event->size);
+				runningStatus = '\0';	/* metas and sysex cancel running status */
+				break;
+			}
+			case 0xF0:
+			case 0xF7: {
+				prefix[prefixSize++] = event->type;
+				prefixSize += PutVarLen(prefix + prefixSize, event->size);
+				runningStatus = '\0';
+				break;
+			}
+			default: {
+				if (event->type != runningStatus) {
+					prefix[prefixSize++] = event->type;
+					runningStatus = event->type;
+				}
+				break;
+			}
+		}
+
+		total += Emit(f, prefix, prefixSize);
+		total += Emit(f, event->data, event->size);
+
+		if ((event->type == 0xFF) && (event->subtype == 0x2F)) {
+			ended = 1;
+			break;
+		}
+	}
+
+	if (!ended) {
+		static const unsigned char endOfTrack[4] = {0x00, 0xFF, 0x2F, 0x00};
+		total += Emit(f, endOfTrack, sizeof(endOfTrack));
+	}
+
+	return total;
+}
+
+
+static void PutBigEndian(unsigned char* out, unsigned long value, unsigned int numBytes)
+{
+	for (unsigned int i=0; i < numBytes; i++) {
+		out[i] = (value >> (8 * (numBytes - 1 - i))) & 0xFF;
+	}
+}
+
+
+int WriteHeaderChunk(FILE* f, FileInfo* fileInfo, unsigned short numTracks)
+{
+	unsigned char header[14] = {'M', 'T', 'h', 'd'};
+	unsigned short division;
+
+	if (fileInfo->timeDivisionType == framesPerSecond) {
+		division = 0x8000 |
+			(fileInfo->timeDivision.framesPerSecond.smpteFrames << 8) |
+			fileInfo->timeDivision.framesPerSecond.ticksPerFrame;
+	}
+	else {
+		division = fileInfo->timeDivision.ticksPerBeat;
+	}
+
+	PutBigEndian(header + 4, 6, 4);
+	PutBigEndian(header + 8, fileInfo->formatType, 2);
+	PutBigEndian(header + 10, numTracks, 2);
+	PutBigEndian(header + 12, division, 2);
+
+	return fwrite(header, sizeof(header), 1, f) == 1 ? 0 : 1;
+}
+
+
+int WriteTrackChunk(FILE* f, Event* events, unsigned int numEvents)
+{
+	unsigned char header[8] = {'M', 'T', 'r', 'k'};
+
+	/* longer quantities take five bytes, which no reader accepts */
+	for (unsigned int i=0; i < numEvents; i++) {
+		if ((events[i].time > MAX_VARLEN) || (events[i].size > MAX_VARLEN))
+			return 1;
+	}
+
+	unsigned long length = EmitTrackEvents(NULL, events, numEvents);
+
+	PutBigEndian(header + 4, length, 4);
+	if (fwrite(header, sizeof(header), 1, f) != 1)
+		return 1;
+
+	EmitTrackEvents(f, events, numEvents);
+
+	return ferror(f) ? 1 : 0;
+}
+
+
+int WriteMidiFile(ParserContext* ctx, const char* filename)
+{
+	FILE* f = fopen(filename, "wb");
+	if (!f)
+		return 1;
+
+	int res = WriteHeaderChunk(f, &ctx->fileInfo, ctx->numTracks);
+
+	for (unsigned int i=0; (res == 0) && (i < ctx->numTracks); i++) {
+		res = WriteTrackChunk(f, ContextTrackEvents(ctx, i), ctx->tracks[i].numEvents);
+	}
+
+	if (fclose(f) != 0)
+		res = 1;
+
+	return res;
+}
@@ -0,0 +1,18 @@
+#ifndef __WRITEMIDI_H__
+#define __WRITEMIDI_H__
+
+#include <stdio.h>
+
+#include "events.h"
+#include "context.h"
+
+/* largest delta time or length a variable-length quantity may hold */
+#define MAX_VARLEN 0x0FFFFFFFUL
+
+unsigned int PutVarLen(unsigned char* out, unsigned long value);
+unsigned long EmitTrackEvents(FILE* f, Event* events, unsigned int numEvents);
+int WriteHeaderChunk(FILE* f, FileInfo* fileInfo, unsigned short numTracks);
+int WriteTrackChunk(FILE* f, Event* events, unsigned int numEvents);
+int WriteMidiFile(ParserContext* ctx, const char* filename);
+
+#endif